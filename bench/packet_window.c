@@ -0,0 +1,159 @@
+/**
+ * Microbenchmark of the window of outstanding packets of the client.
+ * For each packet, a buffer is taken and appended to the window,
+ * two packets inside the window are looked up as ACK handling does,
+ * and the oldest packet is deleted once the window is full.
+ * `ring` is `packet_ring` with buffers from `packet_pool`,
+ * `list` is the singly-linked list with a `malloc` per packet
+ * which the ring replaced, kept here to compare with.
+ * Usage: packet_window.x [<window size> <packet size>],
+ * without arguments windows of 7, 64 and 1024 packets of 1400 bytes
+ * and of `UDP_SIZE` are measured. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../common.h"
+#include "../packet_ring.h"
+#include "../packet_pool.h"
+#include "../protocol.h"
+
+/**
+ * the number of packets sent in each measurement */
+#define N_PACKETS 4000000UL
+
+/**
+ * element of the list */
+typedef struct list_node
+{
+    sized_data packet;
+    char acked;
+    struct list_node *next;
+} list_node;
+
+/**
+ * Return the seconds from `start` to `end`. */
+static double get_duration( struct timespec *start, struct timespec *end )
+{
+    return end->tv_sec - start->tv_sec
+        + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Return the time per packet in nanoseconds with the list. */
+static double run_list( unsigned long window_size, size_t packet_size )
+{
+    list_node *head = NULL;
+    list_node **tail = &head;
+    unsigned long size = 0;
+    unsigned long i;
+    unsigned long sink = 0;
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for( i = 0; i < N_PACKETS; i++ )
+    {
+        list_node *node = malloc_check(sizeof(list_node));
+        node->packet = malloc_sized_check(packet_size);
+        ((char *)node->packet.data)[0] = 1;
+        node->acked = 0;
+        node->next = NULL;
+        *tail = node;
+        tail = &node->next;
+        size++;
+        if( size > window_size )
+        {
+            unsigned long j;
+            list_node *node1 = head;
+            for( j = 0; j < size / 2; j++ ) node1 = node1->next;
+            sink += node1->acked;
+            for( ; j < size - 1; j++ ) node1 = node1->next;
+            sink += node1->acked;
+            node1 = head;
+            head = head->next;
+            free(node1->packet.data);
+            free(node1);
+            size--;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    while( head != NULL )
+    {
+        list_node *node1 = head->next;
+        free(head->packet.data);
+        free(head);
+        head = node1;
+    }
+    if( sink != 0 ) printf("Acknowledged packets were found.\n");
+    return get_duration(&start, &end) * 1e9 / N_PACKETS;
+}
+
+/**
+ * Return the time per packet in nanoseconds with the ring and the pool. */
+static double run_ring( unsigned long window_size, size_t packet_size )
+{
+    packet_ring *ring = packet_ring_new(window_size + 1);
+    packet_pool *pool = packet_pool_new(packet_size);
+    unsigned long i;
+    unsigned long sink = 0;
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for( i = 0; i < N_PACKETS; i++ )
+    {
+        packet_ring_el *el = packet_ring_insert_last(ring);
+        el->packet.head = packet_pool_get(pool);
+        ((char *)el->packet.head.data)[0] = 1;
+        el->acked = 0;
+        if( ring->size > window_size )
+        {
+            sink += packet_ring_get(ring, ring->size / 2)->acked;
+            sink += packet_ring_get(ring, ring->size - 1)->acked;
+            packet_pool_put(pool,
+                            packet_ring_get(ring, 0)->packet.head.data);
+            packet_ring_delete_first(ring);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    packet_pool_free(pool);
+    packet_ring_free(ring);
+    if( sink != 0 ) printf("Acknowledged packets were found.\n");
+    return get_duration(&start, &end) * 1e9 / N_PACKETS;
+}
+
+/**
+ * Measure and print both windows for one window and packet size. */
+static void measure( unsigned long window_size, size_t packet_size )
+{
+    double list_time = run_list(window_size, packet_size);
+    double ring_time = run_ring(window_size, packet_size);
+    printf("window %5lu, %5lu B: list %8.1f ns, ring %6.1f ns per packet\n",
+           window_size, (unsigned long)packet_size, list_time, ring_time);
+}
+
+int main( int argc, char *argv[] )
+{
+    static const unsigned long window_sizes[] = { 7, 64, 1024 };
+    static const size_t packet_sizes[] = { 1400, UDP_SIZE };
+    unsigned int i;
+    unsigned int j;
+    if( argc == 3 )
+    {
+        measure(strtoul(argv[1], NULL, 10), strtoul(argv[2], NULL, 10));
+        return 0;
+    }
+    if( argc != 1 )
+    {
+        printf("Expected 0 or 2 command-line arguments.\n");
+        return 1;
+    }
+    for( i = 0; i < sizeof(window_sizes) / sizeof(window_sizes[0]); i++ )
+    {
+        for( j = 0; j < sizeof(packet_sizes) / sizeof(packet_sizes[0]); j++ )
+        {
+            measure(window_sizes[i], packet_sizes[j]);
+        }
+    }
+    return 0;
+}
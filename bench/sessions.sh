@@ -0,0 +1,68 @@
+#!/bin/sh
+# Stress test of concurrent sessions on loopback.
+# Starts a server that exits after N sessions and N clients at once,
+# each sending the files of LIST, then prints the wall time,
+# the data packets per second sent by all clients and whether
+# every session ended with a correct match line for every file.
+# Usage, from the repository after `make`:
+#   bench/sessions.sh PORT N LOSS "CLIENT OPTIONS" "SERVER OPTIONS" [LIST] [DIR]
+# For example, 16 selective repeat clients against 1 to 4 receive threads:
+#   bench/sessions.sh 5000 16 0 "-s -w 32" "-t 1"
+#   bench/sessions.sh 5000 16 0 "-s -w 32" "-t 4"
+# and 64 clients at 5% loss:
+#   bench/sessions.sh 5000 64 0.05 "-s -w 64" ""
+# LIST defaults to list_of_filenames.txt and DIR to big_set.
+# Each client sends LIST REPEAT times, 40 by default, which makes
+# the 1920 files per client of the measurements in the history.
+
+PORT=$1
+N=$2
+LOSS=$3
+CLIENT_OPTIONS=$4
+SERVER_OPTIONS=$5
+LIST=${6:-list_of_filenames.txt}
+DIR=${7:-big_set}
+REPEAT=${REPEAT:-40}
+OUT=${TMPDIR:-/tmp}/sessions.$$
+mkdir -p "$OUT" || exit 1
+i=0
+while [ $i -lt "$REPEAT" ]; do
+    cat "$LIST"
+    i=$((i + 1))
+done > "$OUT/list.txt"
+
+./server.x -n "$N" $SERVER_OPTIONS "$PORT" "$DIR" "$OUT/matches.txt" \
+    > "$OUT/server.log" 2>&1 &
+SERVER=$!
+sleep 1
+
+START=$(date +%s.%N)
+PIDS=
+i=0
+while [ $i -lt "$N" ]; do
+    ./client.x $CLIENT_OPTIONS 127.0.0.1 "$PORT" "$OUT/list.txt" "$LOSS" \
+        > "$OUT/client.$i.log" 2>&1 &
+    PIDS="$PIDS $!"
+    i=$((i + 1))
+done
+FAILED=0
+for PID in $PIDS; do
+    wait "$PID" || FAILED=$((FAILED + 1))
+done
+END=$(date +%s.%N)
+wait $SERVER
+SERVER_STATUS=$?
+
+PACKETS=$(cat "$OUT"/client.*.log | grep -c "ending a data packet")
+LINES=$(wc -l < "$OUT/matches.txt")
+BAD=$(awk '$1 != $2' "$OUT/matches.txt" | wc -l)
+awk -v start="$START" -v end="$END" -v packets="$PACKETS" \
+    -v n="$N" -v failed="$FAILED" -v server="$SERVER_STATUS" \
+    -v lines="$LINES" -v bad="$BAD" 'BEGIN {
+    printf "%d clients, %d failed, server status %d: %.2f s, ", \
+        n, failed, server, end - start
+    printf "%.0f packets/s, %d match lines, %d wrong\n", \
+        packets / (end - start), lines, bad
+}'
+grep "Sessions:" "$OUT/server.log"
+rm -r "$OUT"
@@ -6,18 +6,79 @@
 #include <sys/socket.h>
 #include <libgen.h>
 #include <time.h>
-#include <sys/select.h>
+#include <unistd.h>
+#include <limits.h>
 
 #include "send_packet.h"
 #include "common.h"
 #include "protocol.h"
-#include "packet_list.h"
-
-#define ACK_TIMEOUT 5 /* seconds */
+#include "packet_ring.h"
+#include "packet_pool.h"
+#include "file_map.h"
+#include "packet_batch.h"
+#include "rto.h"
+#include "timer_heap.h"
+#include "congestion.h"
+#include "event_loop.h"
+#include "prefetch.h"
+#include "file_ring.h"
 
 /* CLOCK_MONOTONIC does not require a system call */
 #define CLOCK CLOCK_MONOTONIC
 
+/* as in TCP, a single reordered packet does not trigger a retransmission */
+#define DEFAULT_DUP_ACK_THRESHOLD 3
+
+/* the greatest number of data packets sent at once when pacing fell behind,
+ * since waking up for each packet costs more than sending it */
+#define PACING_MAX_BURST 16
+
+/**
+ * Session parameters chosen on the command line. */
+typedef struct
+{
+    /* use selective repeat instead of Go-Back-N */
+    int selective;
+
+    /* the greatest number of outstanding data packets */
+    unsigned int window_size;
+
+    /* the greatest size of data packets, bigger files are fragmented */
+    size_t packet_size;
+
+    /* pack several small files into one data packet */
+    int batch;
+
+    /* the number of duplicate ACK packets in a row
+     * after which a packet is resent without waiting for its timer,
+     * or `0` to wait for timers only */
+    unsigned int dup_ack_threshold;
+
+    /* limit the outstanding data packets by a congestion window
+     * and pace new data packets over the RTT */
+    int congestion_control;
+
+    /* written into all packets, chosen at random */
+    unsigned int session_id;
+
+    /* the greatest size of data packets read ahead by a thread, in bytes,
+     * or `0` to read the files when their packets are sent */
+    size_t prefetch_budget;
+
+    /* send file data from files mapped into memory
+     * instead of copying it into packets */
+    int zero_copy;
+
+    /* send data packets of one size as one buffer, which the system splits
+     * (`UDP_OFFLOAD_SEGMENT`), cleared if the system does not support it */
+    int segment;
+
+    /* Unless negative, data packets are not bigger than fits
+     * a datagram of this MTU, so IP does not fragment them.
+     * `0` to use the MTU of the path to the server. */
+    long mtu;
+} session_config;
+
 /**
  * Iterator over files in a textual list. */
 typedef struct
@@ -53,11 +114,34 @@ struct timespec time_subtract( struct timespec x, struct timespec y )
     return r;
 }
 
-struct timeval timespec_to_timeval( struct timespec x )
+/**
+ * Return whether `x` is earlier than `y`. */
+int time_less( struct timespec x, struct timespec y )
+{
+    return x.tv_sec < y.tv_sec
+        || (x.tv_sec == y.tv_sec && x.tv_nsec < y.tv_nsec);
+}
+
+int time_equal( struct timespec x, struct timespec y )
+{
+    return x.tv_sec == y.tv_sec && x.tv_nsec == y.tv_nsec;
+}
+
+double timespec_to_seconds( struct timespec x )
+{
+    return x.tv_sec + x.tv_nsec / 1e9;
+}
+
+struct timespec seconds_to_timespec( double x )
 {
-    struct timeval r;
-    r.tv_sec = x.tv_sec;
-    r.tv_usec = x.tv_nsec / 1000;
+    struct timespec r;
+    r.tv_sec = (time_t)x;
+    r.tv_nsec = (long)((x - r.tv_sec) * 1e9);
+    if( r.tv_nsec >= 1000000000 )
+    {
+        r.tv_sec++;
+        r.tv_nsec -= 1000000000;
+    }
     return r;
 }
 
@@ -120,57 +204,402 @@ int file_iter_next( file_iter *iter, sized_data file_name )
 
 
 /**
- * Return a new data packet containing the contents of the file
- * named `file_name` and its base name.
- * `req_n` and `seq_n` are the values of the corresponding packet fields.
- * If an error happened, the `data` field of the result will be `NULL`. */
-sized_data new_packet_from_file( char *file_name, int req_n, seq_n_t seq_n )
+ * Source of data packets, reads the files listed by a file iterator.
+ * A file too big for one packet is split into fragments.
+ * The files are stat-ed and read in batches through `file_ring`,
+ * files not fitting into the budget of a batch are read in parts.
+ * In the zero-copy mode, the files are mapped into memory instead,
+ * and the packets of a fragment refer to the mapping.
+ */
+
+typedef struct
 {
-    char *base_file_name = basename(file_name);
+    file_iter *iter;
+
+    /* the greatest size of data packets */
+    size_t packet_size;
 
-    /* including `'\0'`*/
-    size_t base_file_name_size = strlen(base_file_name) + 1;
+    /* of buffers for the data packets, or their headers if they are sent
+     * from mappings */
+    packet_pool *pool;
+
+    /* pack several small files into one data packet */
+    int batch;
+
+    /* map the files instead of reading them */
+    int zero_copy;
+
+    /* the `req_n` of the current file */
+    int req_n;
+
+    /* `NULL` if the files are read with blocking calls */
+    file_ring *ring;
+
+    /* the next files of the list, `loads[next_load]` is the next one,
+     * their names are in `load_file_names` */
+    file_load loads[FILE_RING_DEPTH];
+    char *load_file_names;
+    unsigned int n_loads;
+    unsigned int next_load;
+
+    /* the current file, if `is_open`, read into `data` in its batch
+     * or mapped into `map`, which `data` then refers to,
+     * or read from `stream` if `data.data` is `NULL` */
+    int is_open;
+    char *file_name;
+    sized_data base_file_name;
+    size_t base_file_name_size; /* including `'\0'` */
+    sized_data data;
+    file_map *map;
+    FILE *stream;
+    unsigned long file_size;
+    unsigned long offset; /* of the next fragment */
+} packet_source;
 
-    size_t file_size = get_file_size(file_name);
-    size_t packet_size = get_data_packet_size(base_file_name_size, file_size);
-    sized_data r;
-    if( packet_size > UDP_SIZE )
+/**
+ * Return a new packet source reading the files listed by `iter`
+ * into data packets of no more than `packet_size` bytes
+ * in the buffers of `pool`,
+ * which are batch data packets if `batch` is non-zero.
+ * If `zero_copy` is non-zero, fragments are sent from mappings of the files
+ * and the buffers need only hold the headers of data packets. */
+packet_source *packet_source_new( file_iter *iter, packet_pool *pool,
+                                  size_t packet_size, int batch,
+                                  int zero_copy )
+{
+    packet_source *r = malloc_check(sizeof(packet_source));
+    unsigned int i;
+    r->iter = iter;
+    r->packet_size = packet_size;
+    r->pool = pool;
+    r->batch = batch;
+    r->zero_copy = zero_copy;
+    r->req_n = 0;
+    r->ring = file_ring_new();
+    r->load_file_names = malloc_check(FILE_RING_DEPTH * FILE_NAME_SIZE);
+    for( i = 0; i < FILE_RING_DEPTH; i++ )
     {
-        printf("File size and file name are too big: %s\n", file_name);
-        r.size = 0;
-        r.data = NULL;
-        return r;
+        r->loads[i].file_name = r->load_file_names + i * FILE_NAME_SIZE;
     }
-    else
+    r->n_loads = 0;
+    r->next_load = 0;
+    r->is_open = 0;
+    r->base_file_name = malloc_sized_check(FILE_NAME_SIZE);
+    r->data.data = NULL;
+    r->map = NULL;
+    r->stream = NULL;
+    return r;
+}
+
+void packet_source_free( packet_source *source )
+{
+    if( source->stream != NULL ) fclose(source->stream);
+    if( source->map != NULL ) file_map_release(source->map);
+    else free(source->data.data);
+    for( ; source->next_load < source->n_loads; source->next_load++ )
+    {
+        free(source->loads[source->next_load].data.data);
+    }
+    if( source->ring != NULL ) file_ring_free(source->ring);
+    free(source->load_file_names);
+    free(source->base_file_name.data);
+    free(source);
+}
+
+/**
+ * Take the next batch of files from the list,
+ * stat them and read those fitting into `FILE_RING_BATCH_BUDGET`,
+ * in the zero-copy mode only the empty ones, which cannot be mapped.
+ * Return the number of files, `0` if there are no more. */
+unsigned int packet_source_load( packet_source *source )
+{
+    unsigned long n_bytes = 0;
+    unsigned int i;
+    source->n_loads = 0;
+    source->next_load = 0;
+    while( source->n_loads < FILE_RING_DEPTH )
     {
-        sized_data packet = malloc_sized_check(packet_size);
+        sized_data file_name;
+        file_name.data = source->loads[source->n_loads].file_name;
+        file_name.size = FILE_NAME_SIZE;
+        if( file_iter_next(source->iter, file_name) != 0 ) break;
+        source->n_loads++;
+    }
+    file_ring_stat(source->ring, source->loads, source->n_loads);
+    for( i = 0; i < source->n_loads; i++ )
+    {
+        file_load *load = &source->loads[i];
+        if( load->file_size >= 0
+            && n_bytes + load->file_size <= FILE_RING_BATCH_BUDGET
+            && (!source->zero_copy || load->file_size == 0) )
+        {
+            load->read = 1;
+            n_bytes += load->file_size;
+        }
+    }
+    file_ring_read(source->ring, source->loads, source->n_loads);
+    return source->n_loads;
+}
+
+/**
+ * Open the next file in the list which can be read,
+ * skipping the others.
+ * Return `0` if there is such a file, otherwise a non-zero number. */
+int packet_source_open_next( packet_source *source )
+{
+    while( source->next_load < source->n_loads
+           || packet_source_load(source) != 0 )
+    {
+        file_load *load = &source->loads[source->next_load++];
+        char *file_name = load->file_name;
+        char *base_name;
+
+        /* `basename` may modify its argument and returns a part of it */
+        strcpy(source->base_file_name.data, file_name);
+        base_name = basename(source->base_file_name.data);
+        source->base_file_name_size = strlen(base_name) + 1;
+        memmove(source->base_file_name.data, base_name,
+                source->base_file_name_size);
+
+        /* not a regular file or reading it failed, already reported */
+        if( load->file_size < 0 || (load->read && load->data.data == NULL) )
+        {
+            continue;
+        }
+        if( get_data_packet_data_size(source->packet_size,
+                                      source->base_file_name_size) == 0 )
+        {
+            printf("File name is too big: %s\n", file_name);
+            free(load->data.data);
+            continue;
+        }
+
+        if( !load->read && source->zero_copy )
+        {
+            source->map = file_map_open(file_name, load->file_size);
+            if( source->map == NULL ) continue;
+            load->data = source->map->data;
+        }
+        /* the file was not read in its batch */
+        else if( !load->read )
+        {
+            source->stream = fopen(file_name, "rb");
+            if( source->stream == NULL )
+            {
+                perror("packet_source_open_next");
+                print_accessed_path(file_name);
+                continue;
+            }
+        }
+        source->is_open = 1;
+        source->file_name = file_name;
+        source->data = load->data;
+        source->file_size = load->file_size;
+        source->offset = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void packet_source_close( packet_source *source )
+{
+    if( source->stream != NULL ) fclose(source->stream);
+    source->stream = NULL;
+    /* the packets sent from the mapping still hold it */
+    if( source->map != NULL ) file_map_release(source->map);
+    else free(source->data.data);
+    source->map = NULL;
+    source->data.data = NULL;
+    source->is_open = 0;
+    source->req_n++;
+}
+
+/**
+ * Transfer the data of the current file at `offset` to `buffer`,
+ * but no more than the buffer size.
+ * Return the number of transferred bytes
+ * or a negative number if an error happened. */
+ssize_t packet_source_read( packet_source *source, sized_data buffer )
+{
+    size_t size;
+    if( source->data.data == NULL )
+    {
+        return read_stream_all(buffer, source->stream);
+    }
+    size = source->data.size - source->offset;
+    if( size > buffer.size ) size = buffer.size;
+    memcpy(buffer.data, (char *)source->data.data + source->offset, size);
+    return size;
+}
+
+/**
+ * Write a new batch data packet containing as many whole files
+ * as fit into it into `*packet`, starting with the current file,
+ * in a buffer taken from the pool.
+ * `seq_n` is the value of the corresponding packet field.
+ * Return `0` if there is such a packet,
+ * or a non-zero number if the current file does not fit
+ * or no file could be read. */
+int packet_source_next_batch( packet_source *source, seq_n_t seq_n,
+                              sized_data *packet )
+{
+    sized_data buffer = packet_pool_get(source->pool);
+    prot_header *prot_h = buffer.data;
+    size_t empty_size = init_batch_packet(buffer, seq_n);
+    while( source->is_open || packet_source_open_next(source) == 0 )
+    {
+        size_t packet_size = prot_h->size;
+        packet_payload_p record = add_batch_packet_record(
+            buffer, source->req_n, source->base_file_name_size,
+            source->file_size);
+        if( record.error != 0 ) break;
+
+        memcpy(record.file_name.data, source->base_file_name.data,
+               source->base_file_name_size);
+        if( packet_source_read(source, record.data)
+            != (ssize_t)record.data.size )
+        {
+            printf("Read less data than expected from file %s\n",
+                   source->file_name);
+            /* take the record back */
+            prot_h->size = packet_size;
+        }
+        packet_source_close(source);
+    }
+
+    if( prot_h->size == empty_size )
+    {
+        packet_pool_put(source->pool, buffer.data);
+        return 1;
+    }
+    buffer.size = prot_h->size;
+    *packet = buffer;
+    return 0;
+}
+
+/**
+ * Write a new data packet containing the next fragment of the current file
+ * into `*packet`, in a buffer taken from the pool,
+ * moving to the next file in the list if needed.
+ * The fragment of a mapped file is not copied, the packet refers to it.
+ * In the batch mode, small files are packed together instead.
+ * `seq_n` is the value of the corresponding packet field.
+ * Return `0` if there is such a packet,
+ * or a non-zero number if there are no more files. */
+int packet_source_next( packet_source *source, seq_n_t seq_n,
+                        mapped_packet *packet )
+{
+    packet->payload.size = 0;
+    packet->payload.data = NULL;
+    packet->map = NULL;
+    while( 1 )
+    {
+        size_t data_size;
         sized_data packet_data;
-        init_data_packet(packet, req_n, seq_n,
-                         base_file_name_size, file_size);
-        memcpy(get_packet_file_name_p(packet.data),
-               base_file_name, base_file_name_size);
-        packet_data.size = file_size;
-        packet_data.data = get_packet_data_p(packet.data, base_file_name_size);
-        if( read_file_all(packet_data, file_name) != 0 )
+        if( !source->is_open && packet_source_open_next(source) != 0 )
+        {
+            return 1;
+        }
+        if( source->batch && source->offset == 0 )
+        {
+            if( packet_source_next_batch(source, seq_n, &packet->head) == 0 )
+            {
+                return 0;
+            }
+            /* all files were unreadable */
+            if( !source->is_open ) continue;
+        }
+
+        data_size = get_data_packet_data_size(source->packet_size,
+                                              source->base_file_name_size);
+        if( data_size > source->file_size - source->offset )
         {
-            free(packet.data);
-            r.size = 0;
-            r.data = NULL;
-            return r;
+            data_size = source->file_size - source->offset;
         }
-        return packet;
+        packet->head = packet_pool_get(source->pool);
+        if( source->map != NULL )
+        {
+            packet->head.size =
+                get_data_packet_size(source->base_file_name_size, 0);
+            init_data_packet_head(packet->head, source->req_n, seq_n,
+                                  source->base_file_name_size, data_size,
+                                  source->file_size, source->offset);
+            memcpy(get_packet_file_name_p(packet->head.data),
+                   source->base_file_name.data,
+                   source->base_file_name_size);
+            packet->payload.size = data_size;
+            packet->payload.data =
+                (char *)source->map->data.data + source->offset;
+            packet->map = source->map;
+            file_map_hold(source->map);
+        }
+        else
+        {
+            packet->head.size =
+                get_data_packet_size(source->base_file_name_size, data_size);
+            init_data_packet(packet->head, source->req_n, seq_n,
+                             source->base_file_name_size, data_size,
+                             source->file_size, source->offset);
+            memcpy(get_packet_file_name_p(packet->head.data),
+                   source->base_file_name.data,
+                   source->base_file_name_size);
+
+            /* read the fragment straight into the packet */
+            packet_data.size = data_size;
+            packet_data.data = get_packet_data_p(
+                packet->head.data, source->base_file_name_size);
+            if( packet_source_read(source, packet_data)
+                != (ssize_t)data_size )
+            {
+                printf("Read less data than expected from file %s\n",
+                       source->file_name);
+                packet_pool_put(source->pool, packet->head.data);
+                packet_source_close(source);
+                continue;
+            }
+        }
+
+        source->offset += data_size;
+        if( source->offset == source->file_size ) packet_source_close(source);
+        return 0;
     }
 }
 
+/**
+ * Give back the buffer of `packet`, made by `source`, to the pool
+ * and release its mapping. */
+void packet_source_put( packet_source *source, mapped_packet packet )
+{
+    packet_pool_put(source->pool, packet.head.data);
+    if( packet.map != NULL ) file_map_release(packet.map);
+}
+
+/**
+ * `prefetch_produce` of a packet source,
+ * `seq_n` is written when the packet is sent. */
+int produce_packet( void *source, mapped_packet *packet )
+{
+    return packet_source_next(source, 0, packet);
+}
+
+/**
+ * `prefetch_discard` of a packet source. */
+void discard_packet( void *source, mapped_packet packet )
+{
+    packet_source_put(source, packet);
+}
+
 /**
  * If an error happened, return a non-zero number. */
 int send_eot_packet( int udp_socket,
                      struct sockaddr *remote_address,
-                     socklen_t remote_address_length )
+                     socklen_t remote_address_length,
+                     unsigned int session_id )
 {
     int error = 0;
     sized_data packet = malloc_sized_check(get_eot_packet_size());
     init_eot_packet(packet);
+    set_packet_session_id(packet.data, session_id);
     printf("Sending a EOT packet.\n");
     if ( send_packet(udp_socket, packet.data, packet.size, 0,
                      remote_address, remote_address_length) < 0 )
@@ -183,144 +612,747 @@ int send_eot_packet( int udp_socket,
 }
 
 /**
+ * State of a session with the server. */
+typedef struct
+{
+    session_config *config;
+    int udp_socket;
+    struct sockaddr *remote_address;
+    socklen_t remote_address_length;
+
+    /* the last reading of the clock */
+    struct timespec current_time;
+
+    /* data packets sent and not acknowledged yet,
+     * in buffers of `pool` given back when acknowledged */
+    packet_ring *packet_ring0;
+    packet_pool *pool;
+
+    /* `seq_n` of the head of `packet_ring0` */
+    seq_n_t ring_seq_n;
+
+    /* one timer per transmission of a data packet */
+    timer_heap *timers;
+
+    rto_estimator estimator;
+
+    /* used if `config->congestion_control` */
+    congestion_control congestion;
+
+    /* the earliest time the next new data packet may be sent, for pacing */
+    struct timespec next_send_time;
+
+    /* the number of duplicate ACK packets received in a row,
+     * which do not acknowledge the head of `packet_ring0` */
+    unsigned int n_dup_acks;
+
+    /* the number of packets resent on duplicate ACK packets */
+    unsigned long n_fast_retransmits;
+
+    /* data packets to be sent with one system call */
+    packet_batch *sent;
+
+    /* ACK packets received with one system call */
+    packet_batch *received;
+
+    /* new data packets */
+    packet_source *source;
+
+    /* reads `source` ahead in a thread, `NULL` if it is read when sending */
+    prefetch *prefetch0;
+
+    /* waits for ACK packets in `udp_socket`, for `deadline_timer`,
+     * armed for the earliest retransmission or pacing deadline,
+     * and for the read-ahead when it had no packet ready */
+    event_loop *loop;
+    event_source socket_source;
+    event_source deadline_timer;
+    event_source prefetch_source;
+} client_session;
+
+/**
+ * Start the retransmission timer of `el`
+ * to expire after its `send_time` by the current timeout. */
+void start_timer( client_session *session, packet_ring_el *el )
+{
+    timer_heap_el timer;
+    double timeout = rto_estimator_get_timeout(&session->estimator);
+    el->deadline = time_add(el->send_time, seconds_to_timespec(timeout));
+    timer.deadline = el->deadline;
+    timer.seq_n = get_packet_seq_n(el->packet.head.data);
+    timer_heap_insert(session->timers, timer);
+}
+
+/**
+ * Return the outstanding packet with `seq_n`,
+ * or `NULL` if there is no such packet. */
+packet_ring_el *get_outstanding_packet( client_session *session,
+                                        seq_n_t seq_n )
+{
+    seq_n_t ring_index = seq_n_subtract(seq_n, session->ring_seq_n);
+    if( ring_index >= session->packet_ring0->size ) return NULL;
+    return packet_ring_get(session->packet_ring0, ring_index);
+}
+
+/**
+ * Return the outstanding packet which `timer` is for,
+ * or `NULL` if the timer is stale:
+ * the packet was acknowledged or its timer was restarted. */
+packet_ring_el *get_timer_packet( client_session *session,
+                                  timer_heap_el *timer )
+{
+    packet_ring_el *el = get_outstanding_packet(session, timer->seq_n);
+    if( el == NULL || el->acked
+        || !time_equal(el->deadline, timer->deadline) )
+    {
+        return NULL;
+    }
+    return el;
+}
+
+/**
+ * Write the earliest deadline of the outstanding packets to `*deadline`,
+ * removing stale timers.
+ * Return a non-zero number if there are no timers. */
+int get_next_deadline( client_session *session, struct timespec *deadline )
+{
+    timer_heap *timers = session->timers;
+    while( timers->size != 0 )
+    {
+        timer_heap_el *timer = timer_heap_first(timers);
+        if( get_timer_packet(session, timer) != NULL )
+        {
+            *deadline = timer->deadline;
+            return 0;
+        }
+        timer_heap_delete_first(timers);
+    }
+    return 1;
+}
+
+/**
+ * Return the greatest number of outstanding packets allowed now. */
+unsigned int get_send_window( client_session *session )
+{
+    unsigned int window_size = session->config->window_size;
+    if( session->config->congestion_control )
+    {
+        unsigned int cwnd = congestion_get_window(&session->congestion);
+        if( cwnd < window_size ) window_size = cwnd;
+    }
+    return window_size;
+}
+
+/**
+ * Return whether pacing allows a new data packet to be sent now. */
+int is_pacing_ready( client_session *session )
+{
+    return !session->config->congestion_control
+        || !time_less(session->current_time, session->next_send_time);
+}
+
+/**
+ * Delay the next new data packet after one was sent now.
+ * A few packets may be sent at once to catch up with the pace. */
+void pace_packet( client_session *session )
+{
+    double interval;
+    struct timespec earliest;
+    if( !session->config->congestion_control ) return;
+
+    interval = congestion_get_pacing_interval(&session->congestion,
+                                              session->estimator.srtt);
+    earliest = time_subtract(session->current_time,
+                             seconds_to_timespec(interval * PACING_MAX_BURST));
+    if( time_less(session->next_send_time, earliest) )
+    {
+        session->next_send_time = earliest;
+    }
+    session->next_send_time = time_add(session->next_send_time,
+                                       seconds_to_timespec(interval));
+}
+
+/**
+ * Resend the outstanding packet `el` now and restart its timer.
+ * The packet is added to `session->sent`, which is sent when full.
  * If an error happened, return a non-zero number. */
-int send_packet_list( int udp_socket,
-                      struct sockaddr *remote_address,
-                      socklen_t remote_address_length,
-                      packet_list *packet_list0,
-                      struct timespec *current_time)
-{
-    packet_list_node *node = packet_list0->head;
-    while( node != NULL )
-    {
-        sized_data packet = node->el.packet;
-        node->el.send_time = *current_time;
-        printf("Resending a data packet with seq_n = %u, req_n = %d.\n",
-               (unsigned int)(get_packet_seq_n(packet.data)),
-               get_packet_req_n(packet.data));
-        if ( send_packet(udp_socket, packet.data, packet.size, 0,
-                         remote_address, remote_address_length) < 0 )
-        {
-            perror("resend data packet");
+int resend_packet( client_session *session, packet_ring_el *el )
+{
+    el->send_time = session->current_time;
+    if( el->n_retransmissions < UCHAR_MAX ) el->n_retransmissions++;
+    start_timer(session, el);
+    printf("Resending a data packet with seq_n = %u, req_n = %d.\n",
+           (unsigned int)(get_packet_seq_n(el->packet.head.data)),
+           get_packet_req_n(el->packet.head.data));
+    if( packet_batch_is_full(session->sent)
+        && packet_batch_send(session->sent, session->udp_socket) != 0 )
+    {
+        return 1;
+    }
+    packet_batch_add_parts(session->sent, el->packet.head, el->packet.payload,
+                           session->remote_address,
+                           session->remote_address_length);
+    return 0;
+}
+
+/**
+ * Resend all the outstanding packets, as Go-Back-N does:
+ * the server dropped all the packets after a lost one.
+ * The old timers become stale.
+ * If an error happened, return a non-zero number. */
+int resend_all( client_session *session )
+{
+    unsigned long i;
+    for( i = 0; i < session->packet_ring0->size; i++ )
+    {
+        if( resend_packet(session, packet_ring_get(session->packet_ring0, i))
+            != 0 )
+        {
             return 1;
         }
-        node = node->next;
     }
     return 0;
 }
 
 /**
- * Wait for an incoming packet or error in `udp_socket`,
- * but no more than `timeout`.
+ * Resend the outstanding packets whose timers expired by now,
+ * with as few system calls as `session->sent` allows,
+ * and restart their timers after backing the timeout off.
+ * In the selective repeat mode, packets sent later keep their timers.
+ * With Go-Back-N all the outstanding packets are resent.
+ * If an error happened, return a non-zero number. */
+int resend_expired( client_session *session )
+{
+    struct timespec deadline;
+    if( get_next_deadline(session, &deadline) != 0
+        || time_less(session->current_time, deadline) )
+    {
+        return 0;
+    }
+
+    printf("ACK timeout.\n");
+    if( session->config->congestion_control )
+    {
+        congestion_on_timeout(&session->congestion,
+                              session->packet_ring0->size,
+                              seq_n_add(session->ring_seq_n,
+                                        session->packet_ring0->size));
+    }
+    rto_estimator_backoff(&session->estimator);
+    printf("Backing off, retransmission timeout %.6f s.\n",
+           rto_estimator_get_timeout(&session->estimator));
+    if( session->config->selective )
+    {
+        while( get_next_deadline(session, &deadline) == 0
+               && !time_less(session->current_time, deadline) )
+        {
+            packet_ring_el *el =
+                get_timer_packet(session, timer_heap_first(session->timers));
+            timer_heap_delete_first(session->timers);
+            if( resend_packet(session, el) != 0 ) return 1;
+        }
+    }
+    else if( resend_all(session) != 0 ) return 1;
+    return packet_batch_send(session->sent, session->udp_socket);
+}
+
+/**
+ * Resend the outstanding packets without waiting for their timers,
+ * since the server reported packets after the head arriving first.
+ * With Go-Back-N those packets were dropped, so all of them are resent.
+ * If an error happened, return a non-zero number. */
+int fast_retransmit( client_session *session )
+{
+    printf("Fast retransmit after %u duplicate ACK packets.\n",
+           session->n_dup_acks);
+    session->n_fast_retransmits++;
+    if( session->config->congestion_control )
+    {
+        congestion_on_loss(&session->congestion, session->packet_ring0->size,
+                           seq_n_add(session->ring_seq_n,
+                                     session->packet_ring0->size));
+    }
+    return resend_all(session);
+}
+
+/**
+ * Return the number of duplicate ACK packets triggering a fast retransmit,
+ * or `0` if fast retransmit is disabled.
+ * A small window cannot bring enough duplicate ACK packets,
+ * so the threshold is lowered to the number of packets after the head,
+ * as in the early retransmit of RFC 5827. */
+unsigned int get_dup_ack_threshold( client_session *session )
+{
+    unsigned int threshold = session->config->dup_ack_threshold;
+    unsigned long n_after_head = session->packet_ring0->size - 1;
+    if( n_after_head != 0 && n_after_head < threshold )
+    {
+        threshold = n_after_head;
+    }
+    return threshold;
+}
+
+/**
+ * Resend the outstanding packets not acknowledged
+ * but followed by acknowledged packets, at least the duplicate ACK threshold,
+ * without waiting for their timers, as in RFC 6675.
+ * This way each packet is resent only once, later losses are left to timers.
+ * For the selective repeat mode, where packets are acknowledged one by one.
+ * If an error happened, return a non-zero number. */
+int resend_lost( client_session *session )
+{
+    packet_ring *packet_ring0 = session->packet_ring0;
+    unsigned int threshold = get_dup_ack_threshold(session);
+    unsigned long n_acked_after = 0; /* of the current element */
+    unsigned long i;
+    if( threshold == 0 ) return 0;
+
+    for( i = 0; i < packet_ring0->size; i++ )
+    {
+        if( packet_ring_get(packet_ring0, i)->acked ) n_acked_after++;
+    }
+    for( i = 0; i < packet_ring0->size && n_acked_after >= threshold; i++ )
+    {
+        packet_ring_el *el = packet_ring_get(packet_ring0, i);
+        if( el->acked ) n_acked_after--;
+        else if( el->n_retransmissions == 0 )
+        {
+            printf("Fast retransmit, %lu later packets acknowledged.\n",
+                   n_acked_after);
+            session->n_fast_retransmits++;
+            if( session->config->congestion_control )
+            {
+                congestion_on_loss(&session->congestion,
+                                   session->packet_ring0->size,
+                                   seq_n_add(session->ring_seq_n,
+                                             session->packet_ring0->size));
+            }
+            if( resend_packet(session, el) != 0 ) return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Mark the outstanding packet with `seq_n` as acknowledged.
+ * Return a non-zero number if there is no such packet
+ * or it is already acknowledged. */
+int mark_acked( client_session *session, seq_n_t seq_n )
+{
+    packet_ring_el *el = get_outstanding_packet(session, seq_n);
+    if( el == NULL ) return 1;
+    if( el->acked ) return 2;
+    el->acked = 1;
+    return 0;
+}
+
+/**
+ * Mark the outstanding packets reported received
+ * by the SACK bitmap of the ACK packet `packet` as acknowledged,
+ * so that they are not resent.
+ * Return the number of newly acknowledged packets. */
+unsigned long receive_sack( client_session *session, sized_data packet )
+{
+    unsigned char *sack = get_packet_sack_p(packet.data);
+    seq_n_t n_bits = get_packet_sack_size(packet.data) * 8;
+    /* bit `i` is for the packet `first_seq_n + i` */
+    seq_n_t first_seq_n = seq_n_add(get_packet_ack_seq_n(packet.data), 1);
+    seq_n_t i = seq_n_subtract(session->ring_seq_n, first_seq_n);
+    unsigned long ring_index = 0;
+    unsigned long n_acked = 0;
+    for( ; ring_index < session->packet_ring0->size && i < n_bits;
+         ring_index++, i++ )
+    {
+        packet_ring_el *el = packet_ring_get(session->packet_ring0,
+                                             ring_index);
+        if( !el->acked && is_sack_bit_set(sack, i) )
+        {
+            el->acked = 1;
+            n_acked++;
+        }
+    }
+    return n_acked;
+}
+
+/**
+ * Update the RTT estimate with the outstanding packet with `seq_n`
+ * acknowledged now, unless the RTT is ambiguous. */
+void sample_rtt( client_session *session, seq_n_t seq_n )
+{
+    packet_ring_el *el = get_outstanding_packet(session, seq_n);
+    double rtt;
+    if( el == NULL || el->acked || el->n_retransmissions != 0 ) return;
+    rtt = timespec_to_seconds(
+        time_subtract(session->current_time, el->send_time));
+    rto_estimator_sample(&session->estimator, rtt);
+    printf("RTT sample %.6f s, smoothed RTT %.6f s,"
+           " retransmission timeout %.6f s.\n", rtt, session->estimator.srtt,
+           rto_estimator_get_timeout(&session->estimator));
+}
+
+/**
+ * Delete the head of the outstanding packets,
+ * giving its buffer back to the pool. */
+void delete_outstanding_head( client_session *session )
+{
+    packet_source_put(session->source,
+                      packet_ring_get(session->packet_ring0, 0)->packet);
+    packet_ring_delete_first(session->packet_ring0);
+    session->ring_seq_n = seq_n_add(session->ring_seq_n, 1);
+}
+
+/**
+ * Handle the packet `packet` received from the server,
+ * deleting acknowledged outstanding packets and measuring the RTT.
+ * Once `session->config->dup_ack_threshold` ACK packets in a row
+ * acknowledge nothing up to the head of the outstanding packets,
+ * the head is resent at once.
+ * If an error happened, return a non-zero number. */
+int receive_ack( client_session *session, sized_data packet )
+{
+    packet_ring *packet_ring0 = session->packet_ring0;
+    int packet_type = get_packet_type(packet);
+    if( packet_type < 0 )
+    {
+        printf("Received an invalid packet.\n");
+    }
+    else if( get_packet_session_id(packet.data)
+             != session->config->session_id )
+    {
+        printf("Received a packet of another session.\n");
+    }
+    else if( packet_type == PACKET_TYPE_ACK )
+    {
+        seq_n_t ring_index;
+        seq_n_t ack_seq_n = get_packet_ack_seq_n(packet.data);
+        unsigned long n_acked = 0; /* newly acknowledged packets */
+        int advanced = 0; /* whether the head was acknowledged */
+        /* an ACK packet which acknowledges data packets up to the one
+         * before the head, but some data packet after the head arrived */
+        int duplicate = packet_ring0->size != 0
+            && ack_seq_n == seq_n_subtract(session->ring_seq_n, 1);
+        printf("Received an ACK packet with ack_seq_n = %u.\n",
+               (unsigned int)ack_seq_n);
+
+        /* The ACK packet was sent when the data packet
+         * in its `seq_n` field (selective) or `ack_seq_n` field arrived. */
+        sample_rtt(session, is_packet_selective(packet.data)
+                   ? get_packet_seq_n(packet.data) : ack_seq_n);
+
+        /* delete outstanding packets with the `seq_n` field
+         * up to `ack_seq_n` inclusive */
+        ring_index = seq_n_subtract(ack_seq_n, session->ring_seq_n);
+        if( ring_index < packet_ring0->size )
+        {
+            unsigned long i;
+            for( i = ring_index + 1; i-- != 0; )
+            {
+                if( !packet_ring_get(packet_ring0, 0)->acked ) n_acked++;
+                delete_outstanding_head(session);
+            }
+            rto_estimator_reset_backoff(&session->estimator);
+            session->n_dup_acks = 0;
+            advanced = 1;
+        }
+        else
+        {
+            printf("No outstanding buffered packet"
+                   " with seq_n = %u.\n", (unsigned int)ack_seq_n);
+        }
+        if( is_packet_selective(packet.data) )
+        {
+            /* The `seq_n` field of a selective ACK packet
+             * is the data packet it acknowledges. */
+            seq_n_t seq_n = get_packet_seq_n(packet.data);
+            printf("The ACK packet acknowledges seq_n = %u.\n",
+                   (unsigned int)seq_n);
+            if( mark_acked(session, seq_n) == 0 )
+            {
+                rto_estimator_reset_backoff(&session->estimator);
+                n_acked++;
+            }
+            if( get_packet_sack_size(packet.data) != 0 )
+            {
+                unsigned long n_sacked = receive_sack(session, packet);
+                printf("The SACK bitmap acknowledges %lu more packets.\n",
+                       n_sacked);
+                n_acked += n_sacked;
+            }
+
+            /* the window slides over acknowledged packets */
+            while( packet_ring0->size != 0
+                   && packet_ring_get(packet_ring0, 0)->acked )
+            {
+                delete_outstanding_head(session);
+                session->n_dup_acks = 0;
+                advanced = 1;
+            }
+        }
+        printf("The seq_n of the beginning of the window is %u.\n",
+               (unsigned int)session->ring_seq_n);
+        printf("The number of outstanding buffered packets"
+               " is %lu.\n", packet_ring0->size);
+
+        if( session->config->congestion_control && n_acked != 0 )
+        {
+            congestion_control *cc = &session->congestion;
+            packet_ring_el *head = packet_ring0->size != 0
+                ? packet_ring_get(packet_ring0, 0) : NULL;
+            congestion_on_ack(cc, n_acked, session->ring_seq_n);
+
+            /* A partial ACK during fast recovery
+             * means the new head was lost too. */
+            if( cc->fast_recovery && advanced && head != NULL
+                && !head->acked && head->n_retransmissions == 0 )
+            {
+                printf("Partial ACK during fast recovery.\n");
+                session->n_fast_retransmits++;
+                return resend_packet(session, head);
+            }
+        }
+
+        if( is_packet_selective(packet.data) )
+        {
+            /* acknowledged packets show the lost ones, not only the head */
+            if( n_acked != 0 ) return resend_lost(session);
+        }
+        else if( duplicate && packet_ring0->size != 0
+                 && get_dup_ack_threshold(session) != 0
+                 && ++session->n_dup_acks == get_dup_ack_threshold(session) )
+        {
+            return fast_retransmit(session);
+        }
+    }
+    else
+    {
+        printf("Received an unexpected packet of type %d.\n",
+               packet_type);
+    }
+    return 0;
+}
+
+/**
+ * Wait for an incoming packet or error in the socket of `session`,
+ * or for the read-ahead to have a packet ready,
+ * but no later than `*deadline`, which may have passed already,
+ * or without a limit if `deadline` is `NULL`.
+ * The timer is only armed again if the deadline changed.
  * Return `1` if a packet is ready, `0` if no packet is ready,
- * or a negative number if an error happened.
- * May modify the memory referred by `timeout`. */
-int wait_session( int udp_socket, struct timeval *timeout )
+ * or a negative number if an error happened. */
+int wait_session( client_session *session, struct timespec *deadline )
 {
-    fd_set read_set;
-    fd_set error_set;
-    int n_set;
-    FD_ZERO(&read_set);
-    FD_SET(udp_socket, &read_set);
-    FD_ZERO(&error_set);
-    FD_SET(udp_socket, &error_set);
+    event_source *ready[EVENT_LOOP_MAX_EVENTS];
+    int n_ready;
+    int i;
+    int r = 0;
+    if( deadline != NULL )
+    {
+        struct timespec timeout =
+            time_subtract(*deadline, session->current_time);
+        if( timeout.tv_sec < 0 )
+        {
+            timeout.tv_sec = 0;
+            timeout.tv_nsec = 0;
+        }
+        printf("Waiting for a packet with timeout"
+               " (%ld seconds, %ld microseconds).\n",
+               (long)timeout.tv_sec, timeout.tv_nsec / 1000);
+        if( event_loop_set_timer(&session->deadline_timer, *deadline) != 0 )
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        printf("Waiting for a packet or for files to be read.\n");
+        if( event_loop_clear_timer(&session->deadline_timer) != 0 )
+        {
+            return -1;
+        }
+    }
+    n_ready = event_loop_wait(session->loop, ready, -1);
+    if( n_ready < 0 ) return -1;
+    for( i = 0; i < n_ready; i++ )
+    {
+        if( ready[i] == &session->socket_source ) r = 1;
+    }
+    return r;
+}
 
-    printf("Waiting for a packet with timeout"
-           " (%ld seconds, %ld microseconds).\n",
-           (long)timeout->tv_sec, (long)timeout->tv_usec);
-    n_set = select(udp_socket + 1, &read_set, NULL, &error_set, timeout);
-    if( n_set < 0 )
+/**
+ * Write the next new data packet with `seq_n` into `*packet`,
+ * taken from the read-ahead if there is one.
+ * Return `PREFETCH_TAKEN`, `PREFETCH_EMPTY` if the read-ahead
+ * has no packet ready yet, or `PREFETCH_END` if there are no more files. */
+int next_packet( client_session *session, seq_n_t seq_n,
+                 mapped_packet *packet )
+{
+    int r;
+    if( session->prefetch0 == NULL )
     {
-        perror("receive packet, select");
-        return -1;
+        return packet_source_next(session->source, seq_n, packet) == 0
+            ? PREFETCH_TAKEN : PREFETCH_END;
     }
-    return n_set != 0 ? 1 : 0;
+    r = prefetch_take(session->prefetch0, packet);
+    if( r == PREFETCH_TAKEN ) set_packet_seq_n(packet->head.data, seq_n);
+    return r;
 }
 
+/**
+ * Send the files listed by `iter`.
+ * In the selective repeat mode,
+ * the server acknowledges each data packet
+ * and only the packets not acknowledged are resent on a timeout. */
 char handle_session( int udp_socket, file_iter *iter,
                      struct sockaddr *remote_address,
-                     socklen_t remote_address_length )
+                     socklen_t remote_address_length,
+                     session_config *config )
 {
     int error = 0;
-    int req_n = 0;
-    struct timespec current_time;
-    sized_data file_name;
-    sized_data packet_buffer;
-    packet_list *packet_list0;
-    seq_n_t list_seq_n = 0; /* `seq_n` of the head of `packet_list0` */
-    if( clock_gettime(CLOCK, &current_time) != 0 )
+    client_session session;
+    size_t head_size; /* of data packets sent from mappings */
+    session.config = config;
+    session.udp_socket = udp_socket;
+    session.remote_address = remote_address;
+    session.remote_address_length = remote_address_length;
+    if( clock_gettime(CLOCK, &session.current_time) != 0 )
     {
         perror("read clock");
         return 2;
     }
+    session.loop = event_loop_new();
+    if( session.loop == NULL ) return 2;
+    if( event_loop_add(session.loop, &session.socket_source, udp_socket,
+                       NULL) != 0 )
+    {
+        event_loop_free(session.loop);
+        return 2;
+    }
+    if( event_loop_add_timer(session.loop, &session.deadline_timer,
+                             NULL) != 0 )
+    {
+        event_loop_remove(session.loop, &session.socket_source);
+        event_loop_free(session.loop);
+        return 2;
+    }
 
-    file_name = malloc_sized_check(FILE_NAME_SIZE);
-    packet_buffer = malloc_sized_check(UDP_SIZE);
-    packet_list0 = packet_list_new();
+    /* only the headers of data packets sent from mappings are in buffers,
+     * but batch data packets are still built in them */
+    head_size = get_data_packet_size(FILE_NAME_SIZE, 0);
+    if( config->zero_copy && !config->batch
+        && head_size < config->packet_size )
+    {
+        session.pool = packet_pool_new(head_size);
+    }
+    else session.pool = packet_pool_new(config->packet_size);
+    session.source = packet_source_new(iter, session.pool,
+                                       config->packet_size, config->batch,
+                                       config->zero_copy);
+    session.prefetch0 = NULL;
+    if( config->prefetch_budget != 0 )
+    {
+        /* without a read-ahead, files are read when sending,
+         * each packet read ahead takes a buffer of the pool */
+        session.prefetch0 = prefetch_new(
+            produce_packet, discard_packet, session.source,
+            config->prefetch_budget / session.pool->buffer_size);
+        if( session.prefetch0 != NULL
+            && event_loop_add(session.loop, &session.prefetch_source,
+                              session.prefetch0->fd, NULL) != 0 )
+        {
+            prefetch_free(session.prefetch0);
+            session.prefetch0 = NULL;
+        }
+    }
+    session.sent = packet_batch_new(PACKET_BATCH_SIZE, 0);
+    if( config->segment ) packet_batch_enable_segmentation(session.sent);
+    session.received = packet_batch_new(PACKET_BATCH_SIZE, UDP_SIZE);
+    session.packet_ring0 = packet_ring_new(config->window_size);
+    session.ring_seq_n = 0;
+    rto_estimator_init(&session.estimator);
+    session.timers = timer_heap_new();
+    congestion_init(&session.congestion, config->window_size);
+    session.next_send_time = session.current_time;
+    session.n_dup_acks = 0;
+    session.n_fast_retransmits = 0;
     /* Loop invariants:
-     * - `packet_list0->size < WINDOW_SIZE`;
-     * - `packet_list0` is in the order of increasing `send_time`;
-     * - the head of `packet_list0` is the oldest packet;
+     * - `session.packet_ring0->size <= config->window_size`;
+     * - each packet in `session.packet_ring0` not acknowledged
+     *   has a timer in `session.timers` with the same `deadline`;
      * - the `seq_n` field of the packet in the `i`th (0-based) element
-     *   of `packet_list0` is `seq_n_add(list_seq_n, i)`. */
+     *   of `session.packet_ring0` is `seq_n_add(session.ring_seq_n, i)`. */
     while( 1 )
     {
         int wait_result;
-        /* If there is a room in the packet list,
+        int paced = 0; /* whether pacing delays a new data packet */
+        /* whether the next new data packet is still being read */
+        int starved = 0;
+        /* If there is a room in the packet ring,
          * attach a new data packet to its tail and send that packet. */
-        while( packet_list0->size < WINDOW_SIZE
-               && file_iter_next(iter, file_name) == 0)
+        while( session.packet_ring0->size < get_send_window(&session) )
         {
             /* send a data packet */
-            seq_n_t seq_n = seq_n_add(list_seq_n, packet_list0->size);
-            sized_data packet = new_packet_from_file(
-                file_name.data, req_n, seq_n);
-            if( packet.data != NULL )
+            seq_n_t seq_n = seq_n_add(session.ring_seq_n,
+                                      session.packet_ring0->size);
+            mapped_packet packet;
+            packet_ring_el *el;
+            int next_result;
+            if( !is_pacing_ready(&session) )
             {
-                packet_list_el el;
-                printf("Sending a data packet with seq_n = %u, req_n = %d.\n",
-                       (unsigned int)seq_n, req_n);
-                if ( send_packet(udp_socket, packet.data, packet.size, 0,
-                                 remote_address, remote_address_length) < 0 )
-                {
-                    perror("send data packet");
-                    error = 1;
-                }
-
-                if( error != 0 ) {
-                    free(packet.data);
-                    break;
-                }
-                el.send_time = current_time;
-                el.packet = packet;
-                packet_list_insert_last(packet_list0, el);
-                req_n++;
+                paced = 1;
+                break;
             }
+            next_result = next_packet(&session, seq_n, &packet);
+            if( next_result == PREFETCH_EMPTY ) starved = 1;
+            if( next_result != PREFETCH_TAKEN ) break;
 
+            set_packet_window_size(packet.head.data, config->window_size);
+            set_packet_session_id(packet.head.data, config->session_id);
+            if( config->selective ) set_packet_selective(packet.head.data);
+            printf("Sending a data packet with seq_n = %u, req_n = %d.\n",
+                   (unsigned int)seq_n, get_packet_req_n(packet.head.data));
+            if( packet_batch_is_full(session.sent)
+                && packet_batch_send(session.sent, udp_socket) != 0 )
+            {
+                error = 1;
+                packet_source_put(session.source, packet);
+                break;
+            }
+            packet_batch_add_parts(session.sent, packet.head, packet.payload,
+                                   remote_address, remote_address_length);
+            el = packet_ring_insert_last(session.packet_ring0);
+            el->send_time = session.current_time;
+            el->packet = packet;
+            el->acked = 0;
+            el->n_retransmissions = 0;
+            start_timer(&session, el);
+            pace_packet(&session);
+        }
+        if( error == 0 && packet_batch_send(session.sent, udp_socket) != 0 )
+        {
+            error = 1;
         }
         if( error != 0 ) break;
 
-        /* The packet list may be empty here
-         * only if there are no files to send. */
-        if( packet_list0->size == 0 ) break;
+        /* The packet ring may be empty here only if there are no files
+         * to send, pacing delays them or they are still being read. */
+        if( session.packet_ring0->size == 0 && !paced && !starved ) break;
 
-        /* wait for an incoming packet or an ACK timeout */
+        /* wait for an incoming packet, an ACK timeout
+         * or a packet read ahead */
         {
-            struct timespec ack_timeout = {ACK_TIMEOUT, 0};
-            struct timeval timeout =
-                timespec_to_timeval(
-                    time_subtract(
-                        time_add(packet_list0->head->el.send_time, ack_timeout),
-                        current_time));
-            if( timeout.tv_sec < 0 )
+            /* the earliest timeout of an outstanding packet
+             * or the time pacing allows a new data packet */
+            struct timespec deadline;
+            int has_deadline = get_next_deadline(&session, &deadline) == 0;
+            if( paced && (!has_deadline
+                          || time_less(session.next_send_time, deadline)) )
             {
-                timeout.tv_sec = 0;
-                timeout.tv_usec = 0;
+                deadline = session.next_send_time;
+                has_deadline = 1;
             }
-
-            /* `timeout` is the time left until the timeout
-             * of the oldest outstanding packet happens */
-            wait_result = wait_session(udp_socket, &timeout);
+            wait_result = wait_session(&session,
+                                       has_deadline ? &deadline : NULL);
             if( wait_result < 0 )
             {
                 error = 8;
@@ -329,129 +1361,270 @@ char handle_session( int udp_socket, file_iter *iter,
         }
         /* After the wait, the clock is likely moved forward a lot.
          * Read the new time. */
-        if( clock_gettime(CLOCK, &current_time) != 0 )
+        if( clock_gettime(CLOCK, &session.current_time) != 0 )
         {
             perror("read clock");
             error = 3;
             break;
         }
 
-        if( wait_result == 0 )
+        if( wait_result != 0 )
         {
-            /* ACK timeout. */
-            printf("ACK timeout.\n");
-            if( send_packet_list(udp_socket,
-                                 remote_address, remote_address_length,
-                                 packet_list0, &current_time) != 0 )
+            /* receive all ACK packets that are ready */
+            unsigned int i;
+            int n_received = packet_batch_receive(session.received,
+                                                  udp_socket, MSG_DONTWAIT);
+            if( n_received < 0 )
             {
-                error = 7;
-                break;
-            }
-        }
-        else
-        {
-            sized_data packet;
-            int packet_type;
-            ssize_t packet_size =
-                recvfrom(udp_socket, packet_buffer.data, packet_buffer.size, 0,
-                         NULL, NULL);
-            if( packet_size < 0 )
-            {
-                perror("receive packet");
                 error = 4;
                 break;
             }
-
-            /* received a packet */
-            packet.size = packet_size;
-            packet.data = packet_buffer.data;
-            packet_type = get_packet_type(packet);
-            if( packet_type < 0 )
-            {
-                printf("Received an invalid packet.\n");
-            }
-            else
+            for( i = 0; i < (unsigned int)n_received; i++ )
             {
-                if( packet_type == PACKET_TYPE_ACK )
+                if( receive_ack(&session,
+                                packet_batch_get(session.received, i)) != 0 )
                 {
-                    seq_n_t list_index;
-                    seq_n_t ack_seq_n = get_packet_ack_seq_n(packet.data);
-                    printf("Received an ACK packet with ack_seq_n = %u.\n",
-                           (unsigned int)ack_seq_n);
-
-                    /* delete outstanding packets with the `seq_n` field
-                     * up to `ack_seq_n` inclusive */
-                    list_index = seq_n_subtract(ack_seq_n, list_seq_n);
-                    if( list_index < packet_list0->size )
-                    {
-                        unsigned long i;
-                        for( i = list_index + 1; i-- != 0; )
-                        {
-                            packet_list_delete_first(packet_list0);
-                            list_seq_n = seq_n_add(list_seq_n, 1);
-                        }
-                    }
-                    else
-                    {
-                        printf("No outstanding buffered packet"
-                               " with seq_n = %u.\n", (unsigned int)ack_seq_n);
-                    }
-                    printf("The seq_n of the beginning of the window is %u.\n",
-                           (unsigned int)list_seq_n);
-                    printf("The number of outstanding buffered packets"
-                           " is %lu.\n", packet_list0->size);
-                }
-                else
-                {
-                    printf("Received an unexpected packet of type %d.\n",
-                           packet_type);
+                    error = 7;
+                    break;
                 }
             }
+            if( error != 0 ) break;
+        }
+
+        /* only the packets whose timers expired are resent,
+         * together with fast retransmissions */
+        if( resend_expired(&session) != 0
+            || packet_batch_send(session.sent, udp_socket) != 0 )
+        {
+            error = 7;
+            break;
         }
     }
-    packet_list_free(packet_list0);
-    free(packet_buffer.data);
-    free(file_name.data);
+    printf("Session statistics:\n");
+    rto_estimator_print(&session.estimator);
+    printf("Fast retransmissions: %lu.\n", session.n_fast_retransmits);
+    if( config->congestion_control ) congestion_print(&session.congestion);
+    timer_heap_free(session.timers);
+    if( session.prefetch0 != NULL )
+    {
+        event_loop_remove(session.loop, &session.prefetch_source);
+        prefetch_free(session.prefetch0);
+    }
+    event_loop_remove(session.loop, &session.deadline_timer);
+    event_loop_remove(session.loop, &session.socket_source);
+    event_loop_free(session.loop);
+    packet_ring_free(session.packet_ring0);
+    packet_batch_free(session.received);
+    packet_batch_free(session.sent);
+    packet_source_free(session.source);
+    /* after the read-ahead, which gives its packets back */
+    packet_pool_free(session.pool);
 
     if( error == 0 )
     {
-        error = send_eot_packet(
-            udp_socket, remote_address, remote_address_length);
+        error = send_eot_packet(udp_socket, remote_address,
+                                remote_address_length, config->session_id);
     }
     return error;
 }
 
+/**
+ * Lower the packet size of `config` to fit its MTU,
+ * finding the MTU of the path to `address` if it is `0`.
+ * Return a non-zero number if an error happened. */
+int set_packet_size_by_mtu( session_config *config, struct sockaddr *address,
+                            socklen_t address_length )
+{
+    long packet_size;
+    if( config->mtu == 0 )
+    {
+        config->mtu = get_path_mtu(address, address_length);
+        if( config->mtu < 0 ) return 1;
+        printf("The path MTU is %ld bytes.\n", config->mtu);
+    }
+    packet_size = config->mtu - UDP_IP_HEADER_SIZE;
+    if( packet_size <= (long)get_data_packet_size(0, 0) )
+    {
+        printf("The MTU must be from %lu.\n",
+               (unsigned long)(get_data_packet_size(0, 0)
+                               + UDP_IP_HEADER_SIZE + 1));
+        return 1;
+    }
+    if( (size_t)packet_size < config->packet_size )
+    {
+        config->packet_size = packet_size;
+    }
+    printf("Sending data packets of up to %lu bytes.\n",
+           (unsigned long)config->packet_size);
+    return 0;
+}
+
+/**
+ * Print the command line of the client with its options. */
+void print_usage( void )
+{
+    static const char *lines[] = {
+        "Usage: client.x [options] <server host> <server port>"
+        " <list file> <loss %>",
+        "  -s       use selective repeat instead of Go-Back-N",
+        "  -w <n>   send up to n packets ahead, from 1 to 65535 (7)",
+        "  -p <n>   send data packets of up to n bytes (65507)",
+        "  -b       pack several small files into one data packet",
+        "  -d <n>   resend a packet after n duplicate ACK packets,"
+        " 0 never (3)",
+        "  -c       limit the packets ahead by a congestion window",
+        "  -r <n>   read up to n bytes of files ahead, 0 never (4194304)",
+        "  -U       read files with blocking calls instead of io_uring",
+        "  -z       send file data from memory mappings without copying",
+        "  -G       send datagrams one by one, without UDP_SEGMENT",
+        "  -m <n>   fit data packets into an MTU of n bytes,"
+        " 0 for the path MTU",
+        "  -f <n>   emulate the loss of datagrams fragmented"
+        " on a link of MTU n"
+    };
+    unsigned int i;
+    for( i = 0; i < sizeof(lines) / sizeof(lines[0]); i++ )
+    {
+        printf("%s\n", lines[i]);
+    }
+}
+
 int main( int argc, char *argv[] )
 {
     int error = 0;
+    session_config config;
+    int option;
+    config.selective = 0;
+    config.window_size = DEFAULT_WINDOW_SIZE;
+    config.packet_size = UDP_SIZE;
+    config.batch = 0;
+    config.dup_ack_threshold = DEFAULT_DUP_ACK_THRESHOLD;
+    config.congestion_control = 0;
+    config.prefetch_budget = PREFETCH_DEFAULT_BUDGET;
+    config.zero_copy = 0;
+    config.segment = 1;
+    config.mtu = -1;
+    while( (option = getopt(argc, argv, "sbcw:p:d:r:UzGm:f:")) != -1 )
+    {
+        if( option == 's' ) config.selective = 1;
+        else if( option == 'z' ) config.zero_copy = 1;
+        /* send datagrams one by one, without segmentation offload */
+        else if( option == 'G' ) config.segment = 0;
+        else if( option == 'U' ) file_ring_set_enabled(0);
+        else if( option == 'b' ) config.batch = 1;
+        else if( option == 'c' ) config.congestion_control = 1;
+        else if( option == 'w' )
+        {
+            long window_size = strtol(optarg, NULL, 10);
+            if( window_size <= 0 || window_size > MAX_WINDOW_SIZE )
+            {
+                printf("The window size must be from 1 to %d.\n",
+                       MAX_WINDOW_SIZE);
+                error = 1;
+            }
+            else config.window_size = window_size;
+        }
+        else if( option == 'p' )
+        {
+            long packet_size = strtol(optarg, NULL, 10);
+            if( packet_size <= (long)get_data_packet_size(0, 0)
+                || packet_size > UDP_SIZE )
+            {
+                printf("The packet size must be from %lu to %d.\n",
+                       (unsigned long)get_data_packet_size(0, 0) + 1,
+                       UDP_SIZE);
+                error = 1;
+            }
+            else config.packet_size = packet_size;
+        }
+        else if( option == 'd' )
+        {
+            long dup_ack_threshold = strtol(optarg, NULL, 10);
+            if( dup_ack_threshold < 0 || dup_ack_threshold > MAX_WINDOW_SIZE )
+            {
+                printf("The duplicate ACK threshold must be from 0 to %d.\n",
+                       MAX_WINDOW_SIZE);
+                error = 1;
+            }
+            else config.dup_ack_threshold = dup_ack_threshold;
+        }
+        else if( option == 'r' )
+        {
+            long prefetch_budget = strtol(optarg, NULL, 10);
+            if( prefetch_budget < 0 )
+            {
+                printf("The read-ahead budget must not be negative.\n");
+                error = 1;
+            }
+            else config.prefetch_budget = prefetch_budget;
+        }
+        else if( option == 'm' )
+        {
+            long mtu = strtol(optarg, NULL, 10);
+            if( mtu < 0 )
+            {
+                printf("The MTU must not be negative.\n");
+                error = 1;
+            }
+            else config.mtu = mtu;
+        }
+        else if( option == 'f' )
+        {
+            /* the loss of datagrams fragmented on a link of this MTU */
+            long loss_mtu = strtol(optarg, NULL, 10);
+            if( loss_mtu < 68 )
+            {
+                printf("The MTU of the emulated link must be from 68.\n");
+                error = 1;
+            }
+            else set_loss_mtu(loss_mtu);
+        }
+        else error = 1;
+    }
+
+    if( error != 0 )
+    {
+        printf("Invalid command-line options.\n");
+        print_usage();
+    }
     /* because we call `send_packet` */
-    if( srand48_from_time() != 0 ) {
+    else if( srand48_from_time() != 0 ) {
         printf("Error when initializing PRNG.\n");
         error = 6;
     }
     else
     {
         /* Assuming we have the command-line arguments as in the specification.
-         * The first element of `argv` is the whole command line. */
-        if( argc != 5 )
+         * `optind` is the index of the first non-option argument. */
+        if( argc - optind != 4 )
         {
             printf("Expected 4 command-line arguments.\n");
+            print_usage();
             error = 1;
         }
         else
         {
-            char *remote_host_name = argv[1];
-            in_port_t remote_port = htons(strtol(argv[2], NULL, 10));
-            char *list_file_name = argv[3];
-            float loss_probability = strtod(argv[4], NULL) / 100.0;
+            char *remote_host_name = argv[optind];
+            in_port_t remote_port = htons(strtol(argv[optind + 1], NULL, 10));
+            char *list_file_name = argv[optind + 2];
+            float loss_probability = strtod(argv[optind + 3], NULL) / 100.0;
             int udp_socket;
+            int offload;
             set_loss_probability(loss_probability);
             printf("Setting loss probability to %f.\n", loss_probability);
+            config.session_id = lrand48();
+            printf("Using %s with window size %u, session id %u.\n",
+                   config.selective ? "selective repeat" : "Go-Back-N",
+                   config.window_size, config.session_id);
 
-            udp_socket = new_udp_socket(0); /* use any available port */
+            offload = config.segment ? UDP_OFFLOAD_SEGMENT : 0;
+            /* use any available port */
+            udp_socket = new_udp_socket(0, 0, &offload);
             if( udp_socket >= 0 )
             {
-                file_iter *iter = file_iter_new(list_file_name);
+                file_iter *iter;
+                config.segment = offload != 0;
+                iter = file_iter_new(list_file_name);
                 if( iter != NULL )
                 {
                     struct sockaddr_in remote_address;
@@ -462,10 +1635,17 @@ int main( int argc, char *argv[] )
                         remote_address.sin_family = AF_INET;
                         remote_address.sin_port = remote_port;
 
-                        if( handle_session(
-                                udp_socket, iter,
-                                (struct sockaddr *)&remote_address,
+                        if( config.mtu >= 0
+                            && set_packet_size_by_mtu(
+                                &config, (struct sockaddr *)&remote_address,
                                 sizeof(remote_address)) != 0 )
+                        {
+                            error = 1;
+                        }
+                        else if( handle_session(
+                                     udp_socket, iter,
+                                     (struct sockaddr *)&remote_address,
+                                     sizeof(remote_address), &config) != 0 )
                         {
                             error = 5;
                         }
@@ -1,5 +1,9 @@
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 
@@ -109,6 +113,50 @@ off_t get_file_size( char *file_name )
     return stat0.st_size;
 }
 
+int memory_file_equal( sized_data data, char *file_name )
+{
+    struct stat stat0;
+    void *map;
+    int r;
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if( fd < 0 )
+    {
+        perror("memory_file_equal, open");
+        print_accessed_path(file_name);
+        return 0;
+    }
+    if( fstat(fd, &stat0) != 0 )
+    {
+        perror("memory_file_equal, fstat");
+        print_accessed_path(file_name);
+        close(fd);
+        return 0;
+    }
+    /* a file of another size differs,
+     * a shorter one must not be read past its end */
+    if( !S_ISREG(stat0.st_mode) || (size_t)stat0.st_size != data.size )
+    {
+        close(fd);
+        return 0;
+    }
+    if( data.size == 0 )
+    {
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, data.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if( map == MAP_FAILED )
+    {
+        perror("memory_file_equal, mmap");
+        print_accessed_path(file_name);
+        return 0;
+    }
+    r = memcmp(map, data.data, data.size) == 0;
+    munmap(map, data.size);
+    return r;
+}
+
 void debug_dump( sized_data data )
 {
     unsigned char *p = data.data;
@@ -56,6 +56,13 @@ int read_file_all( sized_data buffer, char *file_name );
 
 off_t get_file_size( char *file_name );
 
+/**
+ * Return whether `data` and the contents of the file named `file_name`
+ * are equal, comparing them through a mapping of the file,
+ * without reading it into a buffer.
+ * A file truncated during the comparison raises `SIGBUS`. */
+int memory_file_equal( sized_data data, char *file_name );
+
 /**
  * Print `data` as a list of bytes in base 16. For debugging. */
 void debug_dump( sized_data data );
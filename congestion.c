@@ -0,0 +1,96 @@
+#include <stdio.h>
+
+#include "congestion.h"
+
+/* The rate is paced a bit faster than the window per RTT,
+ * so that pacing does not limit the window, as Linux does. */
+#define PACING_GAIN_SLOW_START 2.0
+#define PACING_GAIN 1.2
+
+/**
+ * Return the reduced slow start threshold after a loss. */
+static double get_loss_threshold( unsigned long flight )
+{
+    double ssthresh = flight / 2.0;
+    return ssthresh < CONGESTION_MIN_THRESHOLD
+        ? CONGESTION_MIN_THRESHOLD : ssthresh;
+}
+
+/**
+ * Start a loss episode lasting until the packets before `next_seq_n`
+ * are acknowledged. */
+static void reduce( congestion_control *cc, unsigned long flight,
+                    seq_n_t next_seq_n )
+{
+    cc->ssthresh = get_loss_threshold(flight);
+    cc->reduced = 1;
+    cc->recover = next_seq_n;
+    cc->n_reductions++;
+}
+
+void congestion_init( congestion_control *cc, unsigned int max_window )
+{
+    cc->max_window = max_window;
+    cc->cwnd = CONGESTION_INITIAL_WINDOW < cc->max_window
+        ? CONGESTION_INITIAL_WINDOW : cc->max_window;
+    cc->ssthresh = cc->max_window;
+    cc->reduced = 0;
+    cc->fast_recovery = 0;
+    cc->recover = 0;
+    cc->n_reductions = 0;
+}
+
+void congestion_on_ack( congestion_control *cc, unsigned long n_acked,
+                        seq_n_t next_unacked )
+{
+    /* Outstanding packets are less than half of the `seq_n` range apart,
+     * so `next_unacked` is at or after `recover`
+     * when their difference is in the lower half. */
+    if( cc->reduced
+        && seq_n_subtract(next_unacked, cc->recover) < (seq_n_t)-1 / 2 )
+    {
+        cc->reduced = 0;
+        cc->fast_recovery = 0;
+    }
+    if( cc->fast_recovery ) return;
+
+    if( cc->cwnd < cc->ssthresh ) cc->cwnd += n_acked;
+    else cc->cwnd += n_acked / cc->cwnd;
+    if( cc->cwnd > cc->max_window ) cc->cwnd = cc->max_window;
+}
+
+void congestion_on_loss( congestion_control *cc, unsigned long flight,
+                         seq_n_t next_seq_n )
+{
+    if( cc->reduced ) return;
+    reduce(cc, flight, next_seq_n);
+    cc->fast_recovery = 1;
+    cc->cwnd = cc->ssthresh;
+}
+
+void congestion_on_timeout( congestion_control *cc, unsigned long flight,
+                            seq_n_t next_seq_n )
+{
+    if( !cc->reduced ) reduce(cc, flight, next_seq_n);
+    cc->fast_recovery = 0;
+    cc->cwnd = 1;
+}
+
+unsigned int congestion_get_window( congestion_control *cc )
+{
+    return cc->cwnd < 1 ? 1 : (unsigned int)cc->cwnd;
+}
+
+double congestion_get_pacing_interval( congestion_control *cc, double srtt )
+{
+    double gain = cc->cwnd < cc->ssthresh
+        ? PACING_GAIN_SLOW_START : PACING_GAIN;
+    return srtt / (cc->cwnd * gain);
+}
+
+void congestion_print( congestion_control *cc )
+{
+    printf("Congestion window: %.2f, slow start threshold: %.2f,"
+           " window reductions: %lu.\n",
+           cc->cwnd, cc->ssthresh, cc->n_reductions);
+}
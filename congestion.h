@@ -0,0 +1,76 @@
+/**
+ * Congestion control of the data packets sent by the Client:
+ * slow start, congestion avoidance and fast recovery as in TCP NewReno
+ * (RFC 5681, RFC 6582), with windows counted in packets.
+ * The rate of new data packets is paced evenly over the RTT.
+ * For the Client. */
+
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include "protocol.h"
+
+/**
+ * the congestion window at the beginning of a session */
+#define CONGESTION_INITIAL_WINDOW 4.0
+
+/**
+ * the smallest slow start threshold after a loss */
+#define CONGESTION_MIN_THRESHOLD 2.0
+
+typedef struct
+{
+    double cwnd; /* congestion window */
+    double ssthresh; /* slow start threshold */
+
+    /* the congestion window does not grow over the window of the session */
+    double max_window;
+
+    /* a loss was detected and the windows were reduced;
+     * more losses of packets sent before `recover` do not reduce them again */
+    int reduced;
+
+    /* fast recovery: the congestion window does not grow
+     * until the packets before `recover` are acknowledged */
+    int fast_recovery;
+
+    /* the first packet sent after the last loss was detected */
+    seq_n_t recover;
+
+    unsigned long n_reductions;
+} congestion_control;
+
+void congestion_init( congestion_control *cc, unsigned int max_window );
+
+/**
+ * Grow the congestion window after `n_acked` packets were acknowledged.
+ * `next_unacked` is the first packet not acknowledged yet. */
+void congestion_on_ack( congestion_control *cc, unsigned long n_acked,
+                        seq_n_t next_unacked );
+
+/**
+ * Enter fast recovery after duplicate ACK packets reported a loss.
+ * `flight` is the number of outstanding packets
+ * and `next_seq_n` is the packet to be sent next. */
+void congestion_on_loss( congestion_control *cc, unsigned long flight,
+                         seq_n_t next_seq_n );
+
+/**
+ * Restart with slow start after a retransmission timeout. */
+void congestion_on_timeout( congestion_control *cc, unsigned long flight,
+                            seq_n_t next_seq_n );
+
+/**
+ * Return the number of packets allowed to be outstanding, at least `1`. */
+unsigned int congestion_get_window( congestion_control *cc );
+
+/**
+ * Return the interval between new data packets in seconds,
+ * so that the window is spread over the smoothed RTT `srtt`. */
+double congestion_get_pacing_interval( congestion_control *cc, double srtt );
+
+/**
+ * Print the state of congestion control. For statistics. */
+void congestion_print( congestion_control *cc );
+
+#endif
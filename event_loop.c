@@ -0,0 +1,160 @@
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "event_loop.h"
+
+event_loop *event_loop_new( void )
+{
+    event_loop *loop;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if( epoll_fd < 0 )
+    {
+        perror("event_loop_new, epoll_create1");
+        return NULL;
+    }
+    loop = malloc_check(sizeof(event_loop));
+    loop->epoll_fd = epoll_fd;
+    loop->n_sources = 0;
+    return loop;
+}
+
+void event_loop_free( event_loop *loop )
+{
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+/**
+ * Watch `source->fd` for input. */
+static int watch_source( event_loop *loop, event_source *source )
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+    if( epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) != 0 )
+    {
+        perror("event_loop, epoll_ctl");
+        return 1;
+    }
+    loop->n_sources++;
+    return 0;
+}
+
+int event_loop_add( event_loop *loop, event_source *source, int fd,
+                    void *context )
+{
+    source->fd = fd;
+    source->context = context;
+    source->is_timer = 0;
+    source->armed = 0;
+    return watch_source(loop, source);
+}
+
+int event_loop_add_timer( event_loop *loop, event_source *source,
+                          void *context )
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if( fd < 0 )
+    {
+        perror("event_loop_add_timer, timerfd_create");
+        return 1;
+    }
+    source->fd = fd;
+    source->context = context;
+    source->is_timer = 1;
+    source->armed = 0;
+    if( watch_source(loop, source) != 0 )
+    {
+        close(fd);
+        return 1;
+    }
+    return 0;
+}
+
+void event_loop_remove( event_loop *loop, event_source *source )
+{
+    if( epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL) != 0 )
+    {
+        perror("event_loop_remove, epoll_ctl");
+    }
+    loop->n_sources--;
+    if( source->is_timer ) close(source->fd);
+}
+
+int event_loop_set_timer( event_source *source, struct timespec deadline )
+{
+    struct itimerspec value;
+    if( source->armed && source->deadline.tv_sec == deadline.tv_sec
+        && source->deadline.tv_nsec == deadline.tv_nsec )
+    {
+        return 0;
+    }
+    /* a zero `it_value` would disarm the timer */
+    if( deadline.tv_sec <= 0 && deadline.tv_nsec <= 0 )
+    {
+        deadline.tv_sec = 0;
+        deadline.tv_nsec = 1;
+    }
+    memset(&value, 0, sizeof(value));
+    value.it_value = deadline;
+    if( timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &value, NULL) != 0 )
+    {
+        perror("event_loop_set_timer, timerfd_settime");
+        return 1;
+    }
+    source->armed = 1;
+    source->deadline = deadline;
+    return 0;
+}
+
+int event_loop_clear_timer( event_source *source )
+{
+    struct itimerspec value;
+    if( !source->armed ) return 0;
+    memset(&value, 0, sizeof(value));
+    if( timerfd_settime(source->fd, 0, &value, NULL) != 0 )
+    {
+        perror("event_loop_clear_timer, timerfd_settime");
+        return 1;
+    }
+    source->armed = 0;
+    return 0;
+}
+
+int event_loop_wait( event_loop *loop, event_source **ready, int timeout )
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int n_ready = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS,
+                             timeout);
+    int i;
+    if( n_ready < 0 )
+    {
+        if( errno == EINTR ) return 0;
+        perror("event_loop_wait, epoll_wait");
+        return -1;
+    }
+    for( i = 0; i < n_ready; i++ )
+    {
+        event_source *source = events[i].data.ptr;
+        if( source->is_timer )
+        {
+            /* reset the expiration count, or the timer stays ready */
+            uint64_t n_expirations;
+            if( read(source->fd, &n_expirations, sizeof(n_expirations)) < 0
+                && errno != EAGAIN )
+            {
+                perror("event_loop_wait, read timer");
+                return -1;
+            }
+            source->armed = 0;
+        }
+        ready[i] = source;
+    }
+    return n_ready;
+}
@@ -0,0 +1,89 @@
+/**
+ * Event loop waiting for any number of descriptors and timers at once,
+ * with `epoll`. A timer is a `timerfd` armed for an absolute deadline
+ * of `CLOCK_MONOTONIC`, so many deadlines kept elsewhere (like in
+ * `timer_heap`) need only one timer armed for the earliest of them.
+ * Each ready event refers to its source, so it is handled in O(1).
+ * For the Client. */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <time.h>
+
+#include "common.h"
+
+/**
+ * the greatest number of events returned by one wait */
+#define EVENT_LOOP_MAX_EVENTS 64
+
+/**
+ * A descriptor watched by a loop, owned by the user.
+ * It must not move while it is in the loop. */
+typedef struct
+{
+    int fd;
+    void *context; /* of the user */
+
+    /* whether it is a timer, then `fd` is owned by the source */
+    int is_timer;
+
+    /* for a timer, whether it is armed and for which deadline,
+     * so that arming it again for the same deadline costs nothing */
+    int armed;
+    struct timespec deadline;
+} event_source;
+
+typedef struct
+{
+    int epoll_fd;
+    unsigned int n_sources;
+} event_loop;
+
+/**
+ * Return a new loop without sources, or `NULL` if an error happened. */
+event_loop *event_loop_new( void );
+
+/**
+ * Free the loop. The sources must have been removed. */
+void event_loop_free( event_loop *loop );
+
+/**
+ * Make the loop report when `fd` is readable or has an error,
+ * with `source` initialized for it.
+ * Return a non-zero number if an error happened. */
+int event_loop_add( event_loop *loop, event_source *source, int fd,
+                    void *context );
+
+/**
+ * Make the loop report when a new timer expires,
+ * with `source` initialized for it. The timer is not armed.
+ * Return a non-zero number if an error happened. */
+int event_loop_add_timer( event_loop *loop, event_source *source,
+                          void *context );
+
+/**
+ * Stop reporting events of `source`, closing it if it is a timer. */
+void event_loop_remove( event_loop *loop, event_source *source );
+
+/**
+ * Arm the timer `source` to expire at `deadline` of `CLOCK_MONOTONIC`,
+ * at once if it has passed, replacing its previous deadline.
+ * Return a non-zero number if an error happened. */
+int event_loop_set_timer( event_source *source, struct timespec deadline );
+
+/**
+ * Disarm the timer `source`.
+ * Return a non-zero number if an error happened. */
+int event_loop_clear_timer( event_source *source );
+
+/**
+ * Wait until a source is ready, but no more than `timeout` milliseconds,
+ * or without a limit if `timeout` is negative.
+ * Write the ready sources to `ready` of `EVENT_LOOP_MAX_EVENTS` elements.
+ * Expired timers are disarmed.
+ * Return the number of ready sources, `0` on a timeout or a signal,
+ * or a negative number if an error happened. */
+int event_loop_wait( event_loop *loop, event_source **ready, int timeout );
+
+#endif
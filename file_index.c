@@ -0,0 +1,828 @@
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "file_ring.h"
+#include "file_index.h"
+
+/* 64-bit FNV-1a parameters */
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325UL
+#define FNV_PRIME 0x100000001b3UL
+
+/**
+ * Files are read in blocks of this size. */
+#define FILE_INDEX_BLOCK_SIZE 0x10000
+
+/**
+ * the beginning of an index file, with the version of the format */
+#define FILE_INDEX_MAGIC "FIDX0001"
+
+/**
+ * Header of an index file.
+ * It is followed by the arrays `entries`, `buckets` and `names`.
+ * Numbers are in the byte order of the host. */
+typedef struct
+{
+    char magic[8];
+
+    /* `sizeof(file_index_entry)`, which differs between architectures */
+    unsigned long entry_size;
+
+    long dir_mtime;
+    long dir_mtime_nsec;
+    unsigned long n_entries;
+    unsigned long n_buckets;
+    unsigned long names_size;
+} file_index_header;
+
+static unsigned long hash_update( unsigned long hash,
+                                  unsigned char *data, size_t size )
+{
+    size_t i;
+    for( i = 0; i < size; i++ )
+    {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+unsigned long file_index_hash( sized_data data )
+{
+    return hash_update(FNV_OFFSET_BASIS, data.data, data.size);
+}
+
+/**
+ * Write the path of the file `file_name` in the indexed directory
+ * to `path` of `FILE_NAME_SIZE` bytes. */
+static void get_path( file_index *index, char *file_name, char *path )
+{
+    snprintf(path, FILE_NAME_SIZE, "%s%c%s",
+             index->dir_name, DIR_SEPARATOR, file_name);
+}
+
+/**
+ * Write the hash and the size of the file `path` to `*hash` and `*file_size`.
+ * Return a non-zero number if an error happened. */
+static int hash_file( char *path, unsigned long *hash,
+                      unsigned long *file_size )
+{
+    unsigned char block[FILE_INDEX_BLOCK_SIZE];
+    size_t n_read;
+    FILE *stream = fopen(path, "rb");
+    if( stream == NULL )
+    {
+        perror("file_index, open file");
+        print_accessed_path(path);
+        return 1;
+    }
+    *hash = FNV_OFFSET_BASIS;
+    *file_size = 0;
+    while( (n_read = fread(block, 1, sizeof(block), stream)) != 0 )
+    {
+        *hash = hash_update(*hash, block, n_read);
+        *file_size += n_read;
+    }
+    if( ferror(stream) )
+    {
+        perror("file_index, read file");
+        print_accessed_path(path);
+        fclose(stream);
+        return 2;
+    }
+    fclose(stream);
+    return 0;
+}
+
+/**
+ * Return whether `entry` was hashed from the file of `file_size` bytes
+ * modified at `mtime`, `mtime_nsec`. */
+static int is_entry_fresh( file_index_entry *entry, unsigned long file_size,
+                           long mtime, long mtime_nsec )
+{
+    return entry->file_size == file_size
+        && entry->mtime == mtime && entry->mtime_nsec == mtime_nsec;
+}
+
+/**
+ * Return a new index of the directory `dir_name` without entries. */
+static file_index *new_empty( char *dir_name )
+{
+    file_index *index = malloc_check(sizeof(file_index));
+    index->dir_name = malloc_check(strlen(dir_name) + 1);
+    strcpy(index->dir_name, dir_name);
+    index->dir_mtime = 0;
+    index->dir_mtime_nsec = 0;
+    index->n_entries = 0;
+    index->entries_capacity = 0;
+    index->entries = NULL;
+    index->n_buckets = 0;
+    index->buckets = NULL;
+    index->names_size = 0;
+    index->names_capacity = 0;
+    index->names = NULL;
+    index->map = NULL;
+    index->map_size = 0;
+    index->name_slots = NULL;
+    index->n_name_slots = 0;
+    index->n_used_name_slots = 0;
+    index->modified = 0;
+    index->validated = 1;
+    index->watched = 0;
+    index->n_hashed = 0;
+    return index;
+}
+
+/**
+ * Append the file name `file_name` to the names of `index`.
+ * Return its offset. The index must not be mapped. */
+static unsigned long add_name( file_index *index, char *file_name )
+{
+    unsigned long offset = index->names_size;
+    size_t size = strlen(file_name) + 1;
+    if( index->names_size + size > index->names_capacity )
+    {
+        char *names;
+        while( index->names_size + size > index->names_capacity )
+        {
+            index->names_capacity = index->names_capacity == 0
+                ? FILE_NAME_SIZE : index->names_capacity * 2;
+        }
+        names = malloc_check(index->names_capacity);
+        memcpy(names, index->names, index->names_size);
+        free(index->names);
+        index->names = names;
+    }
+    memcpy(index->names + offset, file_name, size);
+    index->names_size += size;
+    return offset;
+}
+
+/**
+ * Append an entry for the file `file_name` modified at `mtime`
+ * to `index` without putting it into a bucket or the name table.
+ * The index must not be mapped. */
+static void add_entry( file_index *index, char *file_name,
+                       unsigned long file_size, unsigned long hash,
+                       long mtime, long mtime_nsec )
+{
+    file_index_entry *entry;
+    if( index->n_entries == index->entries_capacity )
+    {
+        file_index_entry *entries;
+        index->entries_capacity = index->entries_capacity == 0
+            ? 1 : index->entries_capacity * 2;
+        entries = malloc_check(
+            index->entries_capacity * sizeof(file_index_entry));
+        memcpy(entries, index->entries,
+               index->n_entries * sizeof(file_index_entry));
+        free(index->entries);
+        index->entries = entries;
+    }
+    entry = &index->entries[index->n_entries++];
+    entry->file_size = file_size;
+    entry->hash = hash;
+    entry->mtime = mtime;
+    entry->mtime_nsec = mtime_nsec;
+    entry->name_offset = add_name(index, file_name);
+    entry->next = FILE_INDEX_NONE;
+}
+
+/**
+ * Put all the entries of `index` into buckets, as many as entries.
+ * Entries added earlier are found first. The index must not be mapped. */
+static void build_buckets( file_index *index )
+{
+    unsigned long i;
+    free(index->buckets);
+    index->n_buckets = 1;
+    while( index->n_buckets < index->n_entries ) index->n_buckets *= 2;
+    index->buckets = malloc_check(index->n_buckets * sizeof(unsigned long));
+    for( i = 0; i < index->n_buckets; i++ )
+    {
+        index->buckets[i] = FILE_INDEX_NONE;
+    }
+    for( i = index->n_entries; i-- != 0; )
+    {
+        file_index_entry *entry = &index->entries[i];
+        unsigned long *bucket =
+            &index->buckets[entry->hash & (index->n_buckets - 1)];
+        if( entry->name_offset == FILE_INDEX_NONE ) continue;
+        entry->next = *bucket;
+        *bucket = i;
+    }
+}
+
+/**
+ * Remove the entry `i` from its bucket. */
+static void unlink_entry( file_index *index, unsigned long i )
+{
+    unsigned long *link =
+        &index->buckets[index->entries[i].hash & (index->n_buckets - 1)];
+    while( *link != FILE_INDEX_NONE )
+    {
+        if( *link == i )
+        {
+            *link = index->entries[i].next;
+            break;
+        }
+        link = &index->entries[*link].next;
+    }
+    index->entries[i].next = FILE_INDEX_NONE;
+}
+
+/**
+ * Put the entry `i` at the beginning of its bucket. */
+static void link_entry( file_index *index, unsigned long i )
+{
+    unsigned long *bucket =
+        &index->buckets[index->entries[i].hash & (index->n_buckets - 1)];
+    index->entries[i].next = *bucket;
+    *bucket = i;
+}
+
+/**
+ * Return the hash of the file name `file_name` for the name table. */
+static unsigned long hash_name( char *file_name )
+{
+    return hash_update(FNV_OFFSET_BASIS, (unsigned char *)file_name,
+                       strlen(file_name));
+}
+
+/**
+ * Put the entry `i` into the name table, which must have a free slot. */
+static void insert_name( file_index *index, unsigned long i )
+{
+    unsigned long j = hash_name(index->names + index->entries[i].name_offset);
+    while( index->name_slots[j & (index->n_name_slots - 1)] != 0 ) j++;
+    index->name_slots[j & (index->n_name_slots - 1)] = i + 1;
+    index->n_used_name_slots++;
+}
+
+/**
+ * Build the name table of `index` with all its entries,
+ * at most half of the slots are used. */
+static void build_name_table( file_index *index )
+{
+    unsigned long i;
+    free(index->name_slots);
+    index->n_name_slots = 1;
+    while( index->n_name_slots < 2 * (index->n_entries + 1) )
+    {
+        index->n_name_slots *= 2;
+    }
+    index->name_slots =
+        malloc_check(index->n_name_slots * sizeof(unsigned long));
+    memset(index->name_slots, 0, index->n_name_slots * sizeof(unsigned long));
+    index->n_used_name_slots = 0;
+    for( i = 0; i < index->n_entries; i++ )
+    {
+        if( index->entries[i].name_offset == FILE_INDEX_NONE ) continue;
+        insert_name(index, i);
+    }
+}
+
+/**
+ * Return the number of the entry for the file `file_name`,
+ * or `FILE_INDEX_NONE` if there is no such entry.
+ * The name table is built when it is first needed. */
+static unsigned long find_entry_by_name( file_index *index, char *file_name )
+{
+    unsigned long j;
+    if( index->name_slots == NULL ) build_name_table(index);
+    j = hash_name(file_name);
+    for( ; index->name_slots[j & (index->n_name_slots - 1)] != 0; j++ )
+    {
+        unsigned long i =
+            index->name_slots[j & (index->n_name_slots - 1)] - 1;
+        /* entries removed stay in the table until it is built again */
+        if( index->entries[i].name_offset != FILE_INDEX_NONE
+            && strcmp(index->names + index->entries[i].name_offset,
+                      file_name) == 0 )
+        {
+            return i;
+        }
+    }
+    return FILE_INDEX_NONE;
+}
+
+/**
+ * Copy the arrays of a mapped index into allocated memory
+ * and unmap the index file, so that the arrays can grow. */
+static void make_allocated( file_index *index )
+{
+    file_index_entry *entries;
+    unsigned long *buckets;
+    char *names;
+    if( index->map == NULL ) return;
+    /* at least one byte, `malloc(0)` may return `NULL` */
+    entries = malloc_check(
+        (index->n_entries + 1) * sizeof(file_index_entry));
+    memcpy(entries, index->entries,
+           index->n_entries * sizeof(file_index_entry));
+    buckets = malloc_check(index->n_buckets * sizeof(unsigned long));
+    memcpy(buckets, index->buckets, index->n_buckets * sizeof(unsigned long));
+    names = malloc_check(index->names_size + 1);
+    memcpy(names, index->names, index->names_size);
+    munmap(index->map, index->map_size);
+    index->map = NULL;
+    index->map_size = 0;
+    index->entries = entries;
+    index->entries_capacity = index->n_entries + 1;
+    index->buckets = buckets;
+    index->names = names;
+    index->names_capacity = index->names_size + 1;
+}
+
+int file_index_check_file( file_index *index, char *file_name,
+                           file_index_change *change )
+{
+    char path[FILE_NAME_SIZE];
+    struct stat stat0;
+    unsigned long i = find_entry_by_name(index, file_name);
+    change->file_name = file_name;
+    change->exists = 0;
+    get_path(index, file_name, path);
+    if( stat(path, &stat0) == 0 && S_ISREG(stat0.st_mode) )
+    {
+        if( i != FILE_INDEX_NONE
+            && is_entry_fresh(&index->entries[i], stat0.st_size,
+                              stat0.st_mtim.tv_sec, stat0.st_mtim.tv_nsec) )
+        {
+            return 0;
+        }
+        if( hash_file(path, &change->hash, &change->file_size) == 0 )
+        {
+            index->n_hashed++;
+            change->exists = 1;
+            change->mtime = stat0.st_mtim.tv_sec;
+            change->mtime_nsec = stat0.st_mtim.tv_nsec;
+        }
+    }
+    return change->exists || i != FILE_INDEX_NONE;
+}
+
+void file_index_apply( file_index *index, file_index_change *change )
+{
+    unsigned long i = find_entry_by_name(index, change->file_name);
+    file_index_entry *entry;
+    index->modified = 1;
+    if( i != FILE_INDEX_NONE )
+    {
+        entry = &index->entries[i];
+        unlink_entry(index, i);
+        if( !change->exists )
+        {
+            printf("Removing %s from the index.\n", change->file_name);
+            entry->name_offset = FILE_INDEX_NONE;
+            return;
+        }
+        printf("Hashing %s again, it changed.\n", change->file_name);
+        entry->file_size = change->file_size;
+        entry->hash = change->hash;
+        entry->mtime = change->mtime;
+        entry->mtime_nsec = change->mtime_nsec;
+        link_entry(index, i);
+        return;
+    }
+    if( !change->exists ) return;
+
+    printf("Adding %s to the index.\n", change->file_name);
+    make_allocated(index);
+    add_entry(index, change->file_name, change->file_size, change->hash,
+              change->mtime, change->mtime_nsec);
+    i = index->n_entries - 1;
+    if( 2 * (index->n_used_name_slots + 1) > index->n_name_slots )
+    {
+        build_name_table(index);
+    }
+    else insert_name(index, i);
+    if( index->n_entries > 2 * index->n_buckets ) build_buckets(index);
+    else link_entry(index, i);
+}
+
+/**
+ * Hash the file of the entry `i` again if it changed since it was hashed,
+ * or remove the entry if the file cannot be read.
+ * Return a non-zero number if the entry was changed or removed. */
+static int refresh_entry( file_index *index, unsigned long i )
+{
+    file_index_change change;
+    if( file_index_check_file(
+            index, index->names + index->entries[i].name_offset,
+            &change) == 0 )
+    {
+        return 0;
+    }
+    file_index_apply(index, &change);
+    return 1;
+}
+
+/**
+ * Add the `n` files of `loads`, in the directory of `index`,
+ * to `index`. They are stat-ed and read in one batch,
+ * except files too big for the batch, which are read in parts.
+ * Unless `old` is `NULL`, its hashes of files with the same name,
+ * size and modification time are used instead of reading the files.
+ * `name_offset` is the offset of the file names in the paths. */
+static void add_batch( file_index *index, file_index *old, file_ring *ring,
+                       file_load *loads, unsigned int n, size_t name_offset )
+{
+    unsigned long old_is[FILE_RING_DEPTH];
+    unsigned long n_bytes = 0;
+    unsigned int i;
+    file_ring_stat(ring, loads, n);
+    for( i = 0; i < n; i++ )
+    {
+        file_load *load = &loads[i];
+        old_is[i] = FILE_INDEX_NONE;
+        if( load->file_size < 0 ) continue;
+        if( old != NULL )
+        {
+            old_is[i] = find_entry_by_name(old, load->file_name + name_offset);
+        }
+        if( old_is[i] != FILE_INDEX_NONE
+            && !is_entry_fresh(&old->entries[old_is[i]], load->file_size,
+                               load->mtime, load->mtime_nsec) )
+        {
+            old_is[i] = FILE_INDEX_NONE;
+        }
+        if( old_is[i] == FILE_INDEX_NONE
+            && n_bytes + load->file_size <= FILE_RING_BATCH_BUDGET )
+        {
+            load->read = 1;
+            n_bytes += load->file_size;
+        }
+    }
+    file_ring_read(ring, loads, n);
+
+    for( i = 0; i < n; i++ )
+    {
+        file_load *load = &loads[i];
+        char *file_name = load->file_name + name_offset;
+        unsigned long hash;
+        unsigned long file_size;
+        if( load->file_size < 0 ) continue;
+        if( old_is[i] != FILE_INDEX_NONE )
+        {
+            file_index_entry *old_entry = &old->entries[old_is[i]];
+            add_entry(index, file_name, old_entry->file_size,
+                      old_entry->hash, load->mtime, load->mtime_nsec);
+        }
+        else if( load->read )
+        {
+            /* `NULL` if reading failed */
+            if( load->data.data == NULL ) continue;
+            index->n_hashed++;
+            add_entry(index, file_name, load->data.size,
+                      file_index_hash(load->data),
+                      load->mtime, load->mtime_nsec);
+            free(load->data.data);
+        }
+        else if( hash_file(load->file_name, &hash, &file_size) == 0 )
+        {
+            index->n_hashed++;
+            add_entry(index, file_name, file_size, hash,
+                      load->mtime, load->mtime_nsec);
+        }
+    }
+}
+
+/**
+ * Return a new index of the regular files in the directory `dir_name`.
+ * Unless `old` is `NULL`, its hashes of files with the same name,
+ * size and modification time are used instead of reading the files.
+ * Return `NULL` if an error happened. */
+static file_index *scan_dir( char *dir_name, file_index *old )
+{
+    file_index *index;
+    file_ring *ring;
+    file_load loads[FILE_RING_DEPTH];
+    char *paths;
+    unsigned int n_loads = 0;
+    struct dirent *dir_entry;
+    struct stat stat0;
+    DIR *dir_stream = opendir(dir_name);
+    if( dir_stream == NULL || stat(dir_name, &stat0) != 0 )
+    {
+        perror("file_index, read directory");
+        print_accessed_path(dir_name);
+        if( dir_stream != NULL ) closedir(dir_stream);
+        return NULL;
+    }
+    index = new_empty(dir_name);
+    index->dir_mtime = stat0.st_mtim.tv_sec;
+    index->dir_mtime_nsec = stat0.st_mtim.tv_nsec;
+
+    ring = file_ring_new();
+    paths = malloc_check(FILE_RING_DEPTH * FILE_NAME_SIZE);
+    while( 1 )
+    {
+        dir_entry = readdir(dir_stream);
+        if( dir_entry != NULL )
+        {
+            loads[n_loads].file_name = paths + n_loads * FILE_NAME_SIZE;
+            get_path(index, dir_entry->d_name, loads[n_loads].file_name);
+            n_loads++;
+        }
+        if( n_loads == FILE_RING_DEPTH || (dir_entry == NULL && n_loads != 0) )
+        {
+            add_batch(index, old, ring, loads, n_loads, strlen(dir_name) + 1);
+            n_loads = 0;
+        }
+        if( dir_entry == NULL ) break;
+    }
+    free(paths);
+    if( ring != NULL ) file_ring_free(ring);
+    closedir(dir_stream);
+    build_buckets(index);
+    index->modified = 1;
+    return index;
+}
+
+file_index *file_index_new( char *dir_name )
+{
+    return scan_dir(dir_name, NULL);
+}
+
+file_index *file_index_rescan( file_index *old )
+{
+    return scan_dir(old->dir_name, old);
+}
+
+/**
+ * Return a non-zero number if the `n_entries` entries of `entries`
+ * and the `n_buckets` buckets of `buckets` of an index file
+ * refer only to entries and to names within the `names_size` bytes,
+ * and each entry is in at most one bucket once,
+ * so that walking the buckets ends. */
+static int are_links_valid( file_index_entry *entries,
+                            unsigned long n_entries,
+                            unsigned long *buckets, unsigned long n_buckets,
+                            unsigned long names_size )
+{
+    unsigned long i;
+    int r = 1;
+    char *linked;
+    for( i = 0; i < n_entries; i++ )
+    {
+        if( (entries[i].name_offset != FILE_INDEX_NONE
+             && entries[i].name_offset >= names_size)
+            || (entries[i].next != FILE_INDEX_NONE
+                && entries[i].next >= n_entries) )
+        {
+            return 0;
+        }
+    }
+    linked = malloc_check(n_entries + 1);
+    memset(linked, 0, n_entries + 1);
+    for( i = 0; r && i < n_buckets; i++ )
+    {
+        unsigned long j = buckets[i];
+        if( j != FILE_INDEX_NONE && j >= n_entries ) r = 0;
+        for( ; r && j != FILE_INDEX_NONE; j = entries[j].next )
+        {
+            if( linked[j] ) r = 0;
+            linked[j] = 1;
+        }
+    }
+    free(linked);
+    return r;
+}
+
+/**
+ * Return the index of the directory `dir_name` in the file `index_file_name`
+ * mapped into memory, or `NULL` if there is no valid index file. */
+static file_index *map_file( char *dir_name, char *index_file_name )
+{
+    file_index *index;
+    file_index_header *header;
+    struct stat stat0;
+    size_t entries_size;
+    size_t buckets_size;
+    void *map;
+    int fd = open(index_file_name, O_RDONLY);
+    if( fd < 0 ) return NULL;
+    if( fstat(fd, &stat0) != 0
+        || (size_t)stat0.st_size < sizeof(file_index_header) )
+    {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, stat0.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+               fd, 0);
+    close(fd);
+    if( map == MAP_FAILED )
+    {
+        perror("file_index, map index file");
+        print_accessed_path(index_file_name);
+        return NULL;
+    }
+
+    header = map;
+    entries_size = header->n_entries * sizeof(file_index_entry);
+    buckets_size = header->n_buckets * sizeof(unsigned long);
+    if( memcmp(header->magic, FILE_INDEX_MAGIC, sizeof(header->magic)) != 0
+        || header->entry_size != sizeof(file_index_entry)
+        || header->n_entries > (size_t)stat0.st_size
+        || header->n_buckets > (size_t)stat0.st_size
+        || header->names_size > (size_t)stat0.st_size
+        || header->n_buckets == 0
+        || (header->n_buckets & (header->n_buckets - 1)) != 0
+        || (size_t)stat0.st_size != sizeof(file_index_header)
+           + entries_size + buckets_size + header->names_size
+        || (header->names_size != 0
+            && ((char *)map)[stat0.st_size - 1] != '\0')
+        || !are_links_valid(
+            (file_index_entry *)((char *)map + sizeof(file_index_header)),
+            header->n_entries,
+            (unsigned long *)((char *)map + sizeof(file_index_header)
+                              + entries_size),
+            header->n_buckets, header->names_size) )
+    {
+        printf("The index file %s is invalid.\n", index_file_name);
+        munmap(map, stat0.st_size);
+        return NULL;
+    }
+
+    index = new_empty(dir_name);
+    index->dir_mtime = header->dir_mtime;
+    index->dir_mtime_nsec = header->dir_mtime_nsec;
+    index->n_entries = header->n_entries;
+    index->entries_capacity = header->n_entries;
+    index->entries =
+        (file_index_entry *)((char *)map + sizeof(file_index_header));
+    index->n_buckets = header->n_buckets;
+    index->buckets = (unsigned long *)((char *)index->entries + entries_size);
+    index->names_size = header->names_size;
+    index->names_capacity = header->names_size;
+    index->names = (char *)index->buckets + buckets_size;
+    index->map = map;
+    index->map_size = stat0.st_size;
+    index->validated = 0;
+    return index;
+}
+
+file_index *file_index_open( char *dir_name, char *index_file_name )
+{
+    file_index *index = map_file(dir_name, index_file_name);
+    if( index != NULL )
+    {
+        struct stat stat0;
+        if( stat(dir_name, &stat0) == 0
+            && index->dir_mtime == stat0.st_mtim.tv_sec
+            && index->dir_mtime_nsec == stat0.st_mtim.tv_nsec )
+        {
+            printf("The index file %s is up to date.\n", index_file_name);
+        }
+        else
+        {
+            file_index *old = index;
+            printf("The directory changed, updating the index file %s.\n",
+                   index_file_name);
+            index = scan_dir(dir_name, old);
+            file_index_free(old);
+        }
+    }
+    else
+    {
+        printf("Creating the index file %s.\n", index_file_name);
+        index = scan_dir(dir_name, NULL);
+    }
+
+    /* not fatal, the index works without the file */
+    if( index != NULL && index->modified )
+    {
+        file_index_save(index, index_file_name);
+    }
+    return index;
+}
+
+int file_index_save( file_index *index, char *index_file_name )
+{
+    char temp_file_name[FILE_NAME_SIZE];
+    file_index_header header;
+    FILE *stream;
+    int error = 0;
+    snprintf(temp_file_name, sizeof(temp_file_name), "%s.tmp",
+             index_file_name);
+    stream = fopen(temp_file_name, "wb");
+    if( stream == NULL )
+    {
+        perror("file_index_save, open file");
+        print_accessed_path(temp_file_name);
+        return 1;
+    }
+
+    memcpy(header.magic, FILE_INDEX_MAGIC, sizeof(header.magic));
+    header.entry_size = sizeof(file_index_entry);
+    header.dir_mtime = index->dir_mtime;
+    header.dir_mtime_nsec = index->dir_mtime_nsec;
+    header.n_entries = index->n_entries;
+    header.n_buckets = index->n_buckets;
+    header.names_size = index->names_size;
+    if( fwrite(&header, sizeof(header), 1, stream) != 1
+        || fwrite(index->entries, sizeof(file_index_entry),
+                  index->n_entries, stream) != index->n_entries
+        || fwrite(index->buckets, sizeof(unsigned long),
+                  index->n_buckets, stream) != index->n_buckets
+        || fwrite(index->names, 1, index->names_size, stream)
+           != index->names_size )
+    {
+        perror("file_index_save, write file");
+        error = 2;
+    }
+    if( fclose(stream) != 0 && error == 0 )
+    {
+        perror("file_index_save, close file");
+        error = 3;
+    }
+    if( error == 0 && rename(temp_file_name, index_file_name) != 0 )
+    {
+        perror("file_index_save, rename file");
+        error = 4;
+    }
+    if( error != 0 )
+    {
+        print_accessed_path(temp_file_name);
+        remove(temp_file_name);
+    }
+    else index->modified = 0;
+    return error;
+}
+
+void file_index_free( file_index *index )
+{
+    if( index->map != NULL ) munmap(index->map, index->map_size);
+    else
+    {
+        free(index->names);
+        free(index->buckets);
+        free(index->entries);
+    }
+    free(index->name_slots);
+    free(index->dir_name);
+    free(index);
+}
+
+char *file_index_find( file_index *index, sized_data data )
+{
+    unsigned long hash = file_index_hash(data);
+    unsigned long *bucket = &index->buckets[hash & (index->n_buckets - 1)];
+    unsigned long i = *bucket;
+    /* an index file may be damaged, indices are checked */
+    while( i < index->n_entries )
+    {
+        file_index_entry *entry = &index->entries[i];
+        if( entry->file_size == data.size && entry->hash == hash
+            && entry->name_offset < index->names_size )
+        {
+            char path[FILE_NAME_SIZE];
+            char *file_name = index->names + entry->name_offset;
+            /* the bucket changed, start over */
+            if( !index->watched && refresh_entry(index, i) != 0 )
+            {
+                i = *bucket;
+                continue;
+            }
+            get_path(index, file_name, path);
+            if( memory_file_equal(data, path) ) return file_name;
+        }
+        i = entry->next;
+    }
+
+    /* The file may have changed in place since the index was written. */
+    if( !index->validated && !index->watched )
+    {
+        printf("Checking all %lu indexed files.\n", index->n_entries);
+        for( i = 0; i < index->n_entries; i++ )
+        {
+            if( index->entries[i].name_offset < index->names_size )
+            {
+                refresh_entry(index, i);
+            }
+        }
+        index->validated = 1;
+        return file_index_find(index, data);
+    }
+    return NULL;
+}
+
+unsigned long file_index_get_memory_size( file_index *index )
+{
+    unsigned long size = sizeof(file_index) + strlen(index->dir_name) + 1;
+    if( index->map != NULL )
+    {
+        return size + index->map_size
+            + index->n_name_slots * sizeof(unsigned long);
+    }
+    return size + index->entries_capacity * sizeof(file_index_entry)
+        + index->n_buckets * sizeof(unsigned long)
+        + index->names_capacity
+        + index->n_name_slots * sizeof(unsigned long);
+}
@@ -0,0 +1,159 @@
+/**
+ * Index of the regular files in a directory by file size and content hash,
+ * to find a file with given contents without reading the directory.
+ * The index is made of flat arrays referring to each other by indices,
+ * so it does not depend on where it is in memory
+ * and an index file is used directly by mapping it into memory.
+ * For the Server. */
+
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include "common.h"
+
+/**
+ * `next` of the last entry in a bucket,
+ * `name_offset` of an entry of a file no longer in the directory */
+#define FILE_INDEX_NONE ((unsigned long)-1)
+
+/**
+ * an indexed file */
+typedef struct
+{
+    unsigned long file_size;
+    unsigned long hash; /* of the file contents, `file_index_hash` */
+
+    /* the modification time of the file when it was hashed */
+    long mtime;
+    long mtime_nsec;
+
+    unsigned long name_offset; /* of the file name in `names` */
+    unsigned long next; /* the next entry in the same bucket */
+} file_index_entry;
+
+typedef struct
+{
+    char *dir_name;
+
+    /* the modification time of the directory when it was read */
+    long dir_mtime;
+    long dir_mtime_nsec;
+
+    unsigned long n_entries;
+    unsigned long entries_capacity;
+    file_index_entry *entries;
+
+    /* a power of 2, the bucket of an entry is `hash & (n_buckets - 1)` */
+    unsigned long n_buckets;
+
+    /* the first entry of each bucket */
+    unsigned long *buckets;
+
+    /* file names terminated by `'\0'`, one after another */
+    unsigned long names_size;
+    unsigned long names_capacity;
+    char *names;
+
+    /* the mapped index file the arrays are in, `NULL` if they are allocated;
+     * the mapping is private, changes are not written to the file */
+    void *map;
+    size_t map_size;
+
+    /* entries by file name, open addressing with entry numbers plus one,
+     * `0` is an empty slot; built when first needed, at most half used */
+    unsigned long *name_slots;
+    unsigned long n_name_slots;
+    unsigned long n_used_name_slots;
+
+    /* whether the index changed since it was read from or written to a file */
+    int modified;
+
+    /* whether all entries were checked against their files
+     * since the index was read from a file */
+    int validated;
+
+    /* whether changes of files are applied by a watcher,
+     * then searches neither read files to check entries nor change the index */
+    int watched;
+
+    /* the number of files hashed since the index was created or opened */
+    unsigned long n_hashed;
+} file_index;
+
+/**
+ * a change of an indexed directory found by `file_index_check_file` */
+typedef struct
+{
+    char *file_name;
+
+    /* whether the file is a regular file and was read,
+     * otherwise its entry is removed */
+    int exists;
+
+    unsigned long file_size;
+    unsigned long hash;
+    long mtime;
+    long mtime_nsec;
+} file_index_change;
+
+/**
+ * Return the hash of `data`, 64-bit FNV-1a if `unsigned long` is 64-bit. */
+unsigned long file_index_hash( sized_data data );
+
+/**
+ * Return a new index of the regular files in the directory `dir_name`,
+ * reading all of them, or `NULL` if an error happened. */
+file_index *file_index_new( char *dir_name );
+
+/**
+ * Return a new index of the directory of `old`,
+ * reading only files with a new size or modification time.
+ * Searches in `old` may go on meanwhile.
+ * Return `NULL` if an error happened. */
+file_index *file_index_rescan( file_index *old );
+
+/**
+ * Return the index of the directory `dir_name` stored in the file
+ * `index_file_name`, mapped into memory.
+ * If the directory changed, files are added to the index or removed from it,
+ * only files with a new size or modification time are read,
+ * and the updated index is written to the file.
+ * If the index file cannot be used, a new index is created and written.
+ * Files changed in place are detected when they are candidates in a search,
+ * and all files are checked once after the first search finding nothing.
+ * Return `NULL` if an error happened. */
+file_index *file_index_open( char *dir_name, char *index_file_name );
+
+/**
+ * Write `index` to the file `index_file_name`, replacing it atomically.
+ * Return a non-zero number if an error happened. */
+int file_index_save( file_index *index, char *index_file_name );
+
+void file_index_free( file_index *index );
+
+/**
+ * Compare the file `file_name` in the directory with its entry in `index`,
+ * reading the file if it was added or changed, and write the change
+ * of the entry to `*change`, which refers to `file_name`.
+ * Searches use nothing the function changes, so they may run concurrently,
+ * but `file_index_apply` may not.
+ * Return a non-zero number if the entry has to change. */
+int file_index_check_file( file_index *index, char *file_name,
+                           file_index_change *change );
+
+/**
+ * Add, update or remove the entry of the file of `change`.
+ * A mapped index is copied into memory before an entry is added. */
+void file_index_apply( file_index *index, file_index_change *change );
+
+/**
+ * Return the name of an indexed file with the contents `data`,
+ * or `NULL` if there is no such file.
+ * Only files with the same size and hash are read to compare them. */
+char *file_index_find( file_index *index, sized_data data );
+
+/**
+ * Return the memory used by the index, in bytes. */
+unsigned long file_index_get_memory_size( file_index *index );
+
+#endif
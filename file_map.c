@@ -0,0 +1,49 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "file_map.h"
+
+file_map *file_map_open( char *file_name, size_t size )
+{
+    file_map *r;
+    void *data;
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if( fd < 0 )
+    {
+        perror("file_map_open, open");
+        print_accessed_path(file_name);
+        return NULL;
+    }
+    /* the mapping stays valid after the file is closed */
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if( data == MAP_FAILED )
+    {
+        perror("file_map_open, mmap");
+        print_accessed_path(file_name);
+        return NULL;
+    }
+    if( madvise(data, size, MADV_SEQUENTIAL) != 0 )
+    {
+        perror("file_map_open, madvise");
+    }
+    r = malloc_check(sizeof(file_map));
+    r->data.data = data;
+    r->data.size = size;
+    r->n_users = 1;
+    return r;
+}
+
+void file_map_hold( file_map *map )
+{
+    __atomic_add_fetch(&map->n_users, 1, __ATOMIC_RELAXED);
+}
+
+void file_map_release( file_map *map )
+{
+    if( __atomic_sub_fetch(&map->n_users, 1, __ATOMIC_ACQ_REL) != 0 ) return;
+    munmap(map->data.data, map->data.size);
+    free(map);
+}
@@ -0,0 +1,49 @@
+/**
+ * Files mapped into memory with `mmap`, for sending file data
+ * straight from the page cache: a data packet is sent as its headers
+ * followed by a part of the mapping, with no copy of the data.
+ * A mapping is shared by all the packets of its file, which may be sent
+ * and acknowledged in different threads, and is unmapped after the last.
+ * Reading a mapping of a file truncated meanwhile raises `SIGBUS`,
+ * so files must not shrink while they are sent.
+ * For the Client. */
+
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include "common.h"
+
+typedef struct
+{
+    sized_data data;
+
+    /* the number of holders, changed atomically */
+    unsigned int n_users;
+} file_map;
+
+/**
+ * A data packet to be sent: `head` followed by `payload`,
+ * which is a part of `map` if `map` is not `NULL`.
+ * Otherwise the whole packet is in `head` and `payload` is empty. */
+typedef struct
+{
+    sized_data head;
+    sized_data payload;
+    file_map *map;
+} mapped_packet;
+
+/**
+ * Map the `size` bytes of the file `file_name`, which must not be `0`,
+ * for reading in order, with one holder.
+ * Return `NULL` if an error happened, which is reported. */
+file_map *file_map_open( char *file_name, size_t size );
+
+/**
+ * Add a holder of `map`. */
+void file_map_hold( file_map *map );
+
+/**
+ * Remove a holder of `map`, unmapping the file after the last one. */
+void file_map_release( file_map *map );
+
+#endif
@@ -0,0 +1,438 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "file_ring.h"
+
+static int ring_enabled = 1;
+
+/** the operations that batches use */
+static const int ring_opcodes[] = {
+    IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE
+};
+
+/**
+ * Return a non-zero number if the kernel behind the ring `fd`
+ * supports all of `ring_opcodes`. */
+static int has_opcodes( int fd )
+{
+    struct io_uring_probe *probe;
+    size_t size = sizeof(struct io_uring_probe)
+        + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    unsigned int i;
+    int supported = 1;
+    probe = malloc_check(size);
+    memset(probe, 0, size);
+    if( syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                probe, IORING_OP_LAST) < 0 )
+    {
+        perror("file_ring_new, io_uring_register");
+        supported = 0;
+    }
+    for( i = 0; supported && i < sizeof(ring_opcodes) / sizeof(int); i++ )
+    {
+        int opcode = ring_opcodes[i];
+        if( opcode >= probe->ops_len
+            || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) )
+        {
+            printf("io_uring does not support the operation %d.\n",
+                   opcode);
+            supported = 0;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+void file_ring_set_enabled( int enabled )
+{
+    ring_enabled = enabled;
+}
+
+file_ring *file_ring_new( void )
+{
+    struct io_uring_params params;
+    file_ring *ring;
+    char *sq_ring;
+    char *cq_ring;
+    int fd;
+    if( !ring_enabled ) return NULL;
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, FILE_RING_DEPTH, &params);
+    if( fd < 0 )
+    {
+        perror("file_ring_new, io_uring_setup");
+        printf("Reading files without io_uring.\n");
+        return NULL;
+    }
+    if( !has_opcodes(fd) )
+    {
+        printf("Reading files without io_uring.\n");
+        close(fd);
+        return NULL;
+    }
+
+    ring = malloc_check(sizeof(file_ring));
+    ring->fd = fd;
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        /* both rings are in one mapping */
+        if( ring->cq_ring_size > ring->sq_ring_size )
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if( ring->sq_ring != MAP_FAILED
+        && !(params.features & IORING_FEAT_SINGLE_MMAP) )
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if( ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+        || ring->sqes == MAP_FAILED )
+    {
+        perror("file_ring_new, mmap");
+        printf("Reading files without io_uring.\n");
+        if( ring->sqes != MAP_FAILED ) munmap(ring->sqes, ring->sqes_size);
+        if( ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring )
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if( ring->sq_ring != MAP_FAILED )
+        {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    sq_ring = ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq_ring + params.sq_off.array);
+    cq_ring = ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    return ring;
+}
+
+void file_ring_free( file_ring *ring )
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if( ring->cq_ring != ring->sq_ring )
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+/**
+ * Return the `i`th new submission queue entry, cleared,
+ * for the operation `opcode` on the load `load_i`. */
+static struct io_uring_sqe *prepare( file_ring *ring, unsigned int i,
+                                     int opcode, unsigned int load_i )
+{
+    unsigned int index = (*ring->sq_tail + i) & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = load_i;
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+/**
+ * the result of an operation that did not complete,
+ * an operation is never cancelled otherwise as none are linked */
+#define NOT_COMPLETED (-ECANCELED)
+
+/**
+ * Submit the `n` prepared entries and wait for all their completions,
+ * writing the result of the operation on the load `i` to `results[i]`,
+ * which the caller sets to `NOT_COMPLETED` beforehand.
+ * Return a non-zero number if an error happened,
+ * then the operations not completed are left `NOT_COMPLETED`. */
+static int run( file_ring *ring, unsigned int n, int *results )
+{
+    unsigned int n_submitted = 0;
+    unsigned int n_completed = 0;
+    /* the kernel sees the entries once the tail moves past them */
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + n, __ATOMIC_RELEASE);
+    while( n_completed < n )
+    {
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if( head == tail )
+        {
+            long r = syscall(__NR_io_uring_enter, ring->fd,
+                             n - n_submitted, n - n_completed,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+            if( r < 0 && errno == EINTR ) continue;
+            if( r < 0 )
+            {
+                perror("file_ring, io_uring_enter");
+                return 1;
+            }
+            n_submitted += r;
+            continue;
+        }
+        for( ; head != tail; head++ )
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            n_completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * Report that the operation `what` on `file_name` failed
+ * with the error number `error`. */
+static void report( char *what, int error, char *file_name )
+{
+    errno = error;
+    perror(what);
+    print_accessed_path(file_name);
+}
+
+/**
+ * Return a non-zero number if an operation with the result `result`
+ * has to be done again with blocking calls,
+ * because it did not run or the kernel does not support it on that file. */
+static int needs_blocking( int result )
+{
+    return result == NOT_COMPLETED || result == -EINVAL
+        || result == -EOPNOTSUPP;
+}
+
+/**
+ * Stat the file of `load` with a blocking call. */
+static void stat_blocking( file_load *load )
+{
+    struct stat stat0;
+    if( stat(load->file_name, &stat0) != 0 )
+    {
+        report("file_ring_stat", errno, load->file_name);
+    }
+    else if( S_ISREG(stat0.st_mode) )
+    {
+        load->file_size = stat0.st_size;
+        load->mtime = stat0.st_mtim.tv_sec;
+        load->mtime_nsec = stat0.st_mtim.tv_nsec;
+    }
+}
+
+void file_ring_stat( file_ring *ring, file_load *loads, unsigned int n )
+{
+    struct statx stats[FILE_RING_DEPTH];
+    int results[FILE_RING_DEPTH];
+    unsigned int i;
+    for( i = 0; i < n; i++ )
+    {
+        loads[i].file_size = -1;
+        loads[i].read = 0;
+        loads[i].data.size = 0;
+        loads[i].data.data = NULL;
+    }
+    if( ring == NULL )
+    {
+        for( i = 0; i < n; i++ ) stat_blocking(&loads[i]);
+        return;
+    }
+
+    for( i = 0; i < n; i++ )
+    {
+        struct io_uring_sqe *sqe = prepare(ring, i, IORING_OP_STATX, i);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)loads[i].file_name;
+        sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+        sqe->off = (unsigned long)&stats[i];
+        results[i] = NOT_COMPLETED;
+    }
+    run(ring, n, results);
+    for( i = 0; i < n; i++ )
+    {
+        if( needs_blocking(results[i]) ) stat_blocking(&loads[i]);
+        else if( results[i] < 0 )
+        {
+            report("file_ring_stat", -results[i], loads[i].file_name);
+        }
+        else if( S_ISREG(stats[i].stx_mode) )
+        {
+            loads[i].file_size = stats[i].stx_size;
+            loads[i].mtime = stats[i].stx_mtime.tv_sec;
+            loads[i].mtime_nsec = stats[i].stx_mtime.tv_nsec;
+        }
+    }
+}
+
+/**
+ * Free the data of `load`, after an error. */
+static void drop_data( file_load *load )
+{
+    free(load->data.data);
+    load->data.data = NULL;
+}
+
+/**
+ * Read the file of `load` with blocking calls. */
+static void read_blocking( file_load *load )
+{
+    if( read_file_all(load->data, load->file_name) != 0 ) drop_data(load);
+}
+
+void file_ring_read( file_ring *ring, file_load *loads, unsigned int n )
+{
+    int results[FILE_RING_DEPTH];
+    int fds[FILE_RING_DEPTH];
+    unsigned long offsets[FILE_RING_DEPTH];
+    int blocking[FILE_RING_DEPTH];
+    unsigned int n_queued;
+    unsigned int i;
+    for( i = 0; i < n; i++ )
+    {
+        fds[i] = -1;
+        offsets[i] = 0;
+        blocking[i] = 0;
+        if( loads[i].read && loads[i].file_size >= 0 )
+        {
+            loads[i].data = malloc_sized_check(loads[i].file_size);
+        }
+    }
+    if( ring == NULL )
+    {
+        for( i = 0; i < n; i++ )
+        {
+            if( loads[i].data.data != NULL ) read_blocking(&loads[i]);
+        }
+        return;
+    }
+
+    /* open all files at once */
+    n_queued = 0;
+    for( i = 0; i < n; i++ )
+    {
+        struct io_uring_sqe *sqe;
+        if( loads[i].data.data == NULL || loads[i].data.size == 0 ) continue;
+        sqe = prepare(ring, n_queued++, IORING_OP_OPENAT, i);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)loads[i].file_name;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    for( i = 0; i < n; i++ ) results[i] = NOT_COMPLETED;
+    if( n_queued != 0 ) run(ring, n_queued, results);
+    for( i = 0; i < n; i++ )
+    {
+        if( loads[i].data.data == NULL || loads[i].data.size == 0 ) continue;
+        if( results[i] >= 0 ) fds[i] = results[i];
+        else if( needs_blocking(results[i]) ) blocking[i] = 1;
+        else
+        {
+            report("file_ring_read, open", -results[i], loads[i].file_name);
+            drop_data(&loads[i]);
+        }
+    }
+
+    /* read all files at once, again for the rest of short reads */
+    while( 1 )
+    {
+        n_queued = 0;
+        for( i = 0; i < n; i++ )
+        {
+            struct io_uring_sqe *sqe;
+            if( fds[i] < 0 || blocking[i] || loads[i].data.data == NULL
+                || offsets[i] == loads[i].data.size )
+            {
+                continue;
+            }
+            sqe = prepare(ring, n_queued++, IORING_OP_READ, i);
+            sqe->fd = fds[i];
+            sqe->addr = (unsigned long)((char *)loads[i].data.data
+                                        + offsets[i]);
+            sqe->len = loads[i].data.size - offsets[i];
+            sqe->off = offsets[i];
+        }
+        if( n_queued == 0 ) break;
+        for( i = 0; i < n; i++ ) results[i] = NOT_COMPLETED;
+        run(ring, n_queued, results);
+        for( i = 0; i < n; i++ )
+        {
+            if( fds[i] < 0 || blocking[i] || loads[i].data.data == NULL
+                || offsets[i] == loads[i].data.size )
+            {
+                continue;
+            }
+            if( results[i] > 0 ) offsets[i] += results[i];
+            else if( needs_blocking(results[i]) ) blocking[i] = 1;
+            else if( results[i] == 0 )
+            {
+                printf("Read less data (%lu) than expected (%lu)"
+                       " from file %s\n", offsets[i],
+                       (unsigned long)loads[i].data.size,
+                       loads[i].file_name);
+                drop_data(&loads[i]);
+            }
+            else
+            {
+                report("file_ring_read, read", -results[i],
+                       loads[i].file_name);
+                drop_data(&loads[i]);
+            }
+        }
+    }
+
+    /* close all files at once */
+    n_queued = 0;
+    for( i = 0; i < n; i++ )
+    {
+        struct io_uring_sqe *sqe;
+        if( fds[i] < 0 ) continue;
+        sqe = prepare(ring, n_queued++, IORING_OP_CLOSE, i);
+        sqe->fd = fds[i];
+    }
+    for( i = 0; i < n; i++ ) results[i] = NOT_COMPLETED;
+    if( n_queued != 0 ) run(ring, n_queued, results);
+    for( i = 0; i < n; i++ )
+    {
+        /* the files must not stay open,
+         * but a descriptor closed by the ring may be reused already */
+        if( fds[i] >= 0 && needs_blocking(results[i]) ) close(fds[i]);
+    }
+
+    /* read again what the ring could not */
+    for( i = 0; i < n; i++ )
+    {
+        if( blocking[i] && loads[i].data.data != NULL )
+        {
+            read_blocking(&loads[i]);
+        }
+    }
+}
@@ -0,0 +1,99 @@
+/**
+ * Batched file I/O with io_uring, used through raw system calls.
+ * The files of a batch are stat-ed with one submission,
+ * then the chosen ones are opened, read and closed
+ * with one submission each, instead of several system calls per file.
+ * Where io_uring is not available, the same operations block
+ * one file at a time.
+ * For the Client and the Server. */
+
+#ifndef FILE_RING_H
+#define FILE_RING_H
+
+#include "common.h"
+
+/**
+ * the greatest number of files in a batch,
+ * which is also the number of entries of the submission queue */
+#define FILE_RING_DEPTH 64
+
+/**
+ * the greatest size of all files of a batch read into memory, in bytes,
+ * other files are left for the caller to read in parts */
+#define FILE_RING_BATCH_BUDGET 0x400000
+
+/**
+ * A file of a batch. */
+typedef struct
+{
+    char *file_name;
+
+    /* Written by `file_ring_stat`, `file_size` is negative
+     * if the file is not a regular file or could not be stat-ed. */
+    long file_size;
+    long mtime;
+    long mtime_nsec;
+
+    /* set by the caller to make `file_ring_read` read the file */
+    int read;
+
+    /* Written by `file_ring_read`, the contents of the file,
+     * owned by the caller, `NULL` if it was not read
+     * or an error happened. */
+    sized_data data;
+} file_load;
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef struct
+{
+    int fd;
+
+    /* the submission queue ring, the fields point into `sq_ring` */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* the completion queue ring, may be the same mapping as `sq_ring` */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+} file_ring;
+
+/**
+ * Make `file_ring_new` fail from now on if `enabled` is `0`,
+ * so that files are read with blocking calls. */
+void file_ring_set_enabled( int enabled );
+
+/**
+ * Return a new ring, or `NULL` if io_uring is not available,
+ * lacks one of the operations used, or is disabled,
+ * then `NULL` makes the other functions block instead. */
+file_ring *file_ring_new( void );
+
+void file_ring_free( file_ring *ring );
+
+/**
+ * Stat the `n` files of `loads`, no more than `FILE_RING_DEPTH`,
+ * and set their `read` to `0` and `data` to nothing.
+ * Errors are reported. */
+void file_ring_stat( file_ring *ring, file_load *loads, unsigned int n );
+
+/**
+ * Read the whole files of the `n` loads of `loads` which have `read` set,
+ * of the size found by `file_ring_stat`.
+ * Errors are reported, those files have no `data`.
+ * With both functions, the operations that the ring fails to run
+ * or does not support on a file are done again with blocking calls. */
+void file_ring_read( file_ring *ring, file_load *loads, unsigned int n );
+
+#endif
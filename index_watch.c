@@ -0,0 +1,316 @@
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "file_index.h"
+#include "index_watch.h"
+
+/**
+ * Files are added by writing them or moving them into the directory,
+ * changed by writing them and removed by deleting them
+ * or moving them out of the directory. */
+#define INDEX_WATCH_EVENTS (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE \
+                            | IN_MOVED_FROM | IN_MOVED_TO)
+
+/**
+ * the size of the buffer inotify events are read into, in bytes */
+#define INDEX_WATCH_BUFFER_SIZE 0x10000
+
+/**
+ * Read the files of the batch which changed,
+ * then apply all the changes to the index at once and empty the batch.
+ * Unless `dir_stat` is `NULL`, the index is up to date with the directory
+ * described by it when the batch is applied. */
+static void apply_batch( index_watch *watch, struct stat *dir_stat )
+{
+    file_index_change changes[INDEX_WATCH_BATCH_SIZE];
+    unsigned int n_changes = 0;
+    unsigned int i;
+    /* only this thread changes the index, searches may go on meanwhile */
+    for( i = 0; i < watch->batch_size; i++ )
+    {
+        if( file_index_check_file(watch->index, watch->batch[i],
+                                  &changes[n_changes]) != 0 )
+        {
+            n_changes++;
+        }
+    }
+
+    pthread_rwlock_wrlock(&watch->lock);
+    for( i = 0; i < n_changes; i++ )
+    {
+        file_index_apply(watch->index, &changes[i]);
+    }
+    if( dir_stat != NULL
+        && (watch->index->dir_mtime != dir_stat->st_mtim.tv_sec
+            || watch->index->dir_mtime_nsec != dir_stat->st_mtim.tv_nsec) )
+    {
+        watch->index->dir_mtime = dir_stat->st_mtim.tv_sec;
+        watch->index->dir_mtime_nsec = dir_stat->st_mtim.tv_nsec;
+        watch->index->modified = 1;
+    }
+    pthread_rwlock_unlock(&watch->lock);
+
+    watch->n_changes += n_changes;
+    watch->batch_size = 0;
+}
+
+/**
+ * Add the file `file_name` to the batch unless it is there already,
+ * applying the batch first if it is full.
+ * `file_name` must not be in the index, which may change then. */
+static void add_to_batch( index_watch *watch, char *file_name )
+{
+    unsigned int i;
+    if( strlen(file_name) > NAME_MAX ) return;
+    for( i = 0; i < watch->batch_size; i++ )
+    {
+        if( strcmp(watch->batch[i], file_name) == 0 ) return;
+    }
+    if( watch->batch_size == INDEX_WATCH_BATCH_SIZE )
+    {
+        apply_batch(watch, NULL);
+    }
+    strcpy(watch->batch[watch->batch_size++], file_name);
+}
+
+/**
+ * Check all files in the directory and all indexed files,
+ * for changes made before the directory was watched. */
+static void check_all( index_watch *watch )
+{
+    char *dir_name = watch->index->dir_name;
+    struct stat dir_stat;
+    struct dirent *dir_entry;
+    unsigned long i;
+    /* before reading the directory, a later change has an event */
+    int stat_error = stat(dir_name, &dir_stat);
+    DIR *dir_stream = opendir(dir_name);
+    if( stat_error != 0 || dir_stream == NULL )
+    {
+        perror("index_watch, read directory");
+        print_accessed_path(dir_name);
+    }
+    if( dir_stream != NULL )
+    {
+        while( (dir_entry = readdir(dir_stream)) != NULL )
+        {
+            add_to_batch(watch, dir_entry->d_name);
+        }
+        closedir(dir_stream);
+    }
+
+    /* for files no longer in the directory */
+    for( i = 0; i < watch->index->n_entries; i++ )
+    {
+        file_index_entry *entry = &watch->index->entries[i];
+        char file_name[NAME_MAX + 1];
+        if( entry->name_offset == FILE_INDEX_NONE ) continue;
+        snprintf(file_name, sizeof(file_name), "%s",
+                 watch->index->names + entry->name_offset);
+        add_to_batch(watch, file_name);
+    }
+    apply_batch(watch, stat_error == 0 ? &dir_stat : NULL);
+    watch->index->validated = 1;
+}
+
+/**
+ * Replace the index by a new one after events were lost. */
+static void rescan( index_watch *watch )
+{
+    file_index *old = watch->index;
+    file_index *index;
+    printf("Events of the directory %s were lost, reading it again.\n",
+           old->dir_name);
+    watch->n_rescans++;
+    watch->batch_size = 0;
+    index = file_index_rescan(old);
+    if( index == NULL ) return;
+    index->watched = 1;
+    pthread_rwlock_wrlock(&watch->lock);
+    watch->index = index;
+    pthread_rwlock_unlock(&watch->lock);
+    file_index_free(old);
+}
+
+/**
+ * Read all pending events into the batch.
+ * Return a non-zero number if events were lost. */
+static int read_events( index_watch *watch )
+{
+    union
+    {
+        struct inotify_event event; /* for the alignment */
+        char bytes[INDEX_WATCH_BUFFER_SIZE];
+    } buffer;
+    ssize_t n_read;
+    int lost = 0;
+    while( (n_read = read(watch->inotify_fd, buffer.bytes,
+                          sizeof(buffer.bytes))) > 0 )
+    {
+        char *p = buffer.bytes;
+        while( p < buffer.bytes + n_read )
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+            watch->n_events++;
+            if( event->mask & IN_Q_OVERFLOW ) lost = 1;
+            else if( event->mask & IN_IGNORED )
+            {
+                printf("The directory %s is no longer watched.\n",
+                       watch->index->dir_name);
+            }
+            else if( event->len != 0 && !lost )
+            {
+                add_to_batch(watch, event->name);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if( n_read < 0 && errno != EAGAIN )
+    {
+        perror("index_watch, read events");
+    }
+    return lost;
+}
+
+/**
+ * The thread of the watcher. */
+static void *run( void *watch0 )
+{
+    index_watch *watch = watch0;
+    struct pollfd fds[2];
+    check_all(watch);
+
+    fds[0].fd = watch->stop_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = watch->inotify_fd;
+    fds[1].events = POLLIN;
+    while( 1 )
+    {
+        struct stat dir_stat;
+        int stat_error;
+        int n_ready = poll(fds, 2, -1);
+        if( n_ready < 0 && errno == EINTR ) continue;
+        if( n_ready < 0 )
+        {
+            perror("index_watch, poll");
+            break;
+        }
+        if( fds[0].revents != 0 ) break;
+
+        /* Collect the events following soon after,
+         * like those of a file copied into the directory in parts. */
+        if( poll(fds, 1, INDEX_WATCH_DELAY) != 0 ) break;
+
+        /* before reading the events, a later change has an event */
+        stat_error = stat(watch->index->dir_name, &dir_stat);
+        watch->n_batches++;
+        if( read_events(watch) != 0 ) rescan(watch);
+        else apply_batch(watch, stat_error == 0 ? &dir_stat : NULL);
+    }
+    return NULL;
+}
+
+index_watch *index_watch_new( file_index *index )
+{
+    index_watch *watch;
+    pthread_rwlockattr_t lock_attr;
+    int error;
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if( inotify_fd < 0 )
+    {
+        perror("index_watch_new, inotify_init1");
+        return NULL;
+    }
+    if( inotify_add_watch(inotify_fd, index->dir_name,
+                          INDEX_WATCH_EVENTS) < 0 )
+    {
+        perror("index_watch_new, inotify_add_watch");
+        print_accessed_path(index->dir_name);
+        close(inotify_fd);
+        return NULL;
+    }
+    watch = malloc_check(sizeof(index_watch));
+    if( pipe(watch->stop_pipe) != 0 )
+    {
+        perror("index_watch_new, pipe");
+        close(inotify_fd);
+        free(watch);
+        return NULL;
+    }
+    watch->index = index;
+    watch->inotify_fd = inotify_fd;
+    watch->batch_size = 0;
+    watch->n_events = 0;
+    watch->n_batches = 0;
+    watch->n_changes = 0;
+    watch->n_rescans = 0;
+
+    /* a batch is applied soon even if searches follow each other closely */
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr,
+        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&watch->lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+
+    index->watched = 1;
+    error = pthread_create(&watch->thread, NULL, run, watch);
+    if( error != 0 )
+    {
+        errno = error;
+        perror("index_watch_new, pthread_create");
+        index->watched = 0;
+        pthread_rwlock_destroy(&watch->lock);
+        close(watch->stop_pipe[0]);
+        close(watch->stop_pipe[1]);
+        close(inotify_fd);
+        free(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+file_index *index_watch_free( index_watch *watch )
+{
+    file_index *index;
+    char stop = 0;
+    if( write(watch->stop_pipe[1], &stop, 1) != 1 )
+    {
+        perror("index_watch_free, write");
+    }
+    pthread_join(watch->thread, NULL);
+    printf("Index watch: %lu events in %lu batches, %lu entries changed,"
+           " %lu rescans.\n",
+           watch->n_events, watch->n_batches, watch->n_changes,
+           watch->n_rescans);
+
+    index = watch->index;
+    index->watched = 0;
+    pthread_rwlock_destroy(&watch->lock);
+    close(watch->stop_pipe[0]);
+    close(watch->stop_pipe[1]);
+    close(watch->inotify_fd);
+    free(watch);
+    return index;
+}
+
+char *index_watch_find( index_watch *watch, sized_data data,
+                        char *file_name )
+{
+    char *r;
+    pthread_rwlock_rdlock(&watch->lock);
+    r = file_index_find(watch->index, data);
+    if( r != NULL )
+    {
+        snprintf(file_name, FILE_NAME_SIZE, "%s", r);
+        r = file_name;
+    }
+    pthread_rwlock_unlock(&watch->lock);
+    return r;
+}
@@ -0,0 +1,70 @@
+/**
+ * Watcher keeping a file index up to date with inotify
+ * while the directory changes. Changes are applied in batches
+ * by a thread of the watcher; files are read outside of the lock,
+ * so searches only wait while a batch is put into the index.
+ * For the Server. */
+
+#ifndef INDEX_WATCH_H
+#define INDEX_WATCH_H
+
+#include <limits.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "file_index.h"
+
+/**
+ * Events are collected for this long after the first one of a batch,
+ * so a file added to the directory is found in a search after that
+ * and the time to read it. In milliseconds. */
+#define INDEX_WATCH_DELAY 20
+
+/**
+ * the maximal number of files changed in a batch */
+#define INDEX_WATCH_BATCH_SIZE 256
+
+typedef struct
+{
+    /* replaced by a new index if events were lost */
+    file_index *index;
+
+    /* held for reading during searches, for writing when `index` changes */
+    pthread_rwlock_t lock;
+
+    int inotify_fd;
+
+    /* written to stop the thread */
+    int stop_pipe[2];
+
+    pthread_t thread;
+
+    /* names of the files changed in the current batch, each once */
+    unsigned int batch_size;
+    char batch[INDEX_WATCH_BATCH_SIZE][NAME_MAX + 1];
+
+    /* for statistics */
+    unsigned long n_events;
+    unsigned long n_batches;
+    unsigned long n_changes; /* of entries */
+    unsigned long n_rescans; /* after events were lost */
+} index_watch;
+
+/**
+ * Start watching the directory of `index`, which the watcher owns then.
+ * Files changed since the index was made are found first.
+ * Return `NULL` if an error happened, then `index` is not changed. */
+index_watch *index_watch_new( file_index *index );
+
+/**
+ * Stop the watcher and free it. Return the index, owned by the caller. */
+file_index *index_watch_free( index_watch *watch );
+
+/**
+ * Do the same as `file_index_find`, but copy the file name found
+ * to `file_name` of `FILE_NAME_SIZE` bytes and return it,
+ * since the index may change after the search. */
+char *index_watch_find( index_watch *watch, sized_data data,
+                        char *file_name );
+
+#endif
@@ -0,0 +1,421 @@
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#include <string.h>
+
+#include "send_packet.h"
+#include "protocol.h"
+#include "packet_batch.h"
+
+/**
+ * the greatest number of datagrams sent as one buffer,
+ * which all systems supporting segmentation offload accept */
+#define MAX_SENT_SEGMENTS 64
+
+/**
+ * the greatest number of datagrams received in one buffer with GRO,
+ * later systems send up to this many as one buffer */
+#define MAX_RECEIVED_SEGMENTS 128
+
+/**
+ * the size of the control message of a message,
+ * which holds the segment size */
+#define CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+packet_batch *packet_batch_new( unsigned int capacity, size_t buffer_size )
+{
+    packet_batch *r = malloc_check(sizeof(packet_batch));
+    r->capacity = capacity;
+    r->size = 0;
+    r->messages = malloc_check(capacity * sizeof(struct mmsghdr));
+    r->iovecs = malloc_check(2 * capacity * sizeof(struct iovec));
+    r->addresses = malloc_check(capacity * sizeof(struct sockaddr_storage));
+    r->pool = NULL;
+    r->segment = 0;
+    r->datagrams = NULL;
+    r->controls = NULL;
+    r->segment_messages = NULL;
+    r->segment_iovecs = NULL;
+    r->segment_firsts = NULL;
+    if( buffer_size == 0 ) r->buffers = NULL;
+    else
+    {
+        unsigned int i;
+        r->buffers = malloc_check(capacity * sizeof(sized_data));
+        for( i = 0; i < capacity; i++ )
+        {
+            r->buffers[i] = malloc_sized_check(buffer_size);
+        }
+    }
+    return r;
+}
+
+packet_batch *packet_batch_new_pooled( unsigned int capacity,
+                                       packet_pool *pool )
+{
+    packet_batch *r = packet_batch_new(capacity, 0);
+    unsigned int i;
+    r->pool = pool;
+    r->buffers = malloc_check(capacity * sizeof(sized_data));
+    for( i = 0; i < capacity; i++ ) r->buffers[i] = packet_pool_get(pool);
+    return r;
+}
+
+void packet_batch_free( packet_batch *batch )
+{
+    if( batch->buffers != NULL )
+    {
+        unsigned int i;
+        for( i = 0; i < batch->capacity; i++ )
+        {
+            if( batch->pool != NULL )
+            {
+                packet_pool_put(batch->pool, batch->buffers[i].data);
+            }
+            else free(batch->buffers[i].data);
+        }
+        free(batch->buffers);
+    }
+    free(batch->segment_firsts);
+    free(batch->segment_iovecs);
+    free(batch->segment_messages);
+    free(batch->controls);
+    free(batch->datagrams);
+    free(batch->addresses);
+    free(batch->iovecs);
+    free(batch->messages);
+    free(batch);
+}
+
+void packet_batch_enable_segmentation( packet_batch *batch )
+{
+    if( batch->controls == NULL )
+    {
+        batch->controls = malloc_check(batch->capacity * CONTROL_SIZE);
+    }
+    batch->segment_messages =
+        malloc_check(batch->capacity * sizeof(struct mmsghdr));
+    batch->segment_iovecs =
+        malloc_check(2 * batch->capacity * sizeof(struct iovec));
+    batch->segment_firsts =
+        malloc_check(batch->capacity * sizeof(unsigned int));
+    batch->segment = 1;
+}
+
+void packet_batch_enable_gro( packet_batch *batch )
+{
+    if( batch->controls == NULL )
+    {
+        batch->controls = malloc_check(batch->capacity * CONTROL_SIZE);
+    }
+    batch->datagrams = malloc_check(batch->capacity * MAX_RECEIVED_SEGMENTS
+                                    * sizeof(packet_batch_datagram));
+}
+
+void packet_batch_clear( packet_batch *batch )
+{
+    batch->size = 0;
+}
+
+int packet_batch_is_full( packet_batch *batch )
+{
+    return batch->size == batch->capacity;
+}
+
+sized_data packet_batch_next_buffer( packet_batch *batch )
+{
+    return batch->buffers[batch->size];
+}
+
+/**
+ * Make the `i`th message refer to `packet`, followed by `payload`
+ * if it is not empty, and the `i`th address. */
+static void packet_batch_set( packet_batch *batch, unsigned int i,
+                              sized_data packet, sized_data payload,
+                              socklen_t address_length )
+{
+    struct msghdr *header = &batch->messages[i].msg_hdr;
+    struct iovec *iovecs = &batch->iovecs[2 * i];
+    iovecs[0].iov_base = packet.data;
+    iovecs[0].iov_len = packet.size;
+    iovecs[1].iov_base = payload.data;
+    iovecs[1].iov_len = payload.size;
+    memset(header, 0, sizeof(*header));
+    header->msg_name = &batch->addresses[i];
+    header->msg_namelen = address_length;
+    header->msg_iov = iovecs;
+    header->msg_iovlen = payload.size != 0 ? 2 : 1;
+    batch->messages[i].msg_len = 0;
+}
+
+void packet_batch_add( packet_batch *batch, sized_data packet,
+                       struct sockaddr *address, socklen_t address_length )
+{
+    sized_data payload;
+    payload.size = 0;
+    payload.data = NULL;
+    packet_batch_add_parts(batch, packet, payload, address, address_length);
+}
+
+void packet_batch_add_parts( packet_batch *batch, sized_data head,
+                             sized_data payload, struct sockaddr *address,
+                             socklen_t address_length )
+{
+    if( packet_batch_is_full(batch) )
+    {
+        fputs("packet_batch_add: The batch is full.\n", stderr);
+        error_exit();
+    }
+    memcpy(&batch->addresses[batch->size], address, address_length);
+    packet_batch_set(batch, batch->size, head, payload, address_length);
+    batch->size++;
+}
+
+sized_data packet_batch_get( packet_batch *batch, unsigned int i )
+{
+    sized_data r;
+    if( batch->datagrams != NULL ) return batch->datagrams[i].data;
+    r.size = batch->messages[i].msg_len;
+    r.data = batch->iovecs[2 * i].iov_base;
+    return r;
+}
+
+void *packet_batch_get_buffer( packet_batch *batch, unsigned int i )
+{
+    if( batch->datagrams != NULL ) i = batch->datagrams[i].message;
+    return batch->buffers[i].data;
+}
+
+struct sockaddr *packet_batch_get_address( packet_batch *batch,
+                                           unsigned int i,
+                                           socklen_t *address_length )
+{
+    if( batch->datagrams != NULL ) i = batch->datagrams[i].message;
+    *address_length = batch->messages[i].msg_hdr.msg_namelen;
+    return (struct sockaddr *)&batch->addresses[i];
+}
+
+/**
+ * Return the size of the datagram of `header`. */
+static size_t get_message_size( struct msghdr *header )
+{
+    size_t r = 0;
+    size_t i;
+    for( i = 0; i < header->msg_iovlen; i++ )
+    {
+        r += header->msg_iov[i].iov_len;
+    }
+    return r;
+}
+
+/**
+ * Send the `n` messages of `messages` with as few `sendmmsg` calls
+ * as possible, setting `*n_sent` to the number of messages sent.
+ * Return a non-zero number if an error happened, which is left in `errno`.
+ */
+static int send_messages( int udp_socket, struct mmsghdr *messages,
+                          unsigned int n, unsigned int *n_sent )
+{
+    *n_sent = 0;
+    while( *n_sent < n )
+    {
+        int n_sent1 = sendmmsg(udp_socket, messages + *n_sent, n - *n_sent,
+                               0);
+        if( n_sent1 < 0 ) return 1;
+        *n_sent += n_sent1;
+    }
+    return 0;
+}
+
+/**
+ * Make the segmented message `k` of the datagrams of the batch
+ * from the `first`th of its `n` first datagrams on,
+ * and return the number of datagrams in it. */
+static unsigned int add_segmented( packet_batch *batch, unsigned int k,
+                                   unsigned int first, unsigned int n,
+                                   struct iovec *iovecs )
+{
+    struct msghdr *first_header = &batch->messages[first].msg_hdr;
+    struct msghdr *header = &batch->segment_messages[k].msg_hdr;
+    size_t segment_size = get_message_size(first_header);
+    size_t size = 0;
+    unsigned int i;
+    *header = *first_header;
+    header->msg_iov = iovecs;
+    header->msg_iovlen = 0;
+    header->msg_control = NULL;
+    header->msg_controllen = 0;
+    for( i = first; i < n && i - first < MAX_SENT_SEGMENTS; i++ )
+    {
+        struct msghdr *next = &batch->messages[i].msg_hdr;
+        size_t next_size = get_message_size(next);
+        if( next_size > segment_size || size + next_size > UDP_SIZE
+            || next->msg_namelen != header->msg_namelen
+            || memcmp(next->msg_name, header->msg_name,
+                      header->msg_namelen) != 0 )
+        {
+            break;
+        }
+        memcpy(iovecs + header->msg_iovlen, next->msg_iov,
+               next->msg_iovlen * sizeof(struct iovec));
+        header->msg_iovlen += next->msg_iovlen;
+        size += next_size;
+        /* only the last datagram may be shorter */
+        if( next_size != segment_size )
+        {
+            i++;
+            break;
+        }
+    }
+    if( i - first > 1 )
+    {
+        struct cmsghdr *control;
+        unsigned short segment_size1 = segment_size;
+        header->msg_control = batch->controls + k * CONTROL_SIZE;
+        header->msg_controllen = CMSG_SPACE(sizeof(segment_size1));
+        control = CMSG_FIRSTHDR(header);
+        control->cmsg_level = IPPROTO_UDP;
+        control->cmsg_type = UDP_SEGMENT;
+        control->cmsg_len = CMSG_LEN(sizeof(segment_size1));
+        memcpy(CMSG_DATA(control), &segment_size1, sizeof(segment_size1));
+    }
+    batch->segment_messages[k].msg_len = 0;
+    return i - first;
+}
+
+/**
+ * Send the datagrams of the batch which `drop_packets` does not drop,
+ * making as few segmented messages of them as possible.
+ * Return a non-zero number if an error happened. */
+static int send_segmented( packet_batch *batch, int udp_socket )
+{
+    unsigned int n = drop_packets(batch->messages, batch->size);
+    unsigned int n_segmented = 0;
+    unsigned int n_iovecs = 0;
+    unsigned int n_sent;
+    unsigned int i = 0;
+    while( i < n )
+    {
+        batch->segment_firsts[n_segmented] = i;
+        i += add_segmented(batch, n_segmented, i, n,
+                           batch->segment_iovecs + n_iovecs);
+        n_iovecs += batch->segment_messages[n_segmented].msg_hdr.msg_iovlen;
+        n_segmented++;
+    }
+    if( send_messages(udp_socket, batch->segment_messages, n_segmented,
+                      &n_sent) == 0 )
+    {
+        return 0;
+    }
+    /* the system or the device cannot split the buffer */
+    if( (errno != EIO && errno != EINVAL)
+        || batch->segment_messages[n_sent].msg_hdr.msg_controllen == 0 )
+    {
+        return 1;
+    }
+    perror("send segmented packets");
+    printf("Sending datagrams without segmentation offload.\n");
+    batch->segment = 0;
+    i = batch->segment_firsts[n_sent];
+    return send_messages(udp_socket, batch->messages + i, n - i, &n_sent);
+}
+
+int packet_batch_send( packet_batch *batch, int udp_socket )
+{
+    int error = 0;
+    if( batch->size != 0
+        && (batch->segment ? send_segmented(batch, udp_socket) != 0
+            : send_packets(udp_socket, batch->messages, batch->size, 0) < 0) )
+    {
+        perror("send packets");
+        error = 1;
+    }
+    packet_batch_clear(batch);
+    return error;
+}
+
+/**
+ * Add the datagrams received in the `i`th message to `datagrams`,
+ * several if the system coalesced them (GRO). */
+static void add_received( packet_batch *batch, unsigned int i )
+{
+    struct msghdr *header = &batch->messages[i].msg_hdr;
+    struct cmsghdr *control;
+    size_t size = batch->messages[i].msg_len;
+    size_t segment_size = size;
+    size_t offset = 0;
+    for( control = CMSG_FIRSTHDR(header); control != NULL;
+         control = CMSG_NXTHDR(header, control) )
+    {
+        if( control->cmsg_level == IPPROTO_UDP
+            && control->cmsg_type == UDP_GRO )
+        {
+            int segment_size1;
+            memcpy(&segment_size1, CMSG_DATA(control), sizeof(segment_size1));
+            if( segment_size1 > 0 ) segment_size = segment_size1;
+        }
+    }
+    do
+    {
+        packet_batch_datagram *datagram;
+        if( batch->size == batch->capacity * MAX_RECEIVED_SEGMENTS )
+        {
+            printf("Dropping received datagrams beyond the batch.\n");
+            return;
+        }
+        datagram = &batch->datagrams[batch->size++];
+        datagram->data.data = (char *)batch->buffers[i].data + offset;
+        datagram->data.size =
+            size - offset < segment_size ? size - offset : segment_size;
+        datagram->message = i;
+        offset += datagram->data.size;
+    } while( offset < size );
+}
+
+int packet_batch_receive( packet_batch *batch, int udp_socket, int flags )
+{
+    unsigned int i;
+    int n;
+    sized_data no_payload;
+    no_payload.size = 0;
+    no_payload.data = NULL;
+    if( batch->pool != NULL )
+    {
+        /* the last received datagrams may still be held */
+        for( i = 0; i < batch->capacity; i++ )
+        {
+            batch->buffers[i] =
+                packet_pool_renew(batch->pool, batch->buffers[i].data);
+        }
+    }
+    for( i = 0; i < batch->capacity; i++ )
+    {
+        packet_batch_set(batch, i, batch->buffers[i], no_payload,
+                         sizeof(struct sockaddr_storage));
+        if( batch->datagrams != NULL )
+        {
+            batch->messages[i].msg_hdr.msg_control =
+                batch->controls + i * CONTROL_SIZE;
+            batch->messages[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        }
+    }
+    batch->size = 0;
+    n = recvmmsg(udp_socket, batch->messages, batch->capacity, flags, NULL);
+    if( n < 0 )
+    {
+        /* a timeout or a signal */
+        if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+        {
+            return 0;
+        }
+        perror("receive packets");
+        return -1;
+    }
+    if( batch->datagrams == NULL )
+    {
+        batch->size = n;
+        return n;
+    }
+    for( i = 0; i < (unsigned int)n; i++ ) add_received(batch, i);
+    return batch->size;
+}
@@ -0,0 +1,144 @@
+/**
+ * Batch of UDP datagrams sent with one `sendmmsg`
+ * or received with one `recvmmsg` system call. */
+
+#ifndef PACKET_BATCH_H
+#define PACKET_BATCH_H
+
+#include <sys/socket.h>
+
+#include "common.h"
+#include "packet_pool.h"
+
+/**
+ * the number of datagrams in a batch by default */
+#define PACKET_BATCH_SIZE 64
+
+/**
+ * A received datagram, with GRO several datagrams share a buffer. */
+typedef struct
+{
+    sized_data data;
+    unsigned int message; /* the index of the message it was received in */
+} packet_batch_datagram;
+
+typedef struct
+{
+    unsigned int capacity;
+    unsigned int size; /* the number of datagrams in the batch */
+    struct mmsghdr *messages;
+    struct iovec *iovecs; /* two per datagram, for `packet_batch_add_parts` */
+    struct sockaddr_storage *addresses;
+
+    /* Buffers owned by the batch, one per datagram,
+     * `NULL` if the batch only refers to packets owned by others. */
+    sized_data *buffers;
+
+    /* where `buffers` are taken from, `NULL` if they are allocated */
+    packet_pool *pool;
+
+    /* whether datagrams are sent with segmentation offload,
+     * see `packet_batch_enable_segmentation` */
+    int segment;
+
+    /* Unless `NULL`, the received datagrams, several of which
+     * may be in one message, see `packet_batch_enable_gro`. */
+    packet_batch_datagram *datagrams;
+
+    /* With segmentation offload or GRO, a control message per message,
+     * and with segmentation offload, the messages actually sent,
+     * each of several datagrams, and their iovecs; `NULL` otherwise. */
+    char *controls;
+    struct mmsghdr *segment_messages;
+    struct iovec *segment_iovecs;
+    unsigned int *segment_firsts; /* the first datagram of each */
+} packet_batch;
+
+/**
+ * Return a new empty batch of up to `capacity` datagrams.
+ * If `buffer_size` is non-zero, the batch owns a buffer of that size
+ * for each datagram, which is needed to receive. */
+packet_batch *packet_batch_new( unsigned int capacity, size_t buffer_size );
+
+/**
+ * Return a new empty batch of up to `capacity` datagrams,
+ * which owns a buffer of `pool` for each datagram.
+ * The buffers of received datagrams may get more holders of the pool,
+ * which keep them after the next receive:
+ * the batch takes new buffers for those then. */
+packet_batch *packet_batch_new_pooled( unsigned int capacity,
+                                       packet_pool *pool );
+
+void packet_batch_free( packet_batch *batch );
+
+/**
+ * Send the datagrams of one size which follow one another
+ * to one address as one buffer, split into datagrams by the system,
+ * the last of them may be shorter. The socket the batch is sent through
+ * must have `UDP_OFFLOAD_SEGMENT`, see `new_udp_socket`.
+ * If the system fails to split a buffer,
+ * the batch goes back to sending datagrams one by one. */
+void packet_batch_enable_segmentation( packet_batch *batch );
+
+/**
+ * Receive several datagrams of one size in one buffer
+ * if the system coalesced them, each of them is still
+ * a datagram of the batch. The socket the batch is received from
+ * must have `UDP_OFFLOAD_GRO`, see `new_udp_socket`.
+ * The batch must own buffers. */
+void packet_batch_enable_gro( packet_batch *batch );
+
+void packet_batch_clear( packet_batch *batch );
+
+int packet_batch_is_full( packet_batch *batch );
+
+/**
+ * Return the buffer owned by the batch for the next datagram to be added.
+ * The batch must own buffers and must not be full. */
+sized_data packet_batch_next_buffer( packet_batch *batch );
+
+/**
+ * Add the datagram `packet` addressed to `address` to the batch.
+ * The memory of `packet` is not copied, it must stay valid until the batch
+ * is sent or cleared. The batch must not be full. */
+void packet_batch_add( packet_batch *batch, sized_data packet,
+                       struct sockaddr *address, socklen_t address_length );
+
+/**
+ * Add the datagram made of `head` followed by `payload`, which may be empty,
+ * as `packet_batch_add` does, without copying them into one buffer. */
+void packet_batch_add_parts( packet_batch *batch, sized_data head,
+                             sized_data payload, struct sockaddr *address,
+                             socklen_t address_length );
+
+/**
+ * Return the `i`th datagram in the batch. */
+sized_data packet_batch_get( packet_batch *batch, unsigned int i );
+
+/**
+ * Return the buffer owned by the batch which the `i`th received datagram
+ * is in, at its start unless GRO is enabled. */
+void *packet_batch_get_buffer( packet_batch *batch, unsigned int i );
+
+/**
+ * Return the source or destination address of the `i`th datagram. */
+struct sockaddr *packet_batch_get_address( packet_batch *batch,
+                                           unsigned int i,
+                                           socklen_t *address_length );
+
+/**
+ * Send all the datagrams in the batch through `send_packets`,
+ * or `drop_packets` with segmentation offload, and clear the batch.
+ * Return a non-zero number if an error happened. */
+int packet_batch_send( packet_batch *batch, int udp_socket );
+
+/**
+ * Clear the batch and receive as many datagrams as are ready,
+ * but no more than the capacity, into the buffers owned by the batch.
+ * `flags` are the flags of `recvmmsg`, with `MSG_WAITFORONE`
+ * the call blocks only until the first datagram arrives.
+ * Return the number of received datagrams
+ * or a negative number if an error happened. */
+int packet_batch_receive( packet_batch *batch, int udp_socket, int flags );
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet_pool.h"
+
+/**
+ * the alignment of buffers in a slab, enough for the packet headers,
+ * each buffer follows the number of its holders
+ * and whether it is a copy, padded to this size */
+#define PACKET_POOL_ALIGNMENT 16
+
+/**
+ * Return the number of holders of `buffer`. */
+static unsigned int *get_n_users( void *buffer )
+{
+    return (unsigned int *)((char *)buffer - PACKET_POOL_ALIGNMENT);
+}
+
+/**
+ * Return whether `buffer` was made by `packet_pool_copy`. */
+static unsigned int *get_is_copy( void *buffer )
+{
+    return get_n_users(buffer) + 1;
+}
+
+/**
+ * Return the distance between two buffers in a slab. */
+static size_t get_stride( packet_pool *pool )
+{
+    return PACKET_POOL_ALIGNMENT
+        + (pool->buffer_size + PACKET_POOL_ALIGNMENT - 1)
+        / PACKET_POOL_ALIGNMENT * PACKET_POOL_ALIGNMENT;
+}
+
+packet_pool *packet_pool_new( size_t buffer_size )
+{
+    packet_pool *r = malloc_check(sizeof(packet_pool));
+    r->buffer_size = buffer_size;
+    pthread_mutex_init(&r->mutex, NULL);
+    r->free_buffers = NULL;
+    r->n_free = 0;
+    r->n_buffers = 0;
+    r->slabs = NULL;
+    r->n_slabs = 0;
+    r->high_water = 0;
+    r->released = 0;
+    return r;
+}
+
+void packet_pool_free( packet_pool *pool )
+{
+    unsigned long i;
+    for( i = 0; i < pool->n_slabs; i++ ) free(pool->slabs[i]);
+    free(pool->slabs);
+    free(pool->free_buffers);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/**
+ * Allocate a new slab and make its buffers free.
+ * The mutex must be locked. */
+static void add_slab( packet_pool *pool )
+{
+    size_t stride = get_stride(pool);
+    char *slab = malloc_check(PACKET_POOL_SLAB_SIZE * stride);
+    void **slabs = malloc_check((pool->n_slabs + 1) * sizeof(void *));
+    void **free_buffers = malloc_check(
+        (pool->n_buffers + PACKET_POOL_SLAB_SIZE) * sizeof(void *));
+    unsigned long i;
+    if( pool->n_slabs != 0 )
+    {
+        memcpy(slabs, pool->slabs, pool->n_slabs * sizeof(void *));
+    }
+    if( pool->n_free != 0 )
+    {
+        memcpy(free_buffers, pool->free_buffers,
+               pool->n_free * sizeof(void *));
+    }
+    free(pool->slabs);
+    free(pool->free_buffers);
+    pool->slabs = slabs;
+    pool->slabs[pool->n_slabs++] = slab;
+    pool->free_buffers = free_buffers;
+    for( i = 0; i < PACKET_POOL_SLAB_SIZE; i++ )
+    {
+        char *buffer = slab + i * stride + PACKET_POOL_ALIGNMENT;
+        *get_is_copy(buffer) = 0;
+        pool->free_buffers[pool->n_free++] = buffer;
+    }
+    pool->n_buffers += PACKET_POOL_SLAB_SIZE;
+}
+
+void packet_pool_release( packet_pool *pool )
+{
+    int unused;
+    pthread_mutex_lock(&pool->mutex);
+    pool->released = 1;
+    unused = pool->n_free == pool->n_buffers;
+    pthread_mutex_unlock(&pool->mutex);
+    if( unused ) packet_pool_free(pool);
+}
+
+void packet_pool_set_high_water( packet_pool *pool, unsigned long n_buffers )
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->high_water = n_buffers;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Compare the addresses of two slabs, for `qsort` and `bsearch`. */
+static int compare_slabs( const void *slab0, const void *slab1 )
+{
+    size_t address0 = (size_t)*(char * const *)slab0;
+    size_t address1 = (size_t)*(char * const *)slab1;
+    return address0 < address1 ? -1 : address0 > address1;
+}
+
+/**
+ * Return the number of the slab of `buffer` in the sorted `pool->slabs`,
+ * the slab with the greatest address not greater than `buffer`. */
+static unsigned long find_slab( packet_pool *pool, void *buffer )
+{
+    unsigned long low = 0;
+    unsigned long high = pool->n_slabs;
+    while( high - low > 1 )
+    {
+        unsigned long middle = low + (high - low) / 2;
+        if( (size_t)pool->slabs[middle] <= (size_t)buffer ) low = middle;
+        else high = middle;
+    }
+    return low;
+}
+
+void packet_pool_trim( packet_pool *pool )
+{
+    unsigned int *n_free_in_slab;
+    unsigned long n_kept = 0;
+    unsigned long i;
+    pthread_mutex_lock(&pool->mutex);
+    if( pool->high_water == 0
+        || pool->n_buffers < pool->high_water + PACKET_POOL_SLAB_SIZE
+        || pool->n_free < PACKET_POOL_SLAB_SIZE )
+    {
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+
+    /* count the free buffers of each slab */
+    qsort(pool->slabs, pool->n_slabs, sizeof(void *), compare_slabs);
+    n_free_in_slab = malloc_check(pool->n_slabs * sizeof(unsigned int));
+    memset(n_free_in_slab, 0, pool->n_slabs * sizeof(unsigned int));
+    for( i = 0; i < pool->n_free; i++ )
+    {
+        n_free_in_slab[find_slab(pool, pool->free_buffers[i])]++;
+    }
+
+    /* free whole slabs, marked by a count past the slab size */
+    for( i = 0; i < pool->n_slabs
+                && pool->n_buffers >= pool->high_water + PACKET_POOL_SLAB_SIZE;
+         i++ )
+    {
+        if( n_free_in_slab[i] == PACKET_POOL_SLAB_SIZE )
+        {
+            n_free_in_slab[i] = PACKET_POOL_SLAB_SIZE + 1;
+            pool->n_buffers -= PACKET_POOL_SLAB_SIZE;
+        }
+    }
+    for( i = 0; i < pool->n_free; i++ )
+    {
+        void *buffer = pool->free_buffers[i];
+        if( n_free_in_slab[find_slab(pool, buffer)]
+            <= PACKET_POOL_SLAB_SIZE )
+        {
+            pool->free_buffers[n_kept++] = buffer;
+        }
+    }
+    pool->n_free = n_kept;
+    n_kept = 0;
+    for( i = 0; i < pool->n_slabs; i++ )
+    {
+        if( n_free_in_slab[i] > PACKET_POOL_SLAB_SIZE ) free(pool->slabs[i]);
+        else pool->slabs[n_kept++] = pool->slabs[i];
+    }
+    pool->n_slabs = n_kept;
+    free(n_free_in_slab);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+sized_data packet_pool_get( packet_pool *pool )
+{
+    sized_data r;
+    pthread_mutex_lock(&pool->mutex);
+    if( pool->n_free == 0 ) add_slab(pool);
+    r.data = pool->free_buffers[--pool->n_free];
+    pthread_mutex_unlock(&pool->mutex);
+    *get_n_users(r.data) = 1;
+    r.size = pool->buffer_size;
+    return r;
+}
+
+sized_data packet_pool_copy( packet_pool *pool, sized_data data )
+{
+    sized_data r;
+    char *copy = malloc_check(PACKET_POOL_ALIGNMENT + data.size);
+    r.data = copy + PACKET_POOL_ALIGNMENT;
+    r.size = data.size;
+    *get_n_users(r.data) = 1;
+    *get_is_copy(r.data) = 1;
+    memcpy(r.data, data.data, data.size);
+    return r;
+}
+
+void packet_pool_hold( packet_pool *pool, void *buffer )
+{
+    __atomic_add_fetch(get_n_users(buffer), 1, __ATOMIC_RELAXED);
+}
+
+void packet_pool_put( packet_pool *pool, void *buffer )
+{
+    int unused;
+    if( __atomic_sub_fetch(get_n_users(buffer), 1, __ATOMIC_ACQ_REL) != 0 )
+    {
+        return;
+    }
+    if( *get_is_copy(buffer) )
+    {
+        free((char *)buffer - PACKET_POOL_ALIGNMENT);
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->free_buffers[pool->n_free++] = buffer;
+    unused = pool->released && pool->n_free == pool->n_buffers;
+    pthread_mutex_unlock(&pool->mutex);
+    if( unused ) packet_pool_free(pool);
+}
+
+sized_data packet_pool_renew( packet_pool *pool, void *buffer )
+{
+    sized_data r;
+    /* no other holder may add one */
+    if( __atomic_load_n(get_n_users(buffer), __ATOMIC_ACQUIRE) == 1
+        && !*get_is_copy(buffer) )
+    {
+        r.data = buffer;
+        r.size = pool->buffer_size;
+        return r;
+    }
+    packet_pool_put(pool, buffer);
+    return packet_pool_get(pool);
+}
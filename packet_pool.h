@@ -0,0 +1,98 @@
+/**
+ * Pool of packet buffers of one size, carved from slabs.
+ * A slab is allocated only when no buffer is free and is kept
+ * until the pool is trimmed or freed, so once the pool has grown
+ * to the number of packets in flight, taking and giving back buffers
+ * allocates nothing.
+ * A buffer may have several holders, which refer to parts of it,
+ * and goes back to the pool after the last one gives it back.
+ * Data kept for long is copied out of the pool into buffers
+ * of its own size, which are freed after their last holder.
+ * Buffers may be taken, held and given back by different threads.
+ * For the Client and the Server. */
+
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <pthread.h>
+
+#include "common.h"
+
+/**
+ * the number of buffers in a slab */
+#define PACKET_POOL_SLAB_SIZE 16
+
+typedef struct
+{
+    size_t buffer_size;
+
+    pthread_mutex_t mutex; /* for all the following */
+
+    /* the free buffers, room for all the buffers of the pool */
+    void **free_buffers;
+    unsigned long n_free;
+    unsigned long n_buffers;
+
+    void **slabs;
+    unsigned long n_slabs;
+
+    /* the number of buffers above which `packet_pool_trim` frees slabs,
+     * `0` to keep all */
+    unsigned long high_water;
+
+    /* set by `packet_pool_release`,
+     * the pool is freed when its last buffer is given back */
+    int released;
+} packet_pool;
+
+/**
+ * Return a new empty pool of buffers of `buffer_size` bytes. */
+packet_pool *packet_pool_new( size_t buffer_size );
+
+/**
+ * Free the pool with all its buffers, given back or not,
+ * except copies, which are freed by their last holder. */
+void packet_pool_free( packet_pool *pool );
+
+/**
+ * Free the pool once all its buffers are given back,
+ * which other threads may still do. It must not be used otherwise. */
+void packet_pool_release( packet_pool *pool );
+
+/**
+ * Make `packet_pool_trim` free slabs while the pool has more than
+ * `n_buffers` buffers. */
+void packet_pool_set_high_water( packet_pool *pool, unsigned long n_buffers );
+
+/**
+ * Free the slabs of `pool` which have no buffer taken,
+ * until no more than its high-water mark of buffers are left. */
+void packet_pool_trim( packet_pool *pool );
+
+/**
+ * Take a buffer of the pool, with one holder,
+ * allocating a new slab if none is free.
+ * The size of the returned buffer is the buffer size of the pool. */
+sized_data packet_pool_get( packet_pool *pool );
+
+/**
+ * Return a buffer of the size of `data` holding a copy of it,
+ * with one holder, held and given back like the buffers of `pool`,
+ * but not occupying any. */
+sized_data packet_pool_copy( packet_pool *pool, sized_data data );
+
+/**
+ * Add a holder of `buffer`, taken from `pool`. */
+void packet_pool_hold( packet_pool *pool, void *buffer );
+
+/**
+ * Remove a holder of `buffer`, taken from `pool`,
+ * which is reused after the last one. */
+void packet_pool_put( packet_pool *pool, void *buffer );
+
+/**
+ * Remove a holder of `buffer`, taken from `pool`, and take a buffer,
+ * which is `buffer` itself if it had no other holder and is not a copy. */
+sized_data packet_pool_renew( packet_pool *pool, void *buffer );
+
+#endif
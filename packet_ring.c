@@ -0,0 +1,51 @@
+#include "packet_ring.h"
+
+packet_ring *packet_ring_new( unsigned long capacity )
+{
+    packet_ring *r = malloc_check(sizeof(packet_ring));
+    r->capacity = 1;
+    while( r->capacity < capacity ) r->capacity *= 2;
+    r->els = malloc_check(r->capacity * sizeof(packet_ring_el));
+    r->first = 0;
+    r->size = 0;
+    return r;
+}
+
+void packet_ring_free( packet_ring *ring )
+{
+    free(ring->els);
+    free(ring);
+}
+
+packet_ring_el *packet_ring_insert_last( packet_ring *ring )
+{
+    if( ring->size == ring->capacity )
+    {
+        fputs("packet_ring_insert_last: The ring must not be full.\n", stderr);
+        error_exit();
+    }
+    ring->size++;
+    return &ring->els[(ring->first + ring->size - 1) & (ring->capacity - 1)];
+}
+
+void packet_ring_delete_first( packet_ring *ring )
+{
+    if( ring->size == 0 )
+    {
+        fputs("packet_ring_delete_first: The ring must be non-empty.\n",
+              stderr);
+        error_exit();
+    }
+    ring->first = (ring->first + 1) & (ring->capacity - 1);
+    ring->size--;
+}
+
+packet_ring_el *packet_ring_get( packet_ring *ring, unsigned long index )
+{
+    if( index >= ring->size )
+    {
+        fputs("packet_ring_get: The index is out of range.\n", stderr);
+        error_exit();
+    }
+    return &ring->els[(ring->first + index) & (ring->capacity - 1)];
+}
@@ -0,0 +1,56 @@
+/**
+ * Ring of outstanding buffered packets of a fixed capacity,
+ * indexed from the oldest packet, so the packet with a given `seq_n`
+ * is found in O(1). The packet buffers are owned by the user.
+ * For the Client. */
+
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <time.h>
+
+#include "common.h"
+#include "file_map.h"
+
+/**
+ * element of `packet_ring` */
+typedef struct
+{
+    struct timespec send_time;
+    struct timespec deadline; /* of the retransmission timer */
+    mapped_packet packet;
+    char acked; /* selectively acknowledged, not to be resent */
+    /* the number of times the packet was resent for any reason,
+     * if non-zero its RTT is ambiguous */
+    unsigned char n_retransmissions;
+} packet_ring_el;
+
+typedef struct
+{
+    packet_ring_el *els;
+    unsigned long capacity; /* a power of 2 */
+    unsigned long first; /* the index in `els` of the oldest element */
+    unsigned long size;
+} packet_ring;
+
+/**
+ * Return a new empty ring of at least `capacity` elements. */
+packet_ring *packet_ring_new( unsigned long capacity );
+
+void packet_ring_free( packet_ring *ring );
+
+/**
+ * Append an element to the ring and return it, for the user to fill.
+ * The ring must not be full. */
+packet_ring_el *packet_ring_insert_last( packet_ring *ring );
+
+/**
+ * Delete the oldest element. The ring must be non-empty. */
+void packet_ring_delete_first( packet_ring *ring );
+
+/**
+ * Return the `index`th (0-based) element of `ring`, from the oldest.
+ * `index` must be less than the size of the ring. */
+packet_ring_el *packet_ring_get( packet_ring *ring, unsigned long index );
+
+#endif
@@ -0,0 +1,176 @@
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "prefetch.h"
+
+/**
+ * Make `fd` readable if the sender waits for it.
+ * The mutex must be locked. */
+static void wake_sender( prefetch *prefetch0 )
+{
+    uint64_t one = 1;
+    if( !prefetch0->waiting ) return;
+    prefetch0->waiting = 0;
+    prefetch0->woken = 1;
+    if( write(prefetch0->fd, &one, sizeof(one)) != sizeof(one) )
+    {
+        perror("prefetch, write eventfd");
+    }
+}
+
+/**
+ * Add `packet` at the end of the queue, which must not be full.
+ * The mutex must be locked. */
+static void push( prefetch *prefetch0, mapped_packet packet )
+{
+    prefetch0->packets[(prefetch0->first + prefetch0->size)
+                       & (prefetch0->capacity - 1)] = packet;
+    prefetch0->size++;
+}
+
+/**
+ * The reader thread. */
+static void *run( void *prefetch1 )
+{
+    prefetch *prefetch0 = prefetch1;
+    while( 1 )
+    {
+        mapped_packet packet;
+        int end;
+        pthread_mutex_lock(&prefetch0->mutex);
+        if( !prefetch0->stop && prefetch0->size >= prefetch0->max_packets )
+        {
+            prefetch0->n_full++;
+            while( !prefetch0->stop
+                   && prefetch0->size >= prefetch0->max_packets )
+            {
+                pthread_cond_wait(&prefetch0->taken, &prefetch0->mutex);
+            }
+        }
+        if( prefetch0->stop )
+        {
+            pthread_mutex_unlock(&prefetch0->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&prefetch0->mutex);
+
+        /* the files are read without the lock */
+        end = prefetch0->produce(prefetch0->context, &packet) != 0;
+
+        pthread_mutex_lock(&prefetch0->mutex);
+        if( end ) prefetch0->end = 1;
+        else push(prefetch0, packet);
+        wake_sender(prefetch0);
+        pthread_mutex_unlock(&prefetch0->mutex);
+        if( end ) break;
+    }
+    return NULL;
+}
+
+prefetch *prefetch_new( prefetch_produce produce, prefetch_discard discard,
+                        void *context, unsigned long max_packets )
+{
+    prefetch *r;
+    int error;
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if( fd < 0 )
+    {
+        perror("prefetch_new, eventfd");
+        return NULL;
+    }
+    r = malloc_check(sizeof(prefetch));
+    r->produce = produce;
+    r->discard = discard;
+    r->context = context;
+    r->max_packets = max_packets != 0 ? max_packets : 1;
+    r->fd = fd;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->taken, NULL);
+    r->capacity = 1;
+    while( r->capacity < r->max_packets ) r->capacity *= 2;
+    r->packets = malloc_check(r->capacity * sizeof(mapped_packet));
+    r->first = 0;
+    r->size = 0;
+    r->end = 0;
+    r->waiting = 0;
+    r->woken = 0;
+    r->stop = 0;
+    r->n_empty = 0;
+    r->n_full = 0;
+    error = pthread_create(&r->thread, NULL, run, r);
+    if( error != 0 )
+    {
+        errno = error;
+        perror("prefetch_new, pthread_create");
+        pthread_cond_destroy(&r->taken);
+        pthread_mutex_destroy(&r->mutex);
+        free(r->packets);
+        close(fd);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void prefetch_free( prefetch *prefetch0 )
+{
+    pthread_mutex_lock(&prefetch0->mutex);
+    prefetch0->stop = 1;
+    pthread_cond_signal(&prefetch0->taken);
+    pthread_mutex_unlock(&prefetch0->mutex);
+    pthread_join(prefetch0->thread, NULL);
+    printf("Read-ahead: no packet was ready %lu times,"
+           " the queue was full %lu times.\n",
+           prefetch0->n_empty, prefetch0->n_full);
+
+    while( prefetch0->size != 0 )
+    {
+        prefetch0->discard(prefetch0->context,
+                           prefetch0->packets[prefetch0->first]);
+        prefetch0->first = (prefetch0->first + 1) & (prefetch0->capacity - 1);
+        prefetch0->size--;
+    }
+    pthread_cond_destroy(&prefetch0->taken);
+    pthread_mutex_destroy(&prefetch0->mutex);
+    free(prefetch0->packets);
+    close(prefetch0->fd);
+    free(prefetch0);
+}
+
+int prefetch_take( prefetch *prefetch0, mapped_packet *packet )
+{
+    int r;
+    pthread_mutex_lock(&prefetch0->mutex);
+    if( prefetch0->woken )
+    {
+        /* consume the wakeup, or `fd` stays readable */
+        uint64_t n_wakeups;
+        if( read(prefetch0->fd, &n_wakeups, sizeof(n_wakeups)) < 0
+            && errno != EAGAIN )
+        {
+            perror("prefetch_take, read eventfd");
+        }
+        prefetch0->woken = 0;
+    }
+    if( prefetch0->size != 0 )
+    {
+        *packet = prefetch0->packets[prefetch0->first];
+        prefetch0->first = (prefetch0->first + 1) & (prefetch0->capacity - 1);
+        prefetch0->size--;
+        pthread_cond_signal(&prefetch0->taken);
+        r = PREFETCH_TAKEN;
+    }
+    else if( prefetch0->end ) r = PREFETCH_END;
+    else
+    {
+        prefetch0->waiting = 1;
+        prefetch0->n_empty++;
+        r = PREFETCH_EMPTY;
+    }
+    pthread_mutex_unlock(&prefetch0->mutex);
+    return r;
+}
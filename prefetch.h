@@ -0,0 +1,98 @@
+/**
+ * Read-ahead of data packets: a reader thread opens and reads the files
+ * and queues their packets ahead of the window,
+ * up to a number of packets, so sending does not wait for the disk
+ * while a packet is ready.
+ * The sender takes packets without waiting and waits for `fd`
+ * in its event loop when none is ready.
+ * For the Client. */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <pthread.h>
+
+#include "common.h"
+#include "file_map.h"
+
+/**
+ * the memory for the queued packets by default, in bytes,
+ * from which the user finds the number of packets */
+#define PREFETCH_DEFAULT_BUDGET 0x400000
+
+/**
+ * Results of `prefetch_take`. */
+#define PREFETCH_TAKEN 0
+#define PREFETCH_EMPTY 1 /* no packet is ready yet, wait for `fd` */
+#define PREFETCH_END 2 /* no more packets */
+
+/**
+ * Write the next packet, owned by the caller, into `*packet`.
+ * Called by the reader thread only.
+ * Return `0` if there is such a packet, or a non-zero number if there are
+ * no more packets. */
+typedef int (*prefetch_produce)( void *context, mapped_packet *packet );
+
+/**
+ * Dispose of `packet`, produced and never taken. */
+typedef void (*prefetch_discard)( void *context, mapped_packet packet );
+
+typedef struct
+{
+    prefetch_produce produce;
+    prefetch_discard discard;
+    void *context;
+    unsigned long max_packets;
+
+    /* readable when a packet is ready or there are no more,
+     * after `prefetch_take` found none */
+    int fd;
+
+    pthread_mutex_t mutex; /* for all the following */
+    pthread_cond_t taken;
+
+    /* a ring of queued packets, the first at `first` */
+    mapped_packet *packets;
+    unsigned long capacity; /* a power of 2, at least `max_packets` */
+    unsigned long first;
+    unsigned long size;
+
+    /* whether the reader produced the last packet */
+    int end;
+
+    /* whether the sender waits for `fd`,
+     * and whether `fd` was made readable and not read yet */
+    int waiting;
+    int woken;
+
+    /* set to make the reader exit */
+    int stop;
+
+    pthread_t thread;
+
+    /* for statistics, the number of times the sender found no packet
+     * and the reader found the queue full */
+    unsigned long n_empty;
+    unsigned long n_full;
+} prefetch;
+
+/**
+ * Return a new read-ahead of the packets of `produce`
+ * with `context`, queuing up to `max_packets` packets,
+ * whose reader starts at once,
+ * or `NULL` if an error happened. */
+prefetch *prefetch_new( prefetch_produce produce, prefetch_discard discard,
+                        void *context, unsigned long max_packets );
+
+/**
+ * Stop the reader and free the read-ahead,
+ * disposing of the packets still queued with `discard`. */
+void prefetch_free( prefetch *prefetch0 );
+
+/**
+ * Take the next packet, owned by the caller then, into `*packet`
+ * without waiting for the reader.
+ * Return `PREFETCH_TAKEN`, `PREFETCH_EMPTY` or `PREFETCH_END`. */
+int prefetch_take( prefetch *prefetch0, mapped_packet *packet );
+
+#endif
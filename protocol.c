@@ -1,5 +1,7 @@
 #include <netdb.h>
+#include <netinet/udp.h>
 #include <sys/socket.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "common.h"
@@ -7,21 +9,27 @@
 
 #define PROT_HEADER_CONST0 0x7f
 
+/**
+ * Records in batch data packets start at multiples of this. */
+#define PAYLOAD_ALIGNMENT sizeof(unsigned long)
 
 
+
+/* Unsigned arithmetic wraps around, which is exactly the modulo. */
+
 seq_n_t seq_n_add(seq_n_t x, seq_n_t y)
 {
-    return (x + y) % SEQ_N_LIMIT;
+    return x + y;
 }
 
 seq_n_t seq_n_neg(seq_n_t x)
 {
-    return (SEQ_N_LIMIT - x) % SEQ_N_LIMIT;
+    return 0 - x;
 }
 
 seq_n_t seq_n_subtract(seq_n_t x, seq_n_t y)
 {
-    return ((SEQ_N_LIMIT + x) - y) % SEQ_N_LIMIT;
+    return x - y;
 }
 
 int seq_n_between(seq_n_t x, seq_n_t  y, seq_n_t z)
@@ -31,7 +39,37 @@ int seq_n_between(seq_n_t x, seq_n_t  y, seq_n_t z)
 
 
 
-int new_udp_socket( in_port_t port )
+/**
+ * Enable the segmentation offload of `*offload` on `udp_socket`,
+ * clearing the flags the system does not support. */
+static void set_udp_offload( int udp_socket, int *offload )
+{
+    if( *offload & UDP_OFFLOAD_SEGMENT )
+    {
+        /* no segment size by default, each send gives its own */
+        int segment_size = 0;
+        if( setsockopt(udp_socket, IPPROTO_UDP, UDP_SEGMENT,
+                       &segment_size, sizeof(segment_size)) != 0 )
+        {
+            if( errno != ENOPROTOOPT ) perror("set socket segmentation");
+            printf("Sending datagrams without segmentation offload.\n");
+            *offload &= ~UDP_OFFLOAD_SEGMENT;
+        }
+    }
+    if( *offload & UDP_OFFLOAD_GRO )
+    {
+        int on = 1;
+        if( setsockopt(udp_socket, IPPROTO_UDP, UDP_GRO,
+                       &on, sizeof(on)) != 0 )
+        {
+            if( errno != ENOPROTOOPT ) perror("set socket GRO");
+            printf("Receiving datagrams without GRO.\n");
+            *offload &= ~UDP_OFFLOAD_GRO;
+        }
+    }
+}
+
+int new_udp_socket( in_port_t port, int reuse_port, int *offload )
 {
     int udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if( udp_socket < 0 )
@@ -42,6 +80,32 @@ int new_udp_socket( in_port_t port )
     else
     {
         struct sockaddr_in local_address;
+        int buffer_size = UDP_SOCKET_BUFFER_SIZE;
+
+        /* Not fatal, the system may limit the buffer size. */
+        if( setsockopt(udp_socket, SOL_SOCKET, SO_RCVBUF,
+                       &buffer_size, sizeof(buffer_size)) != 0 )
+        {
+            perror("set socket receive buffer size");
+        }
+        if( setsockopt(udp_socket, SOL_SOCKET, SO_SNDBUF,
+                       &buffer_size, sizeof(buffer_size)) != 0 )
+        {
+            perror("set socket send buffer size");
+        }
+        if( reuse_port )
+        {
+            int on = 1;
+            if( setsockopt(udp_socket, SOL_SOCKET, SO_REUSEPORT,
+                           &on, sizeof(on)) != 0 )
+            {
+                perror("set socket port reuse");
+                close(udp_socket);
+                return -1;
+            }
+        }
+        if( offload != NULL ) set_udp_offload(udp_socket, offload);
+
         local_address.sin_family = AF_INET; /* Internet Domain */
         local_address.sin_port = port;
         
@@ -59,6 +123,31 @@ int new_udp_socket( in_port_t port )
     }
 }
 
+int get_path_mtu( struct sockaddr *address, socklen_t address_length )
+{
+    int mtu;
+    socklen_t mtu_size = sizeof(mtu);
+    /* the route of a connected socket is known,
+     * unfragmented datagrams learn its MTU */
+    int discover = IP_PMTUDISC_DO;
+    int probe_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if( probe_socket < 0 )
+    {
+        perror("get_path_mtu, create socket");
+        return -1;
+    }
+    if( setsockopt(probe_socket, IPPROTO_IP, IP_MTU_DISCOVER,
+                   &discover, sizeof(discover)) != 0
+        || connect(probe_socket, address, address_length) != 0
+        || getsockopt(probe_socket, IPPROTO_IP, IP_MTU, &mtu, &mtu_size) != 0 )
+    {
+        perror("get_path_mtu");
+        mtu = -1;
+    }
+    close(probe_socket);
+    return mtu;
+}
+
 int get_host_address_by_name( char *host_name, struct in_addr *address )
 {
     struct hostent *host_info = gethostbyname(host_name);
@@ -83,6 +172,13 @@ int get_packet_type( sized_data packet )
     if( prot_h->const0 != PROT_HEADER_CONST0 ) return -1;
 
     flags = prot_h->flags;
+    if( prot_h->sack_size != 0
+        && ((flags & 0x3) != 0x2
+            || prot_h->sack_size > packet.size - sizeof(prot_header)) )
+    {
+        /* only ACK packets may have a SACK bitmap */
+        return -1;
+    }
     return (flags & 0x1) != 0 ? PACKET_TYPE_DATA
         : ((flags & 0x2) != 0 ? PACKET_TYPE_ACK
            : ((flags & 0x4) != 0 ? PACKET_TYPE_EOT : -1));
@@ -93,11 +189,46 @@ seq_n_t get_packet_seq_n( void *packet_data )
     return ((prot_header *)packet_data)->seq_n;
 }
 
+void set_packet_seq_n( void *packet_data, seq_n_t seq_n )
+{
+    ((prot_header *)packet_data)->seq_n = seq_n;
+}
+
 seq_n_t get_packet_ack_seq_n( void *packet_data )
 {
     return ((prot_header *)packet_data)->ack_seq_n;
 }
 
+int is_packet_selective( void *packet_data )
+{
+    return (((prot_header *)packet_data)->flags & PACKET_FLAG_SELECTIVE) != 0;
+}
+
+void set_packet_selective( void *packet_data )
+{
+    ((prot_header *)packet_data)->flags |= PACKET_FLAG_SELECTIVE;
+}
+
+unsigned int get_packet_window_size( void *packet_data )
+{
+    return ((prot_header *)packet_data)->window_size;
+}
+
+void set_packet_window_size( void *packet_data, unsigned int window_size )
+{
+    ((prot_header *)packet_data)->window_size = window_size;
+}
+
+unsigned int get_packet_session_id( void *packet_data )
+{
+    return ((prot_header *)packet_data)->session_id;
+}
+
+void set_packet_session_id( void *packet_data, unsigned int session_id )
+{
+    ((prot_header *)packet_data)->session_id = session_id;
+}
+
 size_t get_eot_packet_size( void )
 {
     return sizeof(prot_header);
@@ -115,10 +246,13 @@ size_t init_eot_packet( sized_data packet )
     
     prot_h = packet.data;
     prot_h->size = packet_size;
+    prot_h->window_size = 0;
     prot_h->seq_n = 0;
     prot_h->ack_seq_n = 0;
     prot_h->flags = 0x4;
     prot_h->const0 = PROT_HEADER_CONST0;
+    prot_h->sack_size = 0;
+    prot_h->session_id = 0;
 
     return packet_size;
 }
@@ -140,20 +274,73 @@ size_t init_ack_packet( sized_data packet, seq_n_t seq_n )
     
     prot_h = packet.data;
     prot_h->size = packet_size;
+    prot_h->window_size = 0;
     prot_h->seq_n = 0;
     prot_h->ack_seq_n = seq_n;
     prot_h->flags = 0x2;
     prot_h->const0 = PROT_HEADER_CONST0;
+    prot_h->sack_size = 0;
+    prot_h->session_id = 0;
 
     return packet_size;
 }
 
+size_t init_selective_ack_packet( sized_data packet,
+                                  seq_n_t ack_seq_n, seq_n_t seq_n )
+{
+    size_t packet_size = init_ack_packet(packet, ack_seq_n);
+    prot_header *prot_h = packet.data;
+    prot_h->seq_n = seq_n;
+    prot_h->flags |= PACKET_FLAG_SELECTIVE;
+    return packet_size;
+}
+
+size_t get_packet_sack_size( void *packet_data )
+{
+    return ((prot_header *)packet_data)->sack_size;
+}
+
+unsigned char *get_packet_sack_p( void *packet_data )
+{
+    return (unsigned char *)packet_data + sizeof(prot_header);
+}
+
+size_t set_packet_sack_size( sized_data packet, size_t sack_size )
+{
+    prot_header *prot_h = packet.data;
+    size_t packet_size = prot_h->size - prot_h->sack_size + sack_size;
+    if( packet_size > packet.size )
+    {
+        fputs("set_packet_sack_size: Buffer is too small.\n", stderr);
+        error_exit();
+    }
+    prot_h->size = packet_size;
+    prot_h->sack_size = sack_size;
+    return packet_size;
+}
+
+int is_sack_bit_set( unsigned char *sack, size_t i )
+{
+    return (sack[i / 8] & (1 << (i % 8))) != 0;
+}
+
+void set_sack_bit( unsigned char *sack, size_t i )
+{
+    sack[i / 8] |= 1 << (i % 8);
+}
+
 size_t get_data_packet_size( size_t file_name_size, size_t data_size )
 {
     return sizeof(prot_header) + sizeof(payload_header)
         + file_name_size + data_size;
 }
 
+size_t get_data_packet_data_size( size_t packet_size, size_t file_name_size )
+{
+    size_t header_size = get_data_packet_size(file_name_size, 0);
+    return packet_size > header_size ? packet_size - header_size : 0;
+}
+
 void *get_packet_file_name_p( void *packet_data )
 {
     return (char *)packet_data + sizeof(prot_header) + sizeof(payload_header);
@@ -175,33 +362,65 @@ int get_packet_req_n( void *packet_data )
     return get_packet_payload_header_p(packet_data)->req_n;
 }
 
-packet_payload_p get_packet_payload_p( sized_data packet )
+/**
+ * Return the pointers to the parts of the payload record
+ * at the beginning of `records`, followed by other records if `batch`.
+ * Without `batch`, the file data occupy the rest of `records`. */
+static packet_payload_p get_payload_record_p( sized_data records, int batch )
 {
     packet_payload_p r;
-    if( packet.size < get_data_packet_size(0, 0) ) r.error = 1;
+    size_t header_size = sizeof(payload_header);
+    if( records.size < header_size ) r.error = 1;
     else
     {
-        payload_header *payload_h = get_packet_payload_header_p(packet.data);
+        payload_header *payload_h = records.data;
         int file_name_size = payload_h->file_name_size;
         if( file_name_size <= 0 ) r.error = 2;
         else
         {
-            if( packet.size < get_data_packet_size(file_name_size, 0) )
+            if( records.size < header_size + file_name_size )
             {
                 r.error = 3;
             }
             else
             {
-                char *file_name = get_packet_file_name_p(packet.data);
+                char *file_name = (char *)records.data + header_size;
+                size_t data_size = batch ? payload_h->file_size
+                    : records.size - header_size - file_name_size;
                 if( file_name[file_name_size - 1] != '\0' ) r.error = 4;
+                else if( payload_h->offset > payload_h->file_size
+                         || data_size
+                            > payload_h->file_size - payload_h->offset )
+                {
+                    r.error = 5;
+                }
+                else if( batch
+                         && (payload_h->offset != 0
+                             || data_size > records.size - header_size
+                                            - file_name_size) )
+                {
+                    r.error = 6;
+                }
                 else
                 {
+                    size_t record_size = batch
+                        ? get_batch_record_size(file_name_size, data_size)
+                        : records.size;
+                    if( record_size > records.size )
+                    {
+                        /* the padding of the last record */
+                        record_size = records.size;
+                    }
                     r.error = 0;
+                    r.req_n = payload_h->req_n;
                     r.file_name.size = file_name_size;
                     r.file_name.data = file_name;
-                    r.data.size = packet.size
-                        - get_data_packet_size(file_name_size, 0);
-                    r.data.data = get_packet_data_p(packet.data, file_name_size);
+                    r.file_size = payload_h->file_size;
+                    r.offset = payload_h->offset;
+                    r.data.size = data_size;
+                    r.data.data = file_name + file_name_size;
+                    r.next.size = records.size - record_size;
+                    r.next.data = (char *)records.data + record_size;
                 }
             }
         }
@@ -209,29 +428,135 @@ packet_payload_p get_packet_payload_p( sized_data packet )
     return r;
 }
 
+packet_payload_p get_packet_payload_p( sized_data packet )
+{
+    packet_payload_p r;
+    if( packet.size < get_data_packet_size(0, 0) ) r.error = 1;
+    else
+    {
+        sized_data records;
+        records.size = packet.size - sizeof(prot_header);
+        records.data = get_packet_payload_header_p(packet.data);
+        r = get_payload_record_p(records, is_packet_batch(packet.data));
+    }
+    return r;
+}
+
+packet_payload_p get_next_packet_payload_p( packet_payload_p payload_p )
+{
+    return get_payload_record_p(payload_p.next, 1);
+}
+
+int is_packet_batch( void *packet_data )
+{
+    return (((prot_header *)packet_data)->flags & PACKET_FLAG_BATCH) != 0;
+}
+
+size_t get_batch_record_size( size_t file_name_size, size_t data_size )
+{
+    size_t size = sizeof(payload_header) + file_name_size + data_size;
+    return (size + PAYLOAD_ALIGNMENT - 1) / PAYLOAD_ALIGNMENT
+        * PAYLOAD_ALIGNMENT;
+}
+
+size_t init_batch_packet( sized_data packet, seq_n_t seq_n )
+{
+    size_t packet_size = sizeof(prot_header);
+    prot_header *prot_h;
+    if( packet_size > packet.size )
+    {
+        fputs("init_batch_packet: Buffer is too small.\n", stderr);
+        error_exit();
+    }
+
+    prot_h = packet.data;
+    prot_h->size = packet_size;
+    prot_h->window_size = 0;
+    prot_h->seq_n = seq_n;
+    prot_h->ack_seq_n = 0;
+    prot_h->flags = 0x1 | PACKET_FLAG_BATCH;
+    prot_h->const0 = PROT_HEADER_CONST0;
+    prot_h->sack_size = 0;
+    prot_h->session_id = 0;
+
+    return packet_size;
+}
+
+packet_payload_p add_batch_packet_record( sized_data packet, int req_n,
+                                          size_t file_name_size,
+                                          size_t file_size )
+{
+    packet_payload_p r;
+    prot_header *prot_h = packet.data;
+    size_t record_size = get_batch_record_size(file_name_size, file_size);
+    if( record_size > packet.size - prot_h->size ) r.error = 1;
+    else
+    {
+        payload_header *payload_h =
+            (payload_header *)((char *)packet.data + prot_h->size);
+        payload_h->req_n = req_n;
+        payload_h->file_name_size = file_name_size;
+        payload_h->file_size = file_size;
+        payload_h->offset = 0;
+        prot_h->size += record_size;
+
+        r.error = 0;
+        r.req_n = req_n;
+        r.file_name.size = file_name_size;
+        r.file_name.data = (char *)payload_h + sizeof(payload_header);
+        r.file_size = file_size;
+        r.offset = 0;
+        r.data.size = file_size;
+        r.data.data = (char *)r.file_name.data + file_name_size;
+        r.next.size = 0;
+        r.next.data = (char *)packet.data + prot_h->size;
+    }
+    return r;
+}
+
 size_t
 init_data_packet( sized_data packet, int req_n, seq_n_t seq_n,
-                  size_t file_name_size, size_t data_size )
+                  size_t file_name_size, size_t data_size,
+                  unsigned long file_size, unsigned long offset )
+{
+    if( get_data_packet_size(file_name_size, data_size) > packet.size )
+    {
+        fputs("init_data_packet: Buffer is too small.\n", stderr);
+        error_exit();
+    }
+    return init_data_packet_head(packet, req_n, seq_n, file_name_size,
+                                 data_size, file_size, offset);
+}
+
+size_t
+init_data_packet_head( sized_data packet, int req_n, seq_n_t seq_n,
+                       size_t file_name_size, size_t data_size,
+                       unsigned long file_size, unsigned long offset )
 {
     size_t packet_size = get_data_packet_size(file_name_size, data_size);
     prot_header *prot_h;
     payload_header *payload_h;
-    if( packet_size > packet.size )
+    if( get_data_packet_size(file_name_size, 0) > packet.size )
     {
-        fputs("init_data_packet: Buffer is too small.\n", stderr);
+        fputs("init_data_packet_head: Buffer is too small.\n", stderr);
         error_exit();
     }
-    
+
     prot_h = packet.data;
     prot_h->size = packet_size;
+    prot_h->window_size = 0;
     prot_h->seq_n = seq_n;
     prot_h->ack_seq_n = 0;
     prot_h->flags = 0x1;
     prot_h->const0 = PROT_HEADER_CONST0;
+    prot_h->sack_size = 0;
+    prot_h->session_id = 0;
 
     payload_h = get_packet_payload_header_p(packet.data);
     payload_h->req_n = req_n;
     payload_h->file_name_size = file_name_size;
+    payload_h->file_size = file_size;
+    payload_h->offset = offset;
 
     return packet_size;
 }
@@ -14,42 +14,93 @@
 
 
 /**
- * Sequence numbers range from `0` inclusive to this constant exclusive. */
-#define SEQ_N_LIMIT (WINDOW_SIZE + 1)
-
-/**
- * sequence numbers,  numbers modulo `SEQ_N_LIMIT` */
-typedef unsigned char seq_n_t;
+ * sequence numbers, numbers modulo `UINT_MAX + 1`.
+ * Selective repeat needs at least twice the window size
+ * to tell a new packet from a retransmitted one,
+ * so any window up to `MAX_WINDOW_SIZE` fits. */
+typedef unsigned int seq_n_t;
 
 /**
  * the greatest size of UDP payload, in bytes */
 #define UDP_SIZE 65507
 
 /**
- * must be positive */
-#define WINDOW_SIZE 7
+ * the size of the IPv4 header without options and the UDP header,
+ * a datagram is not fragmented if its payload and these fit the MTU */
+#define UDP_IP_HEADER_SIZE 28
+
+/**
+ * The window size is chosen by the client
+ * and announced in the `window_size` field of data packets.
+ * It must be positive and not greater than `MAX_WINDOW_SIZE`. */
+#define DEFAULT_WINDOW_SIZE 7
+#define MAX_WINDOW_SIZE 0xffff
+
+/**
+ * the size of socket buffers requested in `new_udp_socket`, in bytes,
+ * so that large windows are not dropped by the receiving host */
+#define UDP_SOCKET_BUFFER_SIZE 0x800000
+
+/**
+ * Flags of segmentation offload, see `new_udp_socket`.
+ * With `UDP_OFFLOAD_SEGMENT`, datagrams of one size are sent
+ * as one buffer, which the system splits (`UDP_SEGMENT`).
+ * With `UDP_OFFLOAD_GRO`, datagrams of one size may be received
+ * as one buffer, which the receiver splits (`UDP_GRO`). */
+#define UDP_OFFLOAD_SEGMENT 1
+#define UDP_OFFLOAD_GRO 2
 
 #define PACKET_TYPE_DATA 0
 #define PACKET_TYPE_ACK 1
 #define PACKET_TYPE_EOT 2
 
+/**
+ * Set in data packets sent in the selective repeat mode
+ * and in the ACK packets answering them. */
+#define PACKET_FLAG_SELECTIVE 0x8
+
+/**
+ * Set in data packets carrying several whole files.
+ * Each file is a record of `payload_header`, file name and file data,
+ * padded to the alignment of `payload_header`. */
+#define PACKET_FLAG_BATCH 0x10
+
+/**
+ * A selective ACK packet may be followed by a SACK bitmap
+ * of the data packets the server buffered after `ack_seq_n`.
+ * Bit `i` is bit `i % 8` of byte `i / 8`,
+ * set if the data packet `ack_seq_n + 1 + i` was received.
+ * The bitmap covers a window, so it is never bigger than this. */
+#define MAX_SACK_SIZE ((MAX_WINDOW_SIZE + 7) / 8)
+
 /**
  * header for all types of packets */
 typedef struct
 {
     int size;
+    unsigned short window_size; /* of the sender, in data packets */
+    unsigned char flags; /* byte 6, `send_packet` looks at it */
+    unsigned char const0; /* always `PROT_HEADER_CONST0` */
     seq_n_t seq_n;
     seq_n_t ack_seq_n;
-    unsigned char flags;
-    unsigned char const0; /* always `PROT_HEADER_CONST0` */
+    unsigned int sack_size; /* of the SACK bitmap after the header, in bytes */
+
+    /* chosen by the client for all packets of a session,
+     * the server tells sessions from the same address apart by it
+     * and copies it into ACK packets */
+    unsigned int session_id;
 } prot_header;
 
 /**
- * header for data packets */
+ * header for data packets.
+ * A file too big for one packet is sent as fragments,
+ * consecutive data packets with the same `req_n` and increasing `offset`. */
 typedef struct
 {
     int req_n;
     int file_name_size;
+    unsigned long file_size; /* of the whole file */
+    unsigned long offset; /* of the file data of this packet in the file */
 } payload_header;
 
 /**
@@ -57,8 +108,12 @@ typedef struct
 typedef struct
 {
     int error;
+    int req_n;
     sized_data file_name;
-    sized_data data;
+    unsigned long file_size;
+    unsigned long offset;
+    sized_data data; /* a fragment if `data.size != file_size` */
+    sized_data next; /* the following records of a batch data packet */
 } packet_payload_p;
 
 
@@ -85,9 +140,21 @@ int seq_n_between(seq_n_t x, seq_n_t  y, seq_n_t z);
 
 
 /**
- * Return a new UDP socket on the local host
+ * Return a new UDP socket on the local host,
+ * with socket buffers of `UDP_SOCKET_BUFFER_SIZE` if the system allows,
+ * or a negative number if an error happened.
+ * If `reuse_port`, several sockets may be bound to the same port
+ * with `SO_REUSEPORT`; the system spreads datagrams among them
+ * by the address of the sender, so one client always reaches one socket.
+ * Unless `offload` is `NULL`, the segmentation offload of its flags
+ * is enabled, and the flags the system does not support are cleared. */
+int new_udp_socket( in_port_t port, int reuse_port, int *offload );
+
+/**
+ * Return the MTU of the path to `address`, as far as the system knows it:
+ * the MTU of the route, lowered by what path MTU discovery found,
  * or a negative number if an error happened. */
-int new_udp_socket( in_port_t port );
+int get_path_mtu( struct sockaddr *address, socklen_t address_length );
 
 /**
  * Write the address of the host `host_name` to `address`.
@@ -103,10 +170,43 @@ int get_packet_type( sized_data packet );
  * Return the `seq_n` field of `packet`. The packet must be valid. */
 seq_n_t get_packet_seq_n( void *packet_data );
 
+/**
+ * Write `seq_n` into the `seq_n` field of `packet`.
+ * The packet must be valid. */
+void set_packet_seq_n( void *packet_data, seq_n_t seq_n );
+
 /**
  * Return the `ack_seq_n` field of `packet`. The packet must be valid. */
 seq_n_t get_packet_ack_seq_n( void *packet_data );
 
+/**
+ * Return whether the `PACKET_FLAG_SELECTIVE` flag is set in `packet`.
+ * The packet must be valid. */
+int is_packet_selective( void *packet_data );
+
+/**
+ * Set the `PACKET_FLAG_SELECTIVE` flag in `packet`.
+ * The packet must be valid. */
+void set_packet_selective( void *packet_data );
+
+/**
+ * Return the `window_size` field of `packet`. The packet must be valid. */
+unsigned int get_packet_window_size( void *packet_data );
+
+/**
+ * Write `window_size` into the `window_size` field of `packet`.
+ * The packet must be valid. */
+void set_packet_window_size( void *packet_data, unsigned int window_size );
+
+/**
+ * Return the `session_id` field of `packet`. The packet must be valid. */
+unsigned int get_packet_session_id( void *packet_data );
+
+/**
+ * Write `session_id` into the `session_id` field of `packet`.
+ * The packet must be valid. */
+void set_packet_session_id( void *packet_data, unsigned int session_id );
+
 /**
  * Return the size of an EOT packet. */
 size_t get_eot_packet_size( void );
@@ -125,11 +225,50 @@ size_t get_ack_packet_size( void );
 size_t init_ack_packet( sized_data packet, seq_n_t seq_n );
 
 /**
- * Return the size of an ACK packet.
+ * Write a selective ACK packet into `packet`.
+ * The size of `packet` must be sufficient.
+ * `ack_seq_n` is the last data packet received in order,
+ * it is written into the `ack_seq_n` packet field.
+ * `seq_n` is the data packet acknowledged by this ACK,
+ * it is written into the `seq_n` packet field. */
+size_t init_selective_ack_packet( sized_data packet,
+                                  seq_n_t ack_seq_n, seq_n_t seq_n );
+
+/**
+ * Return the `sack_size` field of `packet`. The packet must be valid. */
+size_t get_packet_sack_size( void *packet_data );
+
+/**
+ * Return the pointer to the SACK bitmap of the ACK packet `packet_data`,
+ * which may not be written yet. */
+unsigned char *get_packet_sack_p( void *packet_data );
+
+/**
+ * Attach the SACK bitmap of `sack_size` bytes,
+ * written at `get_packet_sack_p`, to the ACK packet in `packet`.
+ * The size of `packet` must be sufficient. Return the new packet size. */
+size_t set_packet_sack_size( sized_data packet, size_t sack_size );
+
+/**
+ * Return whether bit `i` is set in the SACK bitmap `sack`. */
+int is_sack_bit_set( unsigned char *sack, size_t i );
+
+/**
+ * Set bit `i` in the SACK bitmap `sack`. */
+void set_sack_bit( unsigned char *sack, size_t i );
+
+/**
+ * Return the size of a data packet.
  * `file_name_size` is the size of a file name including `'\0'`.
  * `data_size` is the size of file data. */
 size_t get_data_packet_size( size_t file_name_size, size_t data_size );
 
+/**
+ * Return the greatest size of file data in a data packet
+ * of no more than `packet_size` bytes, or `0` if the file name does not fit.
+ * `file_name_size` is the size of a file name including `'\0'`. */
+size_t get_data_packet_data_size( size_t packet_size, size_t file_name_size );
+
 /**
  * Return the pointer to the file name in the packet `packet_data`.
  * `packet_data` must by of type `PACKET_TYPE_DATA` */
@@ -147,16 +286,60 @@ void *get_packet_data_p( void *packet_data, size_t file_name_size );
 int get_packet_req_n( void *packet_data );
 
 /**
+ * Return the pointers to the first file in `packet`.
  * `packet` must by of type `PACKET_TYPE_DATA` */
 packet_payload_p get_packet_payload_p( sized_data packet );
 
+/**
+ * Return the pointers to the file following `payload_p`
+ * in a batch data packet. `payload_p.next.size` must be non-zero. */
+packet_payload_p get_next_packet_payload_p( packet_payload_p payload_p );
+
+/**
+ * Return whether the `PACKET_FLAG_BATCH` flag is set in `packet`.
+ * The packet must be valid. */
+int is_packet_batch( void *packet_data );
+
+/**
+ * Return the size of a record in a batch data packet.
+ * `file_name_size` is the size of a file name including `'\0'`.
+ * `data_size` is the size of file data. */
+size_t get_batch_record_size( size_t file_name_size, size_t data_size );
+
+/**
+ * Write a batch data packet without records into `packet`.
+ * The size of `packet` must be sufficient.
+ * `seq_n` is written into the `seq_n` packet field. */
+size_t init_batch_packet( sized_data packet, seq_n_t seq_n );
+
+/**
+ * Append a record for a whole file to the batch data packet in `packet`,
+ * growing its `size` field. `packet.size` is the size of the buffer.
+ * Return the pointers to the file name and data to be filled in,
+ * the `error` field is non-zero if the record does not fit. */
+packet_payload_p add_batch_packet_record( sized_data packet, int req_n,
+                                          size_t file_name_size,
+                                          size_t file_size );
+
 /**
  * Write a data packet into `packet`. The size of `packet` must be sufficient.
  * `req_n` is written into the `req_n` packet field.
  * `seq_n` is written into the `seq_n` packet field.
  * `file_name_size` is the size of a file name including `'\0'`.
- * `data_size` is the size of file data. */
+ * `data_size` is the size of file data in the packet.
+ * `file_size` and `offset` are the size of the whole file
+ * and the offset of the data in the file. */
 size_t init_data_packet( sized_data packet, int req_n, seq_n_t seq_n,
-                         size_t file_name_size, size_t data_size );
+                         size_t file_name_size, size_t data_size,
+                         unsigned long file_size, unsigned long offset );
+
+/**
+ * Write the headers of a data packet into `packet`, as `init_data_packet`,
+ * but `packet` need only be sufficient for the headers and the file name,
+ * the `data_size` bytes of file data are sent after it from elsewhere.
+ * Return the size of the whole packet. */
+size_t init_data_packet_head( sized_data packet, int req_n, seq_n_t seq_n,
+                              size_t file_name_size, size_t data_size,
+                              unsigned long file_size, unsigned long offset );
 
 #endif
@@ -0,0 +1,79 @@
+#include <stdio.h>
+
+#include "rto.h"
+
+/* gains of the smoothing, as recommended in RFC 6298 */
+#define RTO_ALPHA 0.125
+#define RTO_BETA 0.25
+#define RTO_K 4.0
+
+static double rto_clamp( double rto )
+{
+    return rto < RTO_MIN ? RTO_MIN : (rto > RTO_MAX ? RTO_MAX : rto);
+}
+
+void rto_estimator_init( rto_estimator *estimator )
+{
+    estimator->n_samples = 0;
+    estimator->last_rtt = 0;
+    estimator->srtt = 0;
+    estimator->rttvar = 0;
+    estimator->rto = RTO_INITIAL;
+    estimator->n_backoffs = 0;
+    estimator->n_timeouts = 0;
+}
+
+void rto_estimator_sample( rto_estimator *estimator, double rtt )
+{
+    if( rtt < 0 ) rtt = 0;
+    if( estimator->n_samples == 0 )
+    {
+        estimator->srtt = rtt;
+        estimator->rttvar = rtt / 2;
+    }
+    else
+    {
+        double error = estimator->srtt - rtt;
+        if( error < 0 ) error = -error;
+        estimator->rttvar =
+            (1 - RTO_BETA) * estimator->rttvar + RTO_BETA * error;
+        estimator->srtt = (1 - RTO_ALPHA) * estimator->srtt + RTO_ALPHA * rtt;
+    }
+    estimator->n_samples++;
+    estimator->last_rtt = rtt;
+    estimator->rto = rto_clamp(estimator->srtt + RTO_K * estimator->rttvar);
+    estimator->n_backoffs = 0;
+}
+
+void rto_estimator_backoff( rto_estimator *estimator )
+{
+    if( rto_estimator_get_timeout(estimator) < RTO_MAX )
+    {
+        estimator->n_backoffs++;
+    }
+    estimator->n_timeouts++;
+}
+
+void rto_estimator_reset_backoff( rto_estimator *estimator )
+{
+    estimator->n_backoffs = 0;
+}
+
+double rto_estimator_get_timeout( rto_estimator *estimator )
+{
+    double rto = estimator->rto;
+    unsigned int i;
+    for( i = 0; i < estimator->n_backoffs && rto < RTO_MAX; i++ ) rto *= 2;
+    return rto_clamp(rto);
+}
+
+void rto_estimator_print( rto_estimator *estimator )
+{
+    printf("RTT samples: %lu, last RTT: %.6f s,"
+           " smoothed RTT: %.6f s, RTT variation: %.6f s.\n",
+           estimator->n_samples, estimator->last_rtt,
+           estimator->srtt, estimator->rttvar);
+    printf("Retransmission timeout: %.6f s, backoffs: %u, timeouts: %lu.\n",
+           rto_estimator_get_timeout(estimator), estimator->n_backoffs,
+           estimator->n_timeouts);
+}
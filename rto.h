@@ -0,0 +1,56 @@
+/**
+ * RTO = retransmission timeout.
+ * Estimator of the round-trip time and the retransmission timeout
+ * from RTT samples, as in RFC 6298. Times are in seconds.
+ * For the Client, the Server only uses `RTO_MAX`. */
+
+#ifndef RTO_H
+#define RTO_H
+
+/**
+ * the timeout before the first RTT sample */
+#define RTO_INITIAL 1.0
+
+/**
+ * bounds of the timeout, backoff included */
+#define RTO_MIN 0.01
+#define RTO_MAX 60.0
+
+typedef struct
+{
+    unsigned long n_samples;
+    double last_rtt; /* the last RTT sample */
+    double srtt; /* smoothed RTT */
+    double rttvar; /* RTT variation */
+    double rto; /* the timeout derived from `srtt` and `rttvar` */
+
+    /* the number of timeouts since data were last acknowledged */
+    unsigned int n_backoffs;
+
+    unsigned long n_timeouts;
+} rto_estimator;
+
+void rto_estimator_init( rto_estimator *estimator );
+
+/**
+ * Update the estimate with the RTT `rtt` of a packet sent only once.
+ * Samples of retransmitted packets are ambiguous and must not be used. */
+void rto_estimator_sample( rto_estimator *estimator, double rtt );
+
+/**
+ * Double the timeout after a timeout happened. */
+void rto_estimator_backoff( rto_estimator *estimator );
+
+/**
+ * Undo the backoff after new data were acknowledged. */
+void rto_estimator_reset_backoff( rto_estimator *estimator );
+
+/**
+ * Return the current timeout, backoff included. */
+double rto_estimator_get_timeout( rto_estimator *estimator );
+
+/**
+ * Print the state of the estimator. For statistics. */
+void rto_estimator_print( rto_estimator *estimator );
+
+#endif
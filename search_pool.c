@@ -0,0 +1,139 @@
+#include <errno.h>
+
+#include "common.h"
+#include "search_pool.h"
+
+/**
+ * Finish the jobs which are done, in order, until one which is not.
+ * The mutex of `pool` must be locked. */
+static void finish_jobs( search_pool *pool )
+{
+    while( pool->n_finished != pool->n_started )
+    {
+        search_job *job =
+            &pool->jobs[pool->n_finished % SEARCH_POOL_CAPACITY];
+        if( !job->done ) break;
+        if( pool->finish(pool->context, job) != 0 && pool->error == 0 )
+        {
+            pool->error = 1;
+        }
+        job->done = 0;
+        pool->n_finished++;
+        pthread_cond_broadcast(&pool->job_finished);
+    }
+}
+
+/**
+ * A thread of the pool. */
+static void *run( void *pool0 )
+{
+    search_pool *pool = pool0;
+    pthread_mutex_lock(&pool->mutex);
+    while( 1 )
+    {
+        search_job *job;
+        while( !pool->stop && pool->n_started == pool->n_queued )
+        {
+            pthread_cond_wait(&pool->job_queued, &pool->mutex);
+        }
+        if( pool->n_started == pool->n_queued ) break;
+
+        job = &pool->jobs[pool->n_started++ % SEARCH_POOL_CAPACITY];
+        pthread_mutex_unlock(&pool->mutex);
+        pool->run(pool->context, job);
+        pthread_mutex_lock(&pool->mutex);
+        job->done = 1;
+        finish_jobs(pool);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+search_pool *search_pool_new( unsigned int n_threads, void *context,
+                              search_job_run run0, search_job_finish finish )
+{
+    unsigned int i;
+    search_pool *pool = malloc_check(sizeof(search_pool));
+    pool->context = context;
+    pool->run = run0;
+    pool->finish = finish;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_queued, NULL);
+    pthread_cond_init(&pool->job_finished, NULL);
+    for( i = 0; i < SEARCH_POOL_CAPACITY; i++ ) pool->jobs[i].done = 0;
+    pool->n_queued = 0;
+    pool->n_started = 0;
+    pool->n_finished = 0;
+    pool->stop = 0;
+    pool->error = 0;
+    pool->n_full = 0;
+    pool->threads = malloc_check(n_threads * sizeof(pthread_t));
+    for( pool->n_threads = 0; pool->n_threads < n_threads; pool->n_threads++ )
+    {
+        int error = pthread_create(&pool->threads[pool->n_threads], NULL,
+                                   run, pool);
+        if( error != 0 )
+        {
+            errno = error;
+            perror("search_pool_new, pthread_create");
+            search_pool_free(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+int search_pool_free( search_pool *pool )
+{
+    unsigned int i;
+    int error;
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->job_queued);
+    pthread_mutex_unlock(&pool->mutex);
+    for( i = 0; i < pool->n_threads; i++ )
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    printf("Search pool: %lu searches in %u threads,"
+           " the queue was full %lu times.\n",
+           pool->n_finished, pool->n_threads, pool->n_full);
+
+    error = pool->error;
+    pthread_cond_destroy(&pool->job_finished);
+    pthread_cond_destroy(&pool->job_queued);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+    return error;
+}
+
+int search_pool_queue( search_pool *pool, void *target, char *file_name,
+                       sized_data data, void *buffer,
+                       packet_pool *buffer_pool )
+{
+    search_job *job;
+    int error;
+    pthread_mutex_lock(&pool->mutex);
+    if( pool->n_queued - pool->n_finished == SEARCH_POOL_CAPACITY )
+    {
+        pool->n_full++;
+        while( pool->n_queued - pool->n_finished == SEARCH_POOL_CAPACITY )
+        {
+            pthread_cond_wait(&pool->job_finished, &pool->mutex);
+        }
+    }
+    job = &pool->jobs[pool->n_queued++ % SEARCH_POOL_CAPACITY];
+    job->target = target;
+    job->file_name = file_name;
+    job->data = data;
+    job->buffer = buffer;
+    job->buffer_pool = buffer_pool;
+    job->found = 0;
+    job->search_time = 0;
+    job->done = 0;
+    pthread_cond_signal(&pool->job_queued);
+    error = pool->error;
+    pthread_mutex_unlock(&pool->mutex);
+    return error;
+}
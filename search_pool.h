@@ -0,0 +1,114 @@
+/**
+ * Pool of threads performing file searches,
+ * so that receiving packets does not wait for searches.
+ * Searches are queued in a bounded ring, performed concurrently
+ * and finished (their results written) in the order they were queued.
+ * For the Server. */
+
+#ifndef SEARCH_POOL_H
+#define SEARCH_POOL_H
+
+#include <pthread.h>
+
+#include "common.h"
+#include "packet_pool.h"
+
+/**
+ * the number of threads by default */
+#define SEARCH_POOL_DEFAULT_THREADS 4
+
+/**
+ * the maximal number of queued searches, not yet finished;
+ * queuing one more waits for the first to finish */
+#define SEARCH_POOL_CAPACITY 64
+
+typedef struct
+{
+    /* given to `search_pool_queue`, where the result goes */
+    void *target;
+
+    /* parts of `buffer`, the file name is terminated by `'\0'` */
+    char *file_name;
+    sized_data data;
+
+    /* held by the job, given back to `buffer_pool`,
+     * or freed if `buffer_pool` is `NULL`, by `search_job_finish` */
+    void *buffer;
+    packet_pool *buffer_pool;
+
+    /* the result, `matching_file_name` is valid if `found` */
+    int found;
+    char matching_file_name[FILE_NAME_SIZE];
+    double search_time; /* in seconds */
+
+    /* whether the search was performed, but not finished */
+    int done;
+} search_job;
+
+/**
+ * Perform the search of `job`, writing its result into it.
+ * Called by several threads at once. */
+typedef void (*search_job_run)( void *context, search_job *job );
+
+/**
+ * Finish `job`, writing its result out. Called for one job at a time,
+ * in the order the jobs were queued.
+ * Return a non-zero number if an error happened. */
+typedef int (*search_job_finish)( void *context, search_job *job );
+
+typedef struct
+{
+    void *context;
+    search_job_run run;
+    search_job_finish finish;
+
+    pthread_mutex_t mutex; /* for all the following */
+    pthread_cond_t job_queued;
+    pthread_cond_t job_finished;
+
+    /* the job `n` is `jobs[n % SEARCH_POOL_CAPACITY]` */
+    search_job jobs[SEARCH_POOL_CAPACITY];
+
+    /* the numbers of jobs queued, taken by threads and finished,
+     * `n_finished <= n_started <= n_queued` */
+    unsigned long n_queued;
+    unsigned long n_started;
+    unsigned long n_finished;
+
+    /* set to make the threads exit after all jobs are finished */
+    int stop;
+
+    /* the first error of finishing a job, `0` if none */
+    int error;
+
+    unsigned int n_threads;
+    pthread_t *threads;
+
+    /* for statistics, the number of times queuing waited for a free slot */
+    unsigned long n_full;
+} search_pool;
+
+/**
+ * Return a new pool of `n_threads` threads calling `run` and `finish`
+ * with `context`, or `NULL` if an error happened. */
+search_pool *search_pool_new( unsigned int n_threads, void *context,
+                              search_job_run run, search_job_finish finish );
+
+/**
+ * Finish all queued jobs, stop the threads and free the pool.
+ * Return a non-zero number if finishing a job failed. */
+int search_pool_free( search_pool *pool );
+
+/**
+ * Queue a search for a file named `file_name` with the contents `data`,
+ * with the result going to `target`. Both are parts of `buffer`,
+ * a holder of which is taken over by the job, see `search_job`,
+ * so nothing is copied.
+ * If the queue is full, wait for a job to finish.
+ * Return a non-zero number if finishing a job failed,
+ * then later searches should not be queued. */
+int search_pool_queue( search_pool *pool, void *target, char *file_name,
+                       sized_data data, void *buffer,
+                       packet_pool *buffer_pool );
+
+#endif
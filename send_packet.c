@@ -12,18 +12,41 @@
 #include "send_packet.h"
 
 static float loss_probability = 0.0f;
+static unsigned int loss_mtu = 0;
 
 void set_loss_probability( float x )
 {
     loss_probability = x;
 }
 
-ssize_t send_packet( int sock, const char* buffer, size_t size, int flags, const struct sockaddr* addr, socklen_t addrlen )
+void set_loss_mtu( unsigned int mtu )
+{
+    loss_mtu = mtu;
+}
+
+/* Returns whether a datagram of the given size is dropped. */
+static int is_dropped( size_t size )
 {
-    float rnd = drand48();
+    unsigned int n_fragments = 1;
+    unsigned int i;
+    if( loss_mtu != 0 )
+    {
+        /* Fragments carry multiples of 8 bytes of the UDP datagram
+         * after a 20 bytes IP header. */
+        size_t fragment_size = (loss_mtu - 20) / 8 * 8;
+        n_fragments = (size + 8 + fragment_size - 1) / fragment_size;
+    }
+    for( i = 0; i < n_fragments; i++ )
+    {
+        if( drand48() < loss_probability ) return 1;
+    }
+    return 0;
+}
 
+ssize_t send_packet( int sock, const char* buffer, size_t size, int flags, const struct sockaddr* addr, socklen_t addrlen )
+{
     if( !(buffer[6] & 0x4) && /* Ignore termination packets. */
-	    (rnd < loss_probability) )
+	    is_dropped(size) )
     {
         fprintf(stderr, "Randomly dropping a packet\n");
         return size;
@@ -36,3 +59,50 @@ ssize_t send_packet( int sock, const char* buffer, size_t size, int flags, const
                    addr,
                    addrlen );
 }
+
+unsigned int drop_packets( struct mmsghdr* messages, unsigned int n )
+{
+    unsigned int i;
+    unsigned int n_kept = 0;
+
+    /* Move the messages that are not dropped to the front. */
+    for( i = 0; i < n; i++ )
+    {
+        struct msghdr* header = &messages[i].msg_hdr;
+        const char* buffer = header->msg_iov[0].iov_base;
+        size_t size = 0;
+        size_t j;
+        for( j = 0; j < header->msg_iovlen; j++ )
+        {
+            size += header->msg_iov[j].iov_len;
+        }
+        /* Without loss the shared state of drand48 is not touched,
+         * threads sending at once do not write to it. */
+        if( loss_probability > 0.0f &&
+            !(buffer[6] & 0x4) && /* Ignore termination packets. */
+            is_dropped(size) )
+        {
+            fprintf(stderr, "Randomly dropping a packet\n");
+            continue;
+        }
+        if( n_kept != i ) messages[n_kept] = messages[i];
+        n_kept++;
+    }
+    return n_kept;
+}
+
+int send_packets( int sock, struct mmsghdr* messages, unsigned int n, int flags )
+{
+    unsigned int i;
+    unsigned int n_kept = drop_packets( messages, n );
+
+    /* sendmmsg may send only a part of the messages */
+    i = 0;
+    while( i < n_kept )
+    {
+        int n_sent = sendmmsg( sock, messages + i, n_kept - i, flags );
+        if( n_sent < 0 ) return -1;
+        i += n_sent;
+    }
+    return n;
+}
@@ -18,10 +18,33 @@
  */
 void set_loss_probability( float x );
 
+/* This function makes send_packet and send_packets emulate IP fragmentation
+ * on a link of the given MTU: a datagram that does not fit is sent in several
+ * fragments, each one dropped with the loss probability, and it is lost
+ * if any of them is. With 0, the default, datagrams are not fragmented.
+ */
+void set_loss_mtu( unsigned int mtu );
+
 /* This is a lossy replacement for the sendto function. It uses a random
  * number generator to drop packets with the probability chosen with
  * set_loss_probability. If it doesn't drop the packet, it calls sendto.
  */
 ssize_t send_packet( int sock, const char* buffer, size_t size, int flags, const struct sockaddr* addr, socklen_t addrlen );
 
+/* This is a lossy replacement for the sendmmsg function. Each message must
+ * hold a single packet, starting with its header in the first iovec, and
+ * each packet is dropped with the probability chosen with
+ * set_loss_probability, exactly as in send_packet. The packets that are
+ * not dropped are sent with as few sendmmsg calls as possible.
+ * It returns the number of messages, dropped ones included, or -1.
+ */
+int send_packets( int sock, struct mmsghdr* messages, unsigned int n, int flags );
+
+/* This is the lossy part of send_packets, for callers sending the packets
+ * themselves: each packet is dropped exactly as in send_packets, and the
+ * messages that are not dropped are moved to the front.
+ * It returns the number of messages that are not dropped.
+ */
+unsigned int drop_packets( struct mmsghdr* messages, unsigned int n );
+
 #endif /* SEND_PACKET_H */
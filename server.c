@@ -1,34 +1,98 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "send_packet.h"
 #include "common.h"
 #include "protocol.h"
+#include "packet_batch.h"
+#include "packet_pool.h"
+#include "file_ring.h"
+#include "file_index.h"
+#include "index_watch.h"
+#include "search_pool.h"
+#include "session_table.h"
+#include "rto.h"
 
 /**
  * File search handler, an object that performs file search in a directory. */
 typedef struct
 {
     char *dir_name;
-    DIR *dir_stream;
+
+    /* `NULL` if each session has its own match list file, see `match_output` */
     FILE *match_stream;
+
+    /* Unless `NULL`, the match list file of each session is named
+     * by this prefix and the number of the session. */
+    char *match_prefix;
+
+    /* the number of the last session with its own match list file */
+    unsigned long n_outputs;
+
+    /* `NULL` if the directory is read again for each search */
+    file_index *index;
+
+    /* keeps `index` up to date with the directory, `NULL` if it is not kept;
+     * then `index` is owned and used through the watcher */
+    index_watch *watch;
+
+    /* the file `index` is kept in, `NULL` if it is not kept */
+    char *index_file_name;
+
+    /* performs the searches, `NULL` if they are performed when queued */
+    search_pool *pool;
+
+    /* the ring of each thread which reads the directory for a search,
+     * set up by its first search and freed when the thread exits */
+    pthread_key_t rings;
+
+    /* Held during a search in `index` if it is not watched,
+     * which may change it, so such searches in the pool
+     * are performed one at a time. */
+    pthread_mutex_t lock;
+
+    /* held while a result is written, by one of several receiving threads
+     * or by the pool, and while a `match_output` is taken or released */
+    pthread_mutex_t write_lock;
+
+    /* for statistics, written in the order of the searches */
+    unsigned long n_searches;
+    double search_time; /* of all searches, in seconds */
 } search_handler;
 
+/**
+ * Match list file of one session, written as `<file_name>.part`
+ * and renamed to `file_name` when it is complete,
+ * so a complete file is never seen partly written. */
+typedef struct
+{
+    FILE *stream;
+    char file_name[FILE_NAME_SIZE];
+
+    /* the session while it lasts and each of its queued searches,
+     * the file is complete when none is left */
+    unsigned int n_users;
+} match_output;
 
+/**
+ * the signal which stopped the server, `0` while it runs */
+static volatile sig_atomic_t stop_signal = 0;
 
 
 /**
- * Return whether `data` and the contents of the file named `file_name`
- * are equal. `data` and the file must be of equal size. */
-int memory_file_equal( sized_data data, char *file_name )
+ * Return the time of a monotonic clock in seconds. For statistics. */
+double get_seconds( void )
 {
-    int r;
-    sized_data data1 = malloc_sized_check(data.size);
-    if(read_file_all(data1, file_name) != 0) r = 0;
-    else r = 0 == memcmp(data.data, data1.data, data.size);
-    free(data1.data);
-    return r;
+    struct timespec time0;
+    clock_gettime(CLOCK_MONOTONIC, &time0);
+    return time0.tv_sec + time0.tv_nsec / 1e9;
 }
 
 
@@ -37,26 +101,83 @@ int memory_file_equal( sized_data data, char *file_name )
  * File search handler
  */
 
+/**
+ * the ring of a thread where io_uring is not available,
+ * so that it is not set up again for each search */
+static char no_ring;
+
+/**
+ * Free the `ring` of a thread which exits, as a destructor of `rings`. */
+static void free_thread_ring( void *ring )
+{
+    if( ring != &no_ring ) file_ring_free(ring);
+}
+
+int search_handler_free( search_handler *search_handler0 );
+void search_job_run_handler( void *search_handler0, search_job *job );
+int search_job_finish_handler( void *search_handler0, search_job *job );
+
 /**
  * Return a new file search handler that will search in the directory `dir_name`
- * and write search results into the textual file `match_file_name`.
+ * and write search results into the textual file `match_file_name`,
+ * or if `per_session`, into a file of each session
+ * named `<match_file_name>.<n>`,
+ * where `n` counts the sessions from the first one not written yet.
+ * Unless `rescan`, the files are indexed now
+ * and files added to the directory later are not found,
+ * unless `watch`, then the index is updated while the directory changes.
+ * Unless `index_file_name` is `NULL`, the index is kept in that file
+ * and only files changed since it was written are read.
+ * Unless `n_threads` is `0`, searches are performed by that many threads
+ * and the results are written in the order the searches were queued.
  * Return `NULL` if an error happened. */
-search_handler *search_handler_new( char *dir_name, char *match_file_name )
+search_handler *search_handler_new( char *dir_name, char *match_file_name,
+                                    int per_session, int rescan,
+                                    char *index_file_name, int watch,
+                                    unsigned int n_threads )
 {
-    FILE *match_stream;
+    FILE *match_stream = NULL;
+    char *match_prefix = NULL;
+    unsigned long n_outputs = 0;
     char *dir_name1;
+    file_index *index = NULL;
+    index_watch *watch0 = NULL;
     DIR *dir_stream = opendir(dir_name);
     if( dir_stream == NULL )
     {
         perror("search_handler_new, open directory");
         print_accessed_path(dir_name);
     }
-    
-    match_stream = fopen(match_file_name, "a");
-    if( match_stream == NULL )
+
+    if( per_session )
     {
-        perror("search_handler_new, open match list file");
-        print_accessed_path(match_file_name);
+        /* an existing file is not written over, so numbers go on
+         * from the last run of the server */
+        struct stat stat0;
+        char output_file_name[FILE_NAME_SIZE];
+        do
+        {
+            n_outputs++;
+            snprintf(output_file_name, sizeof(output_file_name), "%s.%lu",
+                     match_file_name, n_outputs);
+        } while( stat(output_file_name, &stat0) == 0 );
+        n_outputs--;
+        match_prefix = strdup(match_file_name);
+        if( match_prefix == NULL )
+        {
+            fputs("search_handler_new: Memory allocation error"
+                  " in \"strdup\".\n", stderr);
+            error_exit();
+        }
+    }
+    else
+    {
+        match_stream = fopen(match_file_name, "a");
+        if( match_stream == NULL )
+        {
+            perror("search_handler_new, open match list file");
+            print_accessed_path(match_file_name);
+        }
     }
 
     dir_name1 = strdup(dir_name);
@@ -67,183 +188,1284 @@ search_handler *search_handler_new( char *dir_name, char *match_file_name )
         error_exit();
     }
 
-    if( dir_stream != NULL && match_stream != NULL )
+    if( dir_stream != NULL && (match_stream != NULL || per_session)
+        && !rescan )
+    {
+        double start_time = get_seconds();
+        index = index_file_name != NULL
+            ? file_index_open(dir_name, index_file_name)
+            : file_index_new(dir_name);
+        if( index != NULL )
+        {
+            printf("Indexed %lu files in %.6f s, %lu of them read,"
+                   " the index takes %lu bytes.\n",
+                   index->n_entries, get_seconds() - start_time,
+                   index->n_hashed, file_index_get_memory_size(index));
+            if( watch && (watch0 = index_watch_new(index)) == NULL )
+            {
+                file_index_free(index);
+                index = NULL;
+            }
+        }
+    }
+
+    if( dir_stream != NULL && (match_stream != NULL || per_session)
+        && (rescan || index != NULL) )
     {
         search_handler *r = malloc_check(sizeof(search_handler));
         r->dir_name = dir_name1;
-        r->dir_stream = dir_stream;
+        closedir(dir_stream);
         r->match_stream = match_stream;
+        r->match_prefix = match_prefix;
+        r->n_outputs = n_outputs;
+        r->index = index;
+        r->watch = watch0;
+        r->index_file_name = index_file_name;
+        r->n_searches = 0;
+        r->search_time = 0;
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_mutex_init(&r->write_lock, NULL);
+        pthread_key_create(&r->rings, free_thread_ring);
+        r->pool = NULL;
+        if( n_threads != 0 )
+        {
+            r->pool = search_pool_new(n_threads, r, search_job_run_handler,
+                                      search_job_finish_handler);
+            if( r->pool == NULL )
+            {
+                search_handler_free(r);
+                return NULL;
+            }
+        }
         return r;
     }
     else
     {
         if( dir_stream != NULL ) closedir(dir_stream);
         if( match_stream != NULL ) fclose(match_stream);
+        free(match_prefix);
+        free(dir_name1);
         return NULL;
     }
 }
 
-void search_handler_free(search_handler *search_handler0)
+int search_handler_free( search_handler *search_handler0 )
 {
-    closedir(search_handler0->dir_stream);
-    fclose(search_handler0->match_stream);
+    int error = 0;
+    void *ring;
+    if( search_handler0->pool != NULL )
+    {
+        error = search_pool_free(search_handler0->pool);
+    }
+    /* the rings of the other threads were freed when they exited */
+    ring = pthread_getspecific(search_handler0->rings);
+    if( ring != NULL ) free_thread_ring(ring);
+    pthread_key_delete(search_handler0->rings);
+    printf("Searches: %lu, average search time: %.6f s.\n",
+           search_handler0->n_searches,
+           search_handler0->n_searches == 0 ? 0.0
+           : search_handler0->search_time / search_handler0->n_searches);
+    if( search_handler0->watch != NULL )
+    {
+        search_handler0->index = index_watch_free(search_handler0->watch);
+    }
+    if( search_handler0->index != NULL )
+    {
+        /* files which changed were hashed again during searches
+         * or by the watcher */
+        if( search_handler0->index_file_name != NULL
+            && search_handler0->index->modified )
+        {
+            file_index_save(search_handler0->index,
+                            search_handler0->index_file_name);
+        }
+        file_index_free(search_handler0->index);
+    }
+    pthread_mutex_destroy(&search_handler0->write_lock);
+    pthread_mutex_destroy(&search_handler0->lock);
+    if( search_handler0->match_stream != NULL )
+    {
+        fclose(search_handler0->match_stream);
+    }
+    free(search_handler0->match_prefix);
     free(search_handler0->dir_name);
     free(search_handler0);
+    return error;
 }
 
 /**
- * Search for a file which content is equal to `remote_data`.
- * Return a non-zero number if an error happened. */
-int search_handler_search( search_handler *search_handler0,
-                           char *remote_file_name, sized_data remote_data )
+ * Return the ring of the calling thread, set up by its first call,
+ * or `NULL` if io_uring is not available. */
+file_ring *search_handler_get_ring( search_handler *search_handler0 )
 {
-    int error = 0;
-    char *matching_file_name;
-    char list_line[FILE_NAME_SIZE] = {0};
-    while( 1 )
+    void *ring = pthread_getspecific(search_handler0->rings);
+    if( ring == NULL )
     {
-        char local_file_name[FILE_NAME_SIZE] = {0};
-        struct stat stat0;
-        struct dirent *dir_entry = readdir(search_handler0->dir_stream);
-        if( dir_entry == NULL )
+        ring = file_ring_new();
+        if( ring == NULL ) ring = &no_ring;
+        pthread_setspecific(search_handler0->rings, ring);
+    }
+    return ring == &no_ring ? NULL : ring;
+}
+
+/**
+ * Return the index of the first of the `n` files of `loads`
+ * which content is equal to `data`, or `n` if there is no such file.
+ * The files are stat-ed in one batch, then those of the size of `data`
+ * are compared through mappings, in order. */
+unsigned int search_handler_scan_batch( file_ring *ring, sized_data data,
+                                        file_load *loads, unsigned int n )
+{
+    unsigned int i;
+    file_ring_stat(ring, loads, n);
+    for( i = 0; i < n; i++ )
+    {
+        if( loads[i].file_size == (long)data.size
+            && memory_file_equal(data, loads[i].file_name) )
         {
-            matching_file_name = NULL;
-            break;
+            return i;
         }
-        snprintf(local_file_name, sizeof(local_file_name), "%s%c%s",
-                 search_handler0->dir_name, DIR_SEPARATOR, dir_entry->d_name);
+    }
+    return n;
+}
 
-        if( stat(local_file_name, &stat0) != 0 )
+/**
+ * Return the name of a file in the directory of `search_handler0`
+ * which content is equal to `data`, reading the whole directory,
+ * copied into `matching_file_name` of `FILE_NAME_SIZE` bytes,
+ * or `NULL` if there is no such file.
+ * The directory is opened for each search, so searches may run concurrently.
+ * The files are stat-ed in batches of `FILE_RING_DEPTH`. */
+char *search_handler_scan( search_handler *search_handler0, sized_data data,
+                           char *matching_file_name )
+{
+    char *r = NULL;
+    file_ring *ring;
+    file_load loads[FILE_RING_DEPTH];
+    char *paths;
+    unsigned int n_loads = 0;
+    size_t name_offset = strlen(search_handler0->dir_name) + 1;
+    DIR *dir_stream = opendir(search_handler0->dir_name);
+    if( dir_stream == NULL )
+    {
+        perror("search_handler_scan, open directory");
+        print_accessed_path(search_handler0->dir_name);
+        return NULL;
+    }
+    ring = search_handler_get_ring(search_handler0);
+    paths = malloc_check(FILE_RING_DEPTH * FILE_NAME_SIZE);
+    while( r == NULL )
+    {
+        struct dirent *dir_entry = readdir(dir_stream);
+        if( dir_entry != NULL )
         {
-            perror("search_handler_search");
-            print_accessed_path(local_file_name);
+            loads[n_loads].file_name = paths + n_loads * FILE_NAME_SIZE;
+            snprintf(loads[n_loads].file_name, FILE_NAME_SIZE, "%s%c%s",
+                     search_handler0->dir_name, DIR_SEPARATOR,
+                     dir_entry->d_name);
+            n_loads++;
         }
-        else
+        if( n_loads == FILE_RING_DEPTH || (dir_entry == NULL && n_loads != 0) )
         {
-            if( S_ISREG(stat0.st_mode) )
+            unsigned int i =
+                search_handler_scan_batch(ring, data, loads, n_loads);
+            if( i != n_loads )
             {
-                size_t file_size = stat0.st_size;
-                if( remote_data.size == file_size
-                    && memory_file_equal(remote_data, local_file_name) )
-                {
-                    matching_file_name = dir_entry->d_name;
-                    break;
-                }
+                snprintf(matching_file_name, FILE_NAME_SIZE, "%s",
+                         loads[i].file_name + name_offset);
+                r = matching_file_name;
             }
+            n_loads = 0;
         }
+        if( dir_entry == NULL ) break;
     }
-    rewinddir(search_handler0->dir_stream);
+    free(paths);
+    closedir(dir_stream);
+    return r;
+}
 
-    /* write the search result to the file */
+/**
+ * Return the name of a file which content is equal to `data`,
+ * copied into `matching_file_name` of `FILE_NAME_SIZE` bytes,
+ * or `NULL` if there is no such file. May be called by several threads. */
+char *search_handler_find( search_handler *search_handler0, sized_data data,
+                           char *matching_file_name )
+{
+    char *r;
+    if( search_handler0->watch != NULL )
+    {
+        return index_watch_find(search_handler0->watch, data,
+                                matching_file_name);
+    }
+    if( search_handler0->index == NULL )
+    {
+        return search_handler_scan(search_handler0, data, matching_file_name);
+    }
+    pthread_mutex_lock(&search_handler0->lock);
+    r = file_index_find(search_handler0->index, data);
+    if( r != NULL )
+    {
+        snprintf(matching_file_name, FILE_NAME_SIZE, "%s", r);
+        r = matching_file_name;
+    }
+    pthread_mutex_unlock(&search_handler0->lock);
+    return r;
+}
+
+/**
+ * Set `*output` to the match list file of a new session,
+ * or to `NULL` if sessions do not have their own files.
+ * Return a non-zero number if an error happened. */
+int search_handler_open_output( search_handler *search_handler0,
+                                match_output **output )
+{
+    match_output *output0;
+    char part_file_name[FILE_NAME_SIZE];
+    unsigned long n;
+    *output = NULL;
+    if( search_handler0->match_prefix == NULL ) return 0;
+
+    pthread_mutex_lock(&search_handler0->write_lock);
+    n = ++search_handler0->n_outputs;
+    pthread_mutex_unlock(&search_handler0->write_lock);
+    output0 = malloc_check(sizeof(match_output));
+    snprintf(output0->file_name, sizeof(output0->file_name), "%s.%lu",
+             search_handler0->match_prefix, n);
+    snprintf(part_file_name, sizeof(part_file_name), "%s.part",
+             output0->file_name);
+    output0->stream = fopen(part_file_name, "w");
+    if( output0->stream == NULL )
+    {
+        perror("search_handler_open_output");
+        print_accessed_path(part_file_name);
+        free(output0);
+        return 1;
+    }
+    output0->n_users = 1;
+    *output = output0;
+    return 0;
+}
+
+/**
+ * Stop using `output`, which may be `NULL`. When it has no more users,
+ * it is complete, then it is closed, renamed to its final name and freed.
+ * Return a non-zero number if an error happened. */
+int search_handler_release_output( search_handler *search_handler0,
+                                   match_output *output )
+{
+    int error = 0;
+    int complete;
+    char part_file_name[FILE_NAME_SIZE];
+    if( output == NULL ) return 0;
+    pthread_mutex_lock(&search_handler0->write_lock);
+    complete = --output->n_users == 0;
+    pthread_mutex_unlock(&search_handler0->write_lock);
+    if( !complete ) return 0;
+
+    snprintf(part_file_name, sizeof(part_file_name), "%s.part",
+             output->file_name);
+    if( fclose(output->stream) != 0 )
+    {
+        perror("search_handler_release_output, close");
+        print_accessed_path(part_file_name);
+        error = 1;
+    }
+    else if( rename(part_file_name, output->file_name) != 0 )
+    {
+        perror("search_handler_release_output, rename");
+        print_accessed_path(output->file_name);
+        error = 1;
+    }
+    else printf("Wrote the match list file %s.\n", output->file_name);
+    free(output);
+    return error;
+}
+
+/**
+ * Write the result of a search for the file `remote_file_name`,
+ * which took `search_time` seconds, to `output`,
+ * or to the match list file of the handler if `output` is `NULL`.
+ * Return a non-zero number if an error happened. */
+int search_handler_write( search_handler *search_handler0,
+                          match_output *output, char *remote_file_name,
+                          char *matching_file_name, double search_time )
+{
+    int error = 0;
+    char list_line[FILE_NAME_SIZE] = {0};
     snprintf(list_line, sizeof(list_line), "%s %s\n",
              remote_file_name,
              matching_file_name == NULL ? "UNKNOWN" : matching_file_name);
-    if( fputs(list_line, search_handler0->match_stream) == EOF )
+    pthread_mutex_lock(&search_handler0->write_lock);
+    search_handler0->n_searches++;
+    search_handler0->search_time += search_time;
+    if( fputs(list_line, output != NULL ? output->stream
+                         : search_handler0->match_stream) == EOF )
     {
-        perror("search_handler_search");
+        perror("search_handler_write");
         error = 1;
     }
+    pthread_mutex_unlock(&search_handler0->write_lock);
     return error;
 }
 
-int handle_session( int udp_socket, search_handler *search_handler0 )
+void search_job_run_handler( void *search_handler0, search_job *job )
 {
-    int error = 0;
+    double start_time = get_seconds();
+    job->found = search_handler_find(search_handler0, job->data,
+                                     job->matching_file_name) != NULL;
+    job->search_time = get_seconds() - start_time;
+}
+
+/**
+ * Give back `buffer` to `buffer_pool`, or free it if `buffer_pool` is `NULL`.
+ */
+void release_search_buffer( void *buffer, packet_pool *buffer_pool )
+{
+    if( buffer_pool != NULL ) packet_pool_put(buffer_pool, buffer);
+    else free(buffer);
+}
+
+int search_job_finish_handler( void *search_handler0, search_job *job )
+{
+    int error = search_handler_write(
+        search_handler0, job->target, job->file_name,
+        job->found ? job->matching_file_name : NULL, job->search_time);
+    if( search_handler_release_output(search_handler0, job->target) != 0 )
+    {
+        error = 1;
+    }
+    release_search_buffer(job->buffer, job->buffer_pool);
+    return error;
+}
+
+/**
+ * Search for a file which content is equal to `remote_data`,
+ * writing the result to `output` (see `search_handler_write`),
+ * or queue the search if the handler has a pool of threads,
+ * then `output` is used until the search is finished.
+ * `remote_file_name` and `remote_data` are parts of `buffer`,
+ * a holder of which is taken over: it is given back to `buffer_pool`,
+ * or freed if `buffer_pool` is `NULL`, when the search is finished.
+ * Return a non-zero number if an error happened. */
+int search_handler_search( search_handler *search_handler0,
+                           match_output *output, char *remote_file_name,
+                           sized_data remote_data, void *buffer,
+                           packet_pool *buffer_pool )
+{
+    char matching_file_name1[FILE_NAME_SIZE];
+    char *matching_file_name;
+    double start_time;
+    int error;
+    if( search_handler0->pool != NULL )
+    {
+        if( output != NULL )
+        {
+            pthread_mutex_lock(&search_handler0->write_lock);
+            output->n_users++;
+            pthread_mutex_unlock(&search_handler0->write_lock);
+        }
+        return search_pool_queue(search_handler0->pool, output,
+                                 remote_file_name, remote_data,
+                                 buffer, buffer_pool);
+    }
+    start_time = get_seconds();
+    matching_file_name = search_handler_find(search_handler0, remote_data,
+                                             matching_file_name1);
+    error = search_handler_write(search_handler0, output, remote_file_name,
+                                 matching_file_name,
+                                 get_seconds() - start_time);
+    release_search_buffer(buffer, buffer_pool);
+    return error;
+}
+
+/**
+ * the greatest size of a file reassembled from fragments, in bytes,
+ * a larger size announced by a packet is not allocated */
+#define MAX_FILE_ASSEMBLY_SIZE 0x40000000UL
 
-    /* `seq_n` of the last data packet received */
-    seq_n_t last_seq_n = seq_n_neg(1);
-    
-    struct sockaddr_storage remote_address;
-    socklen_t remote_address_length;
+/**
+ * A file being reassembled from fragments. */
+typedef struct
+{
+    int req_n;
+    /* in the block of `data`, after the data of the file */
+    sized_data file_name;
+    sized_data data; /* `NULL` if there is no such file */
+    unsigned long received_size;
+} file_assembly;
 
-    sized_data packet_buffer = malloc_sized_check(UDP_SIZE);
+void file_assembly_init( file_assembly *assembly )
+{
+    assembly->file_name.data = NULL;
+    assembly->data.data = NULL;
+}
+
+void file_assembly_clear( file_assembly *assembly )
+{
+    free(assembly->data.data);
+    file_assembly_init(assembly);
+}
+
+/**
+ * Perform a file search for the file in `payload_p`,
+ * writing the result to `output`.
+ * If the whole file is there, it is searched for in `buffer`,
+ * the buffer of the packet taken from `buffers`, which gets one more holder.
+ * If it is a fragment, copy it into `assembly`
+ * and search when the whole file is there.
+ * Fragments must be passed in order.
+ * Return a non-zero number if an error happened. */
+int search_payload( search_handler *search_handler0, match_output *output,
+                    file_assembly *assembly, packet_payload_p payload_p,
+                    packet_pool *buffers, void *buffer )
+{
+    int error;
+    if( payload_p.offset == 0 && payload_p.data.size == payload_p.file_size )
+    {
+        /* the whole file in one packet */
+        if( assembly->data.data != NULL )
+        {
+            printf("Dropping an incomplete file.\n");
+            file_assembly_clear(assembly);
+        }
+        printf("Searching for the file, remote file name: %s\n",
+               (char *)payload_p.file_name.data);
+        packet_pool_hold(buffers, buffer);
+        return search_handler_search(search_handler0, output,
+                                     payload_p.file_name.data, payload_p.data,
+                                     buffer, buffers);
+    }
+
+    if( payload_p.offset == 0 )
+    {
+        if( assembly->data.data != NULL )
+        {
+            printf("Dropping an incomplete file.\n");
+            file_assembly_clear(assembly);
+        }
+        /* the size comes from the network, it must not stop the server */
+        if( payload_p.file_size > MAX_FILE_ASSEMBLY_SIZE )
+        {
+            printf("Dropping the file %s of %lu bytes, more than %lu.\n",
+                   (char *)payload_p.file_name.data, payload_p.file_size,
+                   MAX_FILE_ASSEMBLY_SIZE);
+            return 0;
+        }
+        assembly->data.data =
+            malloc(payload_p.file_size + payload_p.file_name.size);
+        if( assembly->data.data == NULL )
+        {
+            printf("Dropping the file %s of %lu bytes,"
+                   " memory allocation error.\n",
+                   (char *)payload_p.file_name.data, payload_p.file_size);
+            return 0;
+        }
+        assembly->req_n = payload_p.req_n;
+        assembly->data.size = payload_p.file_size;
+        assembly->file_name.data =
+            (char *)assembly->data.data + payload_p.file_size;
+        assembly->file_name.size = payload_p.file_name.size;
+        memcpy(assembly->file_name.data, payload_p.file_name.data,
+               payload_p.file_name.size);
+        assembly->received_size = 0;
+    }
+    else if( assembly->data.data == NULL
+             || payload_p.req_n != assembly->req_n
+             || payload_p.file_size != assembly->data.size
+             || payload_p.offset != assembly->received_size
+             || payload_p.data.size
+                > assembly->data.size - assembly->received_size )
+    {
+        printf("Received an unexpected fragment"
+               " with req_n = %d, offset = %lu.\n",
+               payload_p.req_n, payload_p.offset);
+        return 0;
+    }
+
+    /* the only copy of the file data */
+    memcpy((char *)assembly->data.data + payload_p.offset,
+           payload_p.data.data, payload_p.data.size);
+    assembly->received_size += payload_p.data.size;
+    printf("Received %lu of %lu bytes of the file %s.\n",
+           assembly->received_size, payload_p.file_size,
+           (char *)assembly->file_name.data);
+    if( assembly->received_size != payload_p.file_size ) return 0;
+
+    printf("Searching for the file, remote file name: %s\n",
+           (char *)assembly->file_name.data);
+    /* the search takes over the block */
+    error = search_handler_search(search_handler0, output,
+                                  assembly->file_name.data, assembly->data,
+                                  assembly->data.data, NULL);
+    file_assembly_init(assembly);
+    return error;
+}
+
+/**
+ * Perform a file search for each file in the data packet `packet`,
+ * writing the results to `output`.
+ * `packet` is in `buffer`, taken from `buffers`.
+ * Return a non-zero number if an error happened. */
+int search_packet( search_handler *search_handler0, match_output *output,
+                   file_assembly *assembly, sized_data packet,
+                   packet_pool *buffers, void *buffer )
+{
+    packet_payload_p payload_p = get_packet_payload_p(packet);
     while( 1 )
     {
-        ssize_t packet_size;
-        sized_data packet;
-        int packet_type;
-        remote_address_length = sizeof(remote_address);
-        packet_size =
-            recvfrom(udp_socket, packet_buffer.data, packet_buffer.size, 0,
-                     (struct sockaddr *)&remote_address,
-                     &remote_address_length);
-        
-        if( packet_size < 0 )
-        {
-            perror("receive packet");
-            error = 1;
-            break;
+        if( payload_p.error != 0 )
+        {
+            printf("The data packet is invalid, error: %d\n", payload_p.error);
+            return 0;
+        }
+        if( search_payload(search_handler0, output, assembly, payload_p,
+                           buffers, buffer) != 0 )
+        {
+            return 1;
+        }
+        if( payload_p.next.size == 0 ) return 0;
+        payload_p = get_next_packet_payload_p(payload_p);
+    }
+}
+
+/**
+ * A packet held by `reorder_buffer`. */
+typedef struct
+{
+    sized_data packet; /* `packet.data` is `NULL` in empty slots */
+    void *buffer; /* the buffer `packet` is in */
+} reorder_slot;
+
+/**
+ * Receive buffer of the selective repeat mode.
+ * Holds the data packets received out of order
+ * until the packets preceding them arrive,
+ * as copies of their own size, so that a buffered packet
+ * does not keep a whole receive buffer of the pool. */
+typedef struct
+{
+    /* the pool the packets are copied out of */
+    packet_pool *pool;
+
+    /* the window size announced by the client, `0` before the first packet */
+    unsigned int window_size;
+
+    /* a power of 2 not less than `window_size` */
+    unsigned int capacity;
+
+    /* indexed by `seq_n % capacity` */
+    reorder_slot *packets;
+
+    /* the number of non-empty slots */
+    unsigned int n_buffered;
+
+    /* the `seq_n` after the last buffered packet, if `n_buffered != 0` */
+    seq_n_t end_seq_n;
+} reorder_buffer;
+
+void reorder_buffer_init( reorder_buffer *buffer, packet_pool *pool )
+{
+    buffer->pool = pool;
+    buffer->window_size = 0;
+    buffer->capacity = 0;
+    buffer->packets = NULL;
+    buffer->n_buffered = 0;
+    buffer->end_seq_n = 0;
+}
+
+void reorder_buffer_clear( reorder_buffer *buffer )
+{
+    unsigned int i;
+    for( i = 0; i < buffer->capacity; i++ )
+    {
+        if( buffer->packets[i].packet.data != NULL )
+        {
+            packet_pool_put(buffer->pool, buffer->packets[i].buffer);
+        }
+    }
+    free(buffer->packets);
+    reorder_buffer_init(buffer, buffer->pool);
+}
+
+/**
+ * Empty `buffer` for a new session, keeping its slots. */
+void reorder_buffer_reset( reorder_buffer *buffer )
+{
+    unsigned int i;
+    /* usually nothing is left at the end of a session */
+    if( buffer->n_buffered != 0 )
+    {
+        for( i = 0; i < buffer->capacity; i++ )
+        {
+            if( buffer->packets[i].packet.data != NULL )
+            {
+                packet_pool_put(buffer->pool, buffer->packets[i].buffer);
+                buffer->packets[i].packet.data = NULL;
+            }
+        }
+    }
+    buffer->window_size = 0;
+    buffer->n_buffered = 0;
+    buffer->end_seq_n = 0;
+}
+
+/**
+ * Return the slot of the packet with `seq_n` in `buffer`. */
+reorder_slot *reorder_buffer_slot( reorder_buffer *buffer, seq_n_t seq_n )
+{
+    return &buffer->packets[seq_n & (buffer->capacity - 1)];
+}
+
+/**
+ * Make `buffer` hold a window of `window_size` packets.
+ * The window may only grow, buffered packets are kept. */
+void reorder_buffer_reserve( reorder_buffer *buffer, unsigned int window_size )
+{
+    if( window_size <= buffer->window_size ) return;
+    printf("Using the window size %u.\n", window_size);
+    buffer->window_size = window_size;
+    if( window_size > buffer->capacity )
+    {
+        reorder_slot *old_packets = buffer->packets;
+        unsigned int old_capacity = buffer->capacity;
+        unsigned int i;
+        while( buffer->capacity < window_size )
+        {
+            buffer->capacity = buffer->capacity == 0
+                ? 1 : buffer->capacity * 2;
+        }
+        buffer->packets =
+            malloc_check(buffer->capacity * sizeof(reorder_slot));
+        for( i = 0; i < buffer->capacity; i++ )
+        {
+            buffer->packets[i].packet.size = 0;
+            buffer->packets[i].packet.data = NULL;
+        }
+        for( i = 0; i < old_capacity; i++ )
+        {
+            if( old_packets[i].packet.data != NULL )
+            {
+                *reorder_buffer_slot(
+                    buffer, get_packet_seq_n(old_packets[i].packet.data)) =
+                    old_packets[i];
+            }
+        }
+        free(old_packets);
+    }
+}
+
+/**
+ * Write the SACK bitmap of the packets buffered after `last_seq_n`,
+ * the last packet received in order, to `sack` of `MAX_SACK_SIZE` bytes.
+ * Return the size of the bitmap, `0` if no packets are buffered. */
+size_t reorder_buffer_write_sack( reorder_buffer *buffer, seq_n_t last_seq_n,
+                                  unsigned char *sack )
+{
+    seq_n_t next_seq_n = seq_n_add(last_seq_n, 1);
+    seq_n_t n_bits;
+    size_t sack_size;
+    seq_n_t i;
+    if( buffer->n_buffered == 0 ) return 0;
+
+    n_bits = seq_n_subtract(buffer->end_seq_n, next_seq_n);
+    sack_size = (n_bits + 7) / 8;
+    memset(sack, 0, sack_size);
+    /* the packet `next_seq_n` is missing, or it would have been delivered */
+    for( i = 1; i < n_bits; i++ )
+    {
+        if( reorder_buffer_slot(buffer,
+                                seq_n_add(next_seq_n, i))->packet.data
+            != NULL )
+        {
+            set_sack_bit(sack, i);
+        }
+    }
+    return sack_size;
+}
+
+/**
+ * Handle a data packet received in the selective repeat mode.
+ * Packets within the window are buffered and acknowledged one by one.
+ * Search for the files in the packets which are now in order,
+ * writing the results to `output` and moving `*last_seq_n` forward.
+ * Set `*send_ack` to whether `packet` must be acknowledged.
+ * `packet` is in `packet_buffer`, taken from the pool of `buffer`.
+ * Return a non-zero number if an error happened. */
+int receive_selective( search_handler *search_handler0, match_output *output,
+                       file_assembly *assembly, reorder_buffer *buffer,
+                       sized_data packet, void *packet_buffer,
+                       seq_n_t *last_seq_n, int *send_ack )
+{
+    seq_n_t seq_n = get_packet_seq_n(packet.data);
+    seq_n_t next_seq_n = seq_n_add(*last_seq_n, 1);
+    unsigned int window_size;
+    reorder_buffer_reserve(buffer, get_packet_window_size(packet.data));
+    window_size = buffer->window_size;
+    if( seq_n_between(next_seq_n, seq_n, seq_n_add(next_seq_n, window_size)) )
+    {
+        reorder_slot *slot = reorder_buffer_slot(buffer, seq_n);
+        *send_ack = 1;
+        if( seq_n == next_seq_n )
+        {
+            /* in order, no need to buffer it */
+            *last_seq_n = seq_n;
+            if( search_packet(search_handler0, output, assembly,
+                              packet, buffer->pool, packet_buffer) != 0 )
+            {
+                return 1;
+            }
+        }
+        else if( slot->packet.data == NULL )
+        {
+            printf("Buffering an out-of-order data packet.\n");
+            slot->packet = packet_pool_copy(buffer->pool, packet);
+            slot->buffer = slot->packet.data;
+            if( buffer->n_buffered == 0
+                || seq_n_subtract(seq_n, next_seq_n)
+                   >= seq_n_subtract(buffer->end_seq_n, next_seq_n) )
+            {
+                buffer->end_seq_n = seq_n_add(seq_n, 1);
+            }
+            buffer->n_buffered++;
+            return 0;
+        }
+
+        /* deliver the buffered packets which are now in order */
+        while( 1 )
+        {
+            reorder_slot buffered_packet;
+            next_seq_n = seq_n_add(*last_seq_n, 1);
+            slot = reorder_buffer_slot(buffer, next_seq_n);
+            if( slot->packet.data == NULL ) break;
+            buffered_packet = *slot;
+            slot->packet.data = NULL;
+            buffer->n_buffered--;
+            *last_seq_n = next_seq_n;
+            printf("Delivering a buffered data packet with seq_n = %u.\n",
+                   (unsigned int)next_seq_n);
+            if( search_packet(search_handler0, output, assembly,
+                              buffered_packet.packet, buffer->pool,
+                              buffered_packet.buffer) != 0 )
+            {
+                packet_pool_put(buffer->pool, buffered_packet.buffer);
+                return 1;
+            }
+            packet_pool_put(buffer->pool, buffered_packet.buffer);
         }
+    }
+    else
+    {
+        /* Already delivered if within the previous window,
+         * the ACK packet must have been lost. */
+        *send_ack = seq_n_between(seq_n_subtract(next_seq_n, window_size),
+                                  seq_n, next_seq_n);
+    }
+    return 0;
+}
+
+/**
+ * the time after which a session without packets from its client ends,
+ * for clients whose EOT packet was lost, in seconds.
+ * A client waits up to `RTO_MAX` to resend a packet,
+ * its session must not end meanwhile. */
+#define SESSION_IDLE_TIMEOUT (2 * RTO_MAX)
+
+/**
+ * the greatest number of sessions at once,
+ * data packets starting more sessions are dropped */
+#define MAX_SESSIONS 1024
+
+/**
+ * the greatest number of ended sessions kept for new ones,
+ * with the memory of their buffers */
+#define MAX_SPARE_SESSIONS 16
+
+/**
+ * The number of sessions the server serves,
+ * shared by the receiving threads, used when a session ends with EOT;
+ * sessions ended by the idle timeout are not served, so not counted. */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    unsigned long n_sessions; /* `0` to serve forever */
+    unsigned long n_ended;
+} session_quota;
+
+void session_quota_init( session_quota *quota, unsigned long n_sessions )
+{
+    pthread_mutex_init(&quota->mutex, NULL);
+    quota->n_sessions = n_sessions;
+    quota->n_ended = 0;
+}
+
+void session_quota_clear( session_quota *quota )
+{
+    pthread_mutex_destroy(&quota->mutex);
+}
+
+/**
+ * Count `n_ended` more sessions ended with EOT.
+ * Return whether the server served all its sessions. */
+int session_quota_add( session_quota *quota, unsigned long n_ended )
+{
+    int reached;
+    pthread_mutex_lock(&quota->mutex);
+    quota->n_ended += n_ended;
+    reached = quota->n_sessions != 0 && quota->n_ended >= quota->n_sessions;
+    pthread_mutex_unlock(&quota->mutex);
+    return reached;
+}
+
+/**
+ * State of a session with a client. */
+typedef struct server_session
+{
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    unsigned int session_id;
+
+    /* `seq_n` of the last data packet received in order */
+    seq_n_t last_seq_n;
+    reorder_buffer reorder_buffer0;
+    file_assembly assembly;
+
+    /* where the results of the session go, `NULL` for the handler's file */
+    match_output *output;
+
+    /* when the last packet of the session was received, in seconds */
+    double receive_time;
+
+    /* in the list of sessions by `receive_time`,
+     * or `next` in the list of spare sessions */
+    struct server_session *prev;
+    struct server_session *next;
+} server_session;
+
+/**
+ * the number of the last ended sessions whose late data packets,
+ * such as retransmissions delayed past the EOT packet, are dropped
+ * instead of starting a new session */
+#define N_RECENT_SESSIONS 64
+
+/**
+ * The client address and session id of an ended session. */
+typedef struct
+{
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    unsigned int session_id;
+} ended_session;
+
+/**
+ * All sessions of the server. */
+typedef struct
+{
+    search_handler *search_handler0;
+
+    /* the buffers datagrams are received into, of `UDP_SIZE` bytes,
+     * one pool for each receiving thread, so that they do not contend
+     * on its lock; a buffer is held by the searches of its packet,
+     * so the data of files is searched for where it was received */
+    packet_pool *buffers;
+
+    /* sessions by the address of the client and the session id */
+    session_table *table;
+
+    /* the list of sessions by `receive_time`, the least recent first */
+    server_session *first;
+    server_session *last;
+
+    /* the last `N_RECENT_SESSIONS` ended sessions,
+     * the next one goes to `recent[n_recent % N_RECENT_SESSIONS]` */
+    ended_session recent[N_RECENT_SESSIONS];
+    unsigned long n_recent;
+
+    /* ended sessions to start new ones with, linked by `next` */
+    server_session *spare;
+    unsigned int n_spare;
+
+    /* for statistics */
+    unsigned long n_started;
+    unsigned long n_ended;
+    unsigned long n_idle; /* of the ended sessions, by the idle timeout */
+} session_set;
+
+void session_set_init( session_set *sessions,
+                       search_handler *search_handler0 )
+{
+    sessions->search_handler0 = search_handler0;
+    sessions->buffers = packet_pool_new(UDP_SIZE);
+    /* enough for the receive batch and the queued searches */
+    packet_pool_set_high_water(sessions->buffers,
+                               PACKET_BATCH_SIZE + SEARCH_POOL_CAPACITY);
+    sessions->table = session_table_new();
+    sessions->first = NULL;
+    sessions->last = NULL;
+    sessions->n_recent = 0;
+    sessions->spare = NULL;
+    sessions->n_spare = 0;
+    sessions->n_started = 0;
+    sessions->n_ended = 0;
+    sessions->n_idle = 0;
+}
+
+/**
+ * Remove `session` from the list of sessions by `receive_time`. */
+void session_set_unlink( session_set *sessions, server_session *session )
+{
+    if( session->prev != NULL ) session->prev->next = session->next;
+    else sessions->first = session->next;
+    if( session->next != NULL ) session->next->prev = session->prev;
+    else sessions->last = session->prev;
+}
 
-        packet.size = packet_size;
-        packet.data = packet_buffer.data;
-        packet_type = get_packet_type(packet);
-        if( packet_type < 0 )
+/**
+ * Record that a packet of `session` was received at `time`. */
+void session_set_touch( session_set *sessions, server_session *session,
+                        double time )
+{
+    session->receive_time = time;
+    if( sessions->last == session ) return;
+    session_set_unlink(sessions, session);
+    session->prev = sessions->last;
+    session->next = NULL;
+    sessions->last->next = session;
+    sessions->last = session;
+}
+
+/**
+ * Return whether the session of `session_id` from `address`
+ * is one of the last ended sessions. */
+int session_set_is_recent( session_set *sessions, struct sockaddr *address,
+                           socklen_t address_length, unsigned int session_id )
+{
+    unsigned long n = sessions->n_recent < N_RECENT_SESSIONS
+        ? sessions->n_recent : N_RECENT_SESSIONS;
+    unsigned long i;
+    for( i = 0; i < n; i++ )
+    {
+        ended_session *ended = &sessions->recent[i];
+        if( ended->session_id == session_id
+            && ended->address_length == address_length
+            && memcmp(&ended->address, address, address_length) == 0 )
         {
-            printf("Received an invalid packet.\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Return a new session of `session_id` from `address`,
+ * or `NULL` if there are `MAX_SESSIONS` sessions already,
+ * it is one of the last ended sessions
+ * or its match list file could not be opened. */
+server_session *session_set_start( session_set *sessions,
+                                   struct sockaddr *address,
+                                   socklen_t address_length,
+                                   unsigned int session_id, double time )
+{
+    server_session *session;
+    match_output *output;
+    if( sessions->table->size >= MAX_SESSIONS )
+    {
+        printf("Too many sessions, dropping a packet of a new one.\n");
+        return NULL;
+    }
+    if( session_set_is_recent(sessions, address, address_length,
+                              session_id) )
+    {
+        printf("Dropping a late packet of the ended session %u.\n",
+               session_id);
+        return NULL;
+    }
+    if( search_handler_open_output(sessions->search_handler0, &output) != 0 )
+    {
+        printf("Dropping a packet of a new session.\n");
+        return NULL;
+    }
+    printf("Starting the session %u.\n", session_id);
+    if( sessions->spare != NULL )
+    {
+        /* its buffers are empty, but keep their memory */
+        session = sessions->spare;
+        sessions->spare = session->next;
+        sessions->n_spare--;
+    }
+    else
+    {
+        session = malloc_check(sizeof(server_session));
+        reorder_buffer_init(&session->reorder_buffer0, sessions->buffers);
+        file_assembly_init(&session->assembly);
+    }
+    memcpy(&session->address, address, address_length);
+    session->address_length = address_length;
+    session->session_id = session_id;
+    session->last_seq_n = seq_n_neg(1);
+    session->output = output;
+    session->receive_time = time;
+    session->prev = sessions->last;
+    session->next = NULL;
+    if( sessions->last != NULL ) sessions->last->next = session;
+    else sessions->first = session;
+    sessions->last = session;
+    session_table_insert(sessions->table, address, address_length,
+                         session_id, session);
+    sessions->n_started++;
+    return session;
+}
+
+/**
+ * End `session`, keeping it for a new session or freeing it.
+ * Its match list file is complete once its queued searches are finished. */
+void session_set_end( session_set *sessions, server_session *session )
+{
+    ended_session *ended;
+    if( session->assembly.data.data != NULL )
+    {
+        printf("Dropping an incomplete file.\n");
+    }
+    session_table_delete(sessions->table,
+                         (struct sockaddr *)&session->address,
+                         session->address_length, session->session_id);
+    session_set_unlink(sessions, session);
+    ended = &sessions->recent[sessions->n_recent++ % N_RECENT_SESSIONS];
+    memcpy(&ended->address, &session->address, session->address_length);
+    ended->address_length = session->address_length;
+    ended->session_id = session->session_id;
+    /* an error is reported and the searches of other sessions go on */
+    search_handler_release_output(sessions->search_handler0, session->output);
+    file_assembly_clear(&session->assembly);
+    if( sessions->n_spare < MAX_SPARE_SESSIONS )
+    {
+        reorder_buffer_reset(&session->reorder_buffer0);
+        session->next = sessions->spare;
+        sessions->spare = session;
+        sessions->n_spare++;
+    }
+    else
+    {
+        reorder_buffer_clear(&session->reorder_buffer0);
+        free(session);
+    }
+    /* the buffers a burst of packets took are given back to the system */
+    packet_pool_trim(sessions->buffers);
+    sessions->n_ended++;
+}
+
+/**
+ * End the sessions without packets since `SESSION_IDLE_TIMEOUT`
+ * before `time`. */
+void session_set_end_idle( session_set *sessions, double time )
+{
+    while( sessions->first != NULL
+           && time - sessions->first->receive_time > SESSION_IDLE_TIMEOUT )
+    {
+        printf("The session %u is idle, ending it.\n",
+               sessions->first->session_id);
+        session_set_end(sessions, sessions->first);
+        sessions->n_idle++;
+    }
+}
+
+/**
+ * End all sessions and free the set. */
+void session_set_clear( session_set *sessions )
+{
+    while( sessions->first != NULL )
+    {
+        session_set_end(sessions, sessions->first);
+    }
+    while( sessions->spare != NULL )
+    {
+        server_session *session = sessions->spare;
+        sessions->spare = session->next;
+        reorder_buffer_clear(&session->reorder_buffer0);
+        free(session);
+    }
+    session_table_free(sessions->table);
+    /* queued searches may still hold buffers */
+    packet_pool_release(sessions->buffers);
+}
+
+/**
+ * Handle the data packet `packet` of `session`, searching for the files
+ * in the packets now in order, and add the ACK packet answering it,
+ * if any, to `acks`. `packet` is in `buffer`, a receive buffer of the session.
+ * Return a non-zero number if an error happened. */
+int receive_data( search_handler *search_handler0, server_session *session,
+                  sized_data packet, void *buffer, packet_batch *acks )
+{
+    int send_ack;
+    seq_n_t seq_n = get_packet_seq_n(packet.data);
+    int selective = is_packet_selective(packet.data);
+    printf("Received a data packet with seq_n = %u, req_n = %d.\n",
+           (unsigned int)seq_n, get_packet_req_n(packet.data));
+
+    if( selective )
+    {
+        if( receive_selective(search_handler0, session->output,
+                              &session->assembly, &session->reorder_buffer0,
+                              packet, buffer, &session->last_seq_n,
+                              &send_ack) != 0 )
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        /* If `seq_n` of the received packet is next
+         * to the last received, perform a file search.
+         * Other packets are dropped, but still acknowledged:
+         * duplicate ACK packets tell the client
+         * that a packet is missing before its timer expires. */
+        if( seq_n == seq_n_add(session->last_seq_n, 1) )
+        {
+            session->last_seq_n = seq_n;
+            if( search_packet(search_handler0, session->output,
+                              &session->assembly, packet,
+                              session->reorder_buffer0.pool, buffer) != 0 )
+            {
+                return 1;
+            }
+        }
+        send_ack = 1;
+    }
+
+    if( send_ack )
+    {
+        sized_data ack = packet_batch_next_buffer(acks);
+        size_t ack_size;
+        if( selective )
+        {
+            printf("Sending a selective ACK packet"
+                   " with ack_seq_n = %u, seq_n = %u.\n",
+                   (unsigned int)session->last_seq_n, (unsigned int)seq_n);
+            init_selective_ack_packet(ack, session->last_seq_n, seq_n);
+            ack_size = set_packet_sack_size(
+                ack, reorder_buffer_write_sack(
+                    &session->reorder_buffer0, session->last_seq_n,
+                    get_packet_sack_p(ack.data)));
         }
         else
         {
+            printf("Sending an ACK packet with seq_n = %u.\n",
+                   (unsigned int)session->last_seq_n);
+            ack_size = init_ack_packet(ack, session->last_seq_n);
+        }
+        set_packet_session_id(ack.data, session->session_id);
+        ack.size = ack_size;
+        packet_batch_add(acks, ack, (struct sockaddr *)&session->address,
+                         session->address_length);
+    }
+    printf("The last received seq_n is %u.\n",
+           (unsigned int)session->last_seq_n);
+    return 0;
+}
+
+/**
+ * Serve clients on `udp_socket`, each datagram goes to the session
+ * of its address and session id, until all sessions of `quota` ended
+ * or a signal stopped the server.
+ * If `gro`, the socket has `UDP_OFFLOAD_GRO`.
+ * The sessions are only seen by the calling thread.
+ * Return a non-zero number if an error happened. */
+int handle_sessions( int udp_socket, int gro, search_handler *search_handler0,
+                     session_quota *quota )
+{
+    int error = 0;
+    /* whether all sessions of `quota` ended */
+    int done = session_quota_add(quota, 0);
+    session_set sessions;
+    struct timeval receive_timeout;
+
+    /* All datagrams ready in the socket are received with one system call,
+     * the ACK packets answering them are sent with one system call. */
+    packet_batch *received;
+    packet_batch *acks =
+        packet_batch_new(PACKET_BATCH_SIZE,
+                         get_ack_packet_size() + MAX_SACK_SIZE);
+    session_set_init(&sessions, search_handler0);
+    received = packet_batch_new_pooled(PACKET_BATCH_SIZE, sessions.buffers);
+    if( gro ) packet_batch_enable_gro(received);
+
+    /* wake up now and then to end idle sessions and to see `stop_signal` */
+    receive_timeout.tv_sec = 1;
+    receive_timeout.tv_usec = 0;
+    if( setsockopt(udp_socket, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout,
+                   sizeof(receive_timeout)) != 0 )
+    {
+        perror("handle_sessions, setsockopt");
+    }
+
+    while( error == 0 && !done && stop_signal == 0 )
+    {
+        unsigned int i;
+        double time;
+        int n_received =
+            packet_batch_receive(received, udp_socket, MSG_WAITFORONE);
+        if( n_received < 0 )
+        {
+            error = 1;
+            break;
+        }
+        time = get_seconds();
+
+        for( i = 0; i < (unsigned int)n_received && !done; i++ )
+        {
+            socklen_t remote_address_length;
+            struct sockaddr *remote_address = packet_batch_get_address(
+                received, i, &remote_address_length);
+            sized_data packet = packet_batch_get(received, i);
+            int packet_type = get_packet_type(packet);
+            server_session *session;
+            unsigned int session_id;
+            if( packet_type < 0 )
+            {
+                printf("Received an invalid packet.\n");
+                continue;
+            }
+            session_id = get_packet_session_id(packet.data);
+            session = session_table_find(sessions.table, remote_address,
+                                         remote_address_length, session_id);
             if( packet_type == PACKET_TYPE_EOT )
             {
-                printf("Received a EOT packet.\n");
-                break;
+                if( session == NULL )
+                {
+                    printf("Received a EOT packet of no session.\n");
+                }
+                else
+                {
+                    printf("Received a EOT packet,"
+                           " ending the session %u.\n", session_id);
+                    session_set_end(&sessions, session);
+                    done = session_quota_add(quota, 1);
+                }
             }
             else if( packet_type == PACKET_TYPE_DATA )
             {
-                int send_ack;
-                seq_n_t seq_n = ((prot_header *)packet.data)->seq_n;
-                printf("Received a data packet with seq_n = %u, req_n = %d.\n",
-                       (unsigned int)seq_n, get_packet_req_n(packet.data));
-                
-                if( seq_n == last_seq_n ) send_ack = 1;
-                else if ( seq_n == seq_n_add(last_seq_n, 1) )
+                if( session == NULL )
                 {
-                    packet_payload_p payload_p;
-                    /* If `seq_n` of the received packet is next
-                     * to the last received, perform a file search. */
-                    last_seq_n = seq_n;
-                    send_ack = 1;
-
-                    payload_p = get_packet_payload_p(packet);
-                    if( payload_p.error != 0 )
-                    {
-                        printf("The data packet is invalid, error: %d\n",
-                               payload_p.error);
-                    }
-                    else
-                    {
-                        printf("Searching for the file, remote file name: %s\n",
-                               (char *)payload_p.file_name.data);
-                        if( search_handler_search(search_handler0,
-                                                  payload_p.file_name.data,
-                                                  payload_p.data) != 0 )
-                        {
-                            error = 3;
-                            break;
-                        }
-                    }
+                    session = session_set_start(&sessions, remote_address,
+                                                remote_address_length,
+                                                session_id, time);
+                    if( session == NULL ) continue;
                 }
-                else send_ack = 0;
-                
-                if( send_ack )
+                session_set_touch(&sessions, session, time);
+                /* with GRO, more datagrams than that may be received */
+                if( packet_batch_is_full(acks)
+                    && packet_batch_send(acks, udp_socket) != 0 )
                 {
-                    printf("Sending an ACK packet with seq_n = %u.\n",
-                           (unsigned int)last_seq_n);
-                    init_ack_packet(packet_buffer, last_seq_n);
-                    if ( send_packet(udp_socket, packet_buffer.data,
-                                     get_ack_packet_size(), 0,
-                                     (struct sockaddr *)&remote_address,
-                                     remote_address_length) == -1 )
-                    {
-                        perror("send ACK packet");
-                        error = 2;
-                        break;
-                    }
-                    
+                    error = 2;
+                    break;
+                }
+                if( receive_data(search_handler0, session, packet,
+                                 packet_batch_get_buffer(received, i),
+                                 acks) != 0 )
+                {
+                    error = 3;
+                    break;
                 }
-                printf("The last received seq_n is %u.\n",
-                       (unsigned int)last_seq_n);
             }
             else
             {
@@ -251,48 +1473,268 @@ int handle_session( int udp_socket, search_handler *search_handler0 )
                        packet_type);
             }
         }
+
+        if( packet_batch_send(acks, udp_socket) != 0 && error == 0 )
+        {
+            error = 2;
+        }
+        session_set_end_idle(&sessions, time);
+        /* sessions may also have ended in other threads */
+        done = session_quota_add(quota, 0) || done;
     }
-    free(packet_buffer.data);
+    printf("Sessions: %lu started, %lu ended, %lu of them idle.\n",
+           sessions.n_started, sessions.n_ended, sessions.n_idle);
+    packet_batch_free(received);
+    session_set_clear(&sessions);
+    packet_batch_free(acks);
     return error;
 }
 
+/**
+ * A thread of the server receiving on its own socket. */
+typedef struct
+{
+    int udp_socket;
+    int gro; /* whether `udp_socket` has `UDP_OFFLOAD_GRO` */
+    search_handler *search_handler0;
+    session_quota *quota;
+    pthread_t thread;
+    int error;
+} receive_thread;
+
+void *receive_thread_run( void *thread0 )
+{
+    receive_thread *thread = thread0;
+    thread->error = handle_sessions(thread->udp_socket, thread->gro,
+                                    thread->search_handler0, thread->quota);
+    return NULL;
+}
+
+/**
+ * Serve clients on the port `local_port` until `n_sessions` sessions
+ * ended with EOT, or forever if `n_sessions` is `0`.
+ * Unless `n_threads` is `1`, that many threads receive datagrams
+ * on their own sockets bound to the same port,
+ * each one with its own sessions.
+ * If `gro`, datagrams coalesced by the system are received with GRO
+ * where it is supported.
+ * Return a non-zero number if an error happened. */
+int serve( in_port_t local_port, search_handler *search_handler0,
+           unsigned long n_sessions, unsigned int n_threads, int gro )
+{
+    int offload = gro ? UDP_OFFLOAD_GRO : 0;
+    int error = 0;
+    session_quota quota;
+    receive_thread *threads;
+    unsigned int n_started;
+    unsigned int i;
+    session_quota_init(&quota, n_sessions);
+    if( n_threads == 1 )
+    {
+        int udp_socket = new_udp_socket(local_port, 0, &offload);
+        if( udp_socket < 0 ) error = 1;
+        else
+        {
+            error = handle_sessions(udp_socket, offload != 0,
+                                    search_handler0, &quota);
+            close(udp_socket);
+        }
+        session_quota_clear(&quota);
+        return error;
+    }
+
+    /* all sockets are bound before datagrams are received */
+    threads = malloc_check(n_threads * sizeof(receive_thread));
+    for( i = 0; i < n_threads; i++ )
+    {
+        int offload1 = offload;
+        threads[i].udp_socket = error == 0
+            ? new_udp_socket(local_port, 1, &offload1) : -1;
+        threads[i].gro = offload1 != 0;
+        threads[i].search_handler0 = search_handler0;
+        threads[i].quota = &quota;
+        threads[i].error = 0;
+        if( threads[i].udp_socket < 0 ) error = 1;
+    }
+    if( error != 0 )
+    {
+        for( i = 0; i < n_threads; i++ )
+        {
+            if( threads[i].udp_socket >= 0 ) close(threads[i].udp_socket);
+        }
+        free(threads);
+        session_quota_clear(&quota);
+        return error;
+    }
+
+    printf("Receiving in %u threads.\n", n_threads);
+    for( n_started = 0; n_started < n_threads; n_started++ )
+    {
+        int thread_error = pthread_create(&threads[n_started].thread, NULL,
+                                          receive_thread_run,
+                                          &threads[n_started]);
+        if( thread_error != 0 )
+        {
+            errno = thread_error;
+            perror("serve, pthread_create");
+            error = 2;
+            /* the started threads still have to serve all sessions */
+            break;
+        }
+    }
+    for( i = 0; i < n_started; i++ )
+    {
+        pthread_join(threads[i].thread, NULL);
+        if( threads[i].error != 0 ) error = 3;
+    }
+    for( i = 0; i < n_threads; i++ ) close(threads[i].udp_socket);
+    free(threads);
+    session_quota_clear(&quota);
+    return error;
+}
+
+/**
+ * Stop serving, the receiving threads see it within a second. */
+void handle_stop_signal( int signal_number )
+{
+    stop_signal = signal_number;
+}
+
+/**
+ * Make SIGINT and SIGTERM stop the server cleanly:
+ * queued searches are finished and the index is saved.
+ * Return a non-zero number if an error happened. */
+int set_stop_signal_handler( void )
+{
+    struct sigaction action;
+    action.sa_handler = handle_stop_signal;
+    sigemptyset(&action.sa_mask);
+    /* without `SA_RESTART`, a blocked receive returns at once */
+    action.sa_flags = 0;
+    if( sigaction(SIGINT, &action, NULL) != 0
+        || sigaction(SIGTERM, &action, NULL) != 0 )
+    {
+        perror("set_stop_signal_handler, sigaction");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Print the command line of the server with its options. */
+void print_usage( void )
+{
+    static const char *lines[] = {
+        "Usage: server.x [options] <port> <directory> <match list file>",
+        "  -n <n>   exit after n sessions ended with EOT, 0 never (1)",
+        "  -D       serve until stopped, each session into its own"
+        " match list",
+        "           file <match list file>.<n>, as with -n 0",
+        "  -t <n>   receive in n threads on sockets of the same port (1)",
+        "  -j <n>   search in n threads, 0 in the receiving threads (4)",
+        "  -R       read the directory for each search, without an index",
+        "  -I <f>   keep the index in the file f,"
+        " reading only changed files",
+        "  -W       keep the index up to date while the directory changes",
+        "  -U       read files with blocking calls instead of io_uring",
+        "  -G       receive datagrams one by one, without UDP_GRO"
+    };
+    unsigned int i;
+    for( i = 0; i < sizeof(lines) / sizeof(lines[0]); i++ )
+    {
+        printf("%s\n", lines[i]);
+    }
+}
+
 int main( int argc, char *argv[] )
 {
     int error = 0;
+    int rescan = 0; /* read the directory for each search, no index */
+    char *index_file_name = NULL;
+    int watch = 0; /* keep the index up to date with the directory */
+    /* `0` to search in the receiving thread */
+    unsigned int n_search_threads = SEARCH_POOL_DEFAULT_THREADS;
+    /* the number of sessions to serve, `0` to serve forever,
+     * sessions ended by the idle timeout do not count */
+    unsigned long n_sessions = 1;
+    int n_sessions_given = 0;
+    unsigned int n_receive_threads = 1;
+    /* serve until stopped, each session into its own match list file */
+    int daemon_mode = 0;
+    int gro = 1; /* receive datagrams coalesced by the system at once */
+    int option;
+    while( (option = getopt(argc, argv, "DRI:Wj:n:t:UG")) != -1 )
+    {
+        if( option == 'D' ) daemon_mode = 1;
+        /* read files with blocking calls instead of io_uring */
+        else if( option == 'U' ) file_ring_set_enabled(0);
+        /* receive datagrams one by one, without GRO */
+        else if( option == 'G' ) gro = 0;
+        else if( option == 'R' ) rescan = 1;
+        else if( option == 'I' ) index_file_name = optarg;
+        else if( option == 'W' ) watch = 1;
+        else if( option == 'j' ) n_search_threads = strtoul(optarg, NULL, 10);
+        else if( option == 'n' )
+        {
+            n_sessions = strtoul(optarg, NULL, 10);
+            n_sessions_given = 1;
+        }
+        else if( option == 't' )
+        {
+            n_receive_threads = strtoul(optarg, NULL, 10);
+            if( n_receive_threads == 0 ) error = 1;
+        }
+        else error = 1;
+    }
+
+    if( error != 0 )
+    {
+        printf("Invalid command-line options.\n");
+        print_usage();
+    }
     /* because we call `send_packet` */
-    if( srand48_from_time() != 0 ) {
+    else if( srand48_from_time() != 0 ) {
         printf("Error when initializing PRNG.\n");
         error = 2;
     }
+    else if( set_stop_signal_handler() != 0 ) error = 2;
     else
     {
         /* Assuming we have the command-line arguments as in the specification.
-         * The first element of `argv` is the whole command line. */
-        if( argc != 4 )
+         * `optind` is the index of the first non-option argument. */
+        if( argc - optind != 3 )
         {
             printf("Expected 3 command-line arguments.\n");
+            print_usage();
             error = 1;
         }
         else
         {
-            in_port_t local_port = htons(strtol(argv[1], NULL, 10));
-            char *compare_dir_name = argv[2];
-            char *match_file_name = argv[3];
+            in_port_t local_port = htons(strtol(argv[optind], NULL, 10));
+            char *compare_dir_name = argv[optind + 1];
+            char *match_file_name = argv[optind + 2];
 
-            int udp_socket = new_udp_socket(local_port);
-            if( udp_socket >= 0 )
+            search_handler *search_handler0;
+            if( daemon_mode && !n_sessions_given ) n_sessions = 0;
+            search_handler0 = search_handler_new(
+                compare_dir_name, match_file_name, daemon_mode, rescan,
+                index_file_name, watch, n_search_threads);
+            if( search_handler0 != NULL )
             {
-                search_handler *search_handler0 =
-                    search_handler_new(compare_dir_name, match_file_name);
-                if( search_handler0 != NULL )
+                if( serve(local_port, search_handler0, n_sessions,
+                          n_receive_threads, gro) != 0 )
+                {
+                    error = 3;
+                }
+                if( stop_signal != 0 )
+                {
+                    printf("Stopped by the signal %d.\n", (int)stop_signal);
+                }
+                /* queued searches are finished */
+                if( search_handler_free(search_handler0) != 0 )
                 {
-                    if( handle_session(udp_socket, search_handler0) != 0 )
-                    {
-                        error = 3;
-                    }
-                    search_handler_free(search_handler0);
+                    error = 3;
                 }
-                close(udp_socket);
             }
         }
     }
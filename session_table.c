@@ -0,0 +1,158 @@
+#include <string.h>
+
+#include "common.h"
+#include "session_table.h"
+
+/* 64-bit FNV-1a parameters */
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325UL
+#define FNV_PRIME 0x100000001b3UL
+
+/**
+ * Return the hash of a session key.
+ * Unused bytes of addresses are zeroed by the system,
+ * so the whole address is hashed and compared. */
+static unsigned long hash_key( struct sockaddr *address,
+                               socklen_t address_length,
+                               unsigned int session_id )
+{
+    unsigned long hash = FNV_OFFSET_BASIS;
+    unsigned char *bytes = (unsigned char *)address;
+    socklen_t i;
+    for( i = 0; i < address_length; i++ )
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    hash ^= session_id;
+    hash *= FNV_PRIME;
+    /* the low bits choose the bucket, mix the high ones in */
+    return hash ^ (hash >> 29);
+}
+
+static int node_equal( session_table_node *node, struct sockaddr *address,
+                       socklen_t address_length, unsigned int session_id )
+{
+    return node->session_id == session_id
+        && node->address_length == address_length
+        && memcmp(&node->address, address, address_length) == 0;
+}
+
+/**
+ * Return the link to the node of the session in its bucket,
+ * pointing to `NULL` if there is no such node. */
+static session_table_node **find_link( session_table *table,
+                                       struct sockaddr *address,
+                                       socklen_t address_length,
+                                       unsigned int session_id )
+{
+    session_table_node **link = &table->buckets[
+        hash_key(address, address_length, session_id)
+        & (table->n_buckets - 1)];
+    while( *link != NULL
+           && !node_equal(*link, address, address_length, session_id) )
+    {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * Double the number of buckets, moving the nodes into the new ones. */
+static void grow( session_table *table )
+{
+    session_table_node **old_buckets = table->buckets;
+    unsigned long old_n_buckets = table->n_buckets;
+    unsigned long i;
+    table->n_buckets *= 2;
+    table->buckets =
+        malloc_check(table->n_buckets * sizeof(session_table_node *));
+    for( i = 0; i < table->n_buckets; i++ ) table->buckets[i] = NULL;
+    for( i = 0; i < old_n_buckets; i++ )
+    {
+        while( old_buckets[i] != NULL )
+        {
+            session_table_node *node = old_buckets[i];
+            session_table_node **bucket = &table->buckets[
+                hash_key((struct sockaddr *)&node->address,
+                         node->address_length, node->session_id)
+                & (table->n_buckets - 1)];
+            old_buckets[i] = node->next;
+            node->next = *bucket;
+            *bucket = node;
+        }
+    }
+    free(old_buckets);
+}
+
+session_table *session_table_new( void )
+{
+    session_table *table = malloc_check(sizeof(session_table));
+    unsigned long i;
+    table->size = 0;
+    table->n_buckets = 16;
+    table->buckets =
+        malloc_check(table->n_buckets * sizeof(session_table_node *));
+    for( i = 0; i < table->n_buckets; i++ ) table->buckets[i] = NULL;
+    return table;
+}
+
+void session_table_free( session_table *table )
+{
+    unsigned long i;
+    for( i = 0; i < table->n_buckets; i++ )
+    {
+        while( table->buckets[i] != NULL )
+        {
+            session_table_node *node = table->buckets[i];
+            table->buckets[i] = node->next;
+            free(node);
+        }
+    }
+    free(table->buckets);
+    free(table);
+}
+
+void *session_table_find( session_table *table, struct sockaddr *address,
+                          socklen_t address_length, unsigned int session_id )
+{
+    session_table_node *node =
+        *find_link(table, address, address_length, session_id);
+    return node == NULL ? NULL : node->session;
+}
+
+void session_table_insert( session_table *table, struct sockaddr *address,
+                           socklen_t address_length, unsigned int session_id,
+                           void *session )
+{
+    session_table_node **bucket;
+    session_table_node *node = malloc_check(sizeof(session_table_node));
+    if( address_length > sizeof(node->address) )
+    {
+        fputs("session_table_insert: The address is too long.\n", stderr);
+        error_exit();
+    }
+    if( table->size == table->n_buckets ) grow(table);
+    memset(&node->address, 0, sizeof(node->address));
+    memcpy(&node->address, address, address_length);
+    node->address_length = address_length;
+    node->session_id = session_id;
+    node->session = session;
+    bucket = &table->buckets[hash_key(address, address_length, session_id)
+                             & (table->n_buckets - 1)];
+    node->next = *bucket;
+    *bucket = node;
+    table->size++;
+}
+
+void session_table_delete( session_table *table, struct sockaddr *address,
+                           socklen_t address_length,
+                           unsigned int session_id )
+{
+    session_table_node **link =
+        find_link(table, address, address_length, session_id);
+    session_table_node *node = *link;
+    if( node == NULL ) return;
+    *link = node->next;
+    free(node);
+    table->size--;
+}
@@ -0,0 +1,59 @@
+/**
+ * Hash table of sessions by the address of the client
+ * and the session id chosen by it, with separate chaining.
+ * Sessions are found, added and removed in O(1) on average.
+ * For the Server. */
+
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <sys/socket.h>
+
+#include "common.h"
+
+typedef struct session_table_node
+{
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    unsigned int session_id;
+    void *session; /* owned by the user */
+    struct session_table_node *next; /* in the same bucket */
+} session_table_node;
+
+typedef struct
+{
+    unsigned long size; /* the number of sessions */
+
+    /* a power of 2, not less than `size` */
+    unsigned long n_buckets;
+    session_table_node **buckets;
+} session_table;
+
+/**
+ * Return a new empty table. */
+session_table *session_table_new( void );
+
+/**
+ * Free the table, but not the sessions in it. */
+void session_table_free( session_table *table );
+
+/**
+ * Return the session of `session_id` from `address`,
+ * or `NULL` if there is no such session. */
+void *session_table_find( session_table *table, struct sockaddr *address,
+                          socklen_t address_length, unsigned int session_id );
+
+/**
+ * Add `session` of `session_id` from `address`,
+ * which must not be in the table. */
+void session_table_insert( session_table *table, struct sockaddr *address,
+                           socklen_t address_length, unsigned int session_id,
+                           void *session );
+
+/**
+ * Remove the session of `session_id` from `address`, if there is one. */
+void session_table_delete( session_table *table, struct sockaddr *address,
+                           socklen_t address_length,
+                           unsigned int session_id );
+
+#endif
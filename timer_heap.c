@@ -0,0 +1,114 @@
+#include <limits.h>
+#include <string.h>
+
+#include "timer_heap.h"
+
+#define TIMER_HEAP_INITIAL_CAPACITY 16
+
+/**
+ * Timers with equal deadlines are ordered by `seq_n`,
+ * so that packets sent together are resent in their order. */
+static int timer_heap_less( timer_heap_el *x, timer_heap_el *y )
+{
+    if( x->deadline.tv_sec != y->deadline.tv_sec )
+    {
+        return x->deadline.tv_sec < y->deadline.tv_sec;
+    }
+    if( x->deadline.tv_nsec != y->deadline.tv_nsec )
+    {
+        return x->deadline.tv_nsec < y->deadline.tv_nsec;
+    }
+    return x->seq_n != y->seq_n
+        && seq_n_subtract(y->seq_n, x->seq_n) <= UINT_MAX / 2;
+}
+
+static void timer_heap_swap( timer_heap *heap, unsigned long i,
+                             unsigned long j )
+{
+    timer_heap_el el = heap->els[i];
+    heap->els[i] = heap->els[j];
+    heap->els[j] = el;
+}
+
+timer_heap *timer_heap_new( void )
+{
+    timer_heap *r = malloc_check(sizeof(timer_heap));
+    r->size = 0;
+    r->capacity = TIMER_HEAP_INITIAL_CAPACITY;
+    r->els = malloc_check(r->capacity * sizeof(timer_heap_el));
+    return r;
+}
+
+void timer_heap_free( timer_heap *heap )
+{
+    free(heap->els);
+    free(heap);
+}
+
+void timer_heap_insert( timer_heap *heap, timer_heap_el el )
+{
+    unsigned long i;
+    if( heap->size == heap->capacity )
+    {
+        timer_heap_el *els =
+            malloc_check(2 * heap->capacity * sizeof(timer_heap_el));
+        memcpy(els, heap->els, heap->size * sizeof(timer_heap_el));
+        free(heap->els);
+        heap->els = els;
+        heap->capacity *= 2;
+    }
+
+    /* sift up */
+    i = heap->size++;
+    heap->els[i] = el;
+    while( i != 0 )
+    {
+        unsigned long parent = (i - 1) / 2;
+        if( !timer_heap_less(&heap->els[i], &heap->els[parent]) ) break;
+        timer_heap_swap(heap, i, parent);
+        i = parent;
+    }
+}
+
+timer_heap_el *timer_heap_first( timer_heap *heap )
+{
+    if( heap->size == 0 )
+    {
+        fputs("timer_heap_first: The heap must be non-empty.\n", stderr);
+        error_exit();
+    }
+    return &heap->els[0];
+}
+
+void timer_heap_delete_first( timer_heap *heap )
+{
+    unsigned long i = 0;
+    if( heap->size == 0 )
+    {
+        fputs("timer_heap_delete_first: The heap must be non-empty.\n",
+              stderr);
+        error_exit();
+    }
+    heap->els[0] = heap->els[--heap->size];
+
+    /* sift down */
+    while( 1 )
+    {
+        unsigned long least = i;
+        unsigned long child = 2 * i + 1;
+        if( child < heap->size
+            && timer_heap_less(&heap->els[child], &heap->els[least]) )
+        {
+            least = child;
+        }
+        child++;
+        if( child < heap->size
+            && timer_heap_less(&heap->els[child], &heap->els[least]) )
+        {
+            least = child;
+        }
+        if( least == i ) break;
+        timer_heap_swap(heap, i, least);
+        i = least;
+    }
+}
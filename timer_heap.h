@@ -0,0 +1,48 @@
+/**
+ * Binary min-heap of timers ordered by deadline, then by `seq_n`.
+ * The earliest deadline is found in O(1), timers are added and removed
+ * in O(log n). Timers are not cancelled, the user recognizes stale timers
+ * when they reach the top and removes them.
+ * For the Client. */
+
+#ifndef TIMER_HEAP_H
+#define TIMER_HEAP_H
+
+#include <time.h>
+
+#include "protocol.h"
+
+/**
+ * element of `timer_heap` */
+typedef struct
+{
+    struct timespec deadline;
+    seq_n_t seq_n; /* of the packet the timer is for */
+} timer_heap_el;
+
+typedef struct
+{
+    unsigned long size;
+    unsigned long capacity;
+    timer_heap_el *els; /* `els[0]` has the earliest deadline */
+} timer_heap;
+
+/**
+ * Return a new empty heap. */
+timer_heap *timer_heap_new( void );
+
+void timer_heap_free( timer_heap *heap );
+
+void timer_heap_insert( timer_heap *heap, timer_heap_el el );
+
+/**
+ * Return the timer with the earliest deadline.
+ * The heap must be non-empty. */
+timer_heap_el *timer_heap_first( timer_heap *heap );
+
+/**
+ * Remove the timer with the earliest deadline.
+ * The heap must be non-empty. */
+void timer_heap_delete_first( timer_heap *heap );
+
+#endif